@@ -6,6 +6,14 @@
 #include "NimBLEDis.h"
 #include "NimBLELog.h"
 
+#include <esp_idf_version.h>
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+# include <esp_app_desc.h>
+#else
+# include <esp_ota_ops.h>
+# define esp_app_get_description esp_ota_get_app_description
+#endif
+
 #define BLE_DIS_SERVICE_UUID               (uint16_t)0x180a
 #define BLE_DIS_SYSTEM_ID_CHR_UUID         (uint16_t)0x2A23
 #define BLE_DIS_MODEL_NUMBER_CHR_UUID      (uint16_t)0x2A24
@@ -26,9 +34,7 @@ bool NimBLEDis::createDisChar(const NimBLEUUID& uuid, const uint8_t* value, uint
     }
 
     if (m_pDisService->getCharacteristic(uuid)) {
-        NIMBLE_LOGE(LOG_TAG,
-                    "%s - Characteristic value already set",
-                    NimBLEUUID(BLE_DIS_MODEL_NUMBER_CHR_UUID).toString().c_str());
+        NIMBLE_LOGE(LOG_TAG, "%s - Characteristic value already set", uuid.toString().c_str());
         return false;
     }
 
@@ -39,11 +45,6 @@ bool NimBLEDis::createDisChar(const NimBLEUUID& uuid, const uint8_t* value, uint
     }
 
     pChar->setValue(value, length);
-    if (memcmp(pChar->getValue(), value, length) != 0) {
-        NIMBLE_LOGE(LOG_TAG, "Failed to set characteristic value");
-        return false;
-    }
-
     return true;
 }
 
@@ -58,6 +59,7 @@ bool NimBLEDis::setModelNumber(const char* value) {
 bool NimBLEDis::setSerialNumber(const char* value) {
     if (createDisChar(BLE_DIS_SERIAL_NUMBER_CHR_UUID, reinterpret_cast<const uint8_t*>(value), strlen(value))) {
         NIMBLE_LOGI(LOG_TAG, "Serial Number set to: %s", value);
+        return true;
     }
     return false;
 }
@@ -118,7 +120,108 @@ bool NimBLEDis::setPnp(uint8_t src, uint16_t vid, uint16_t pid, uint16_t ver) {
     return false;
 }
 
+/**
+ * @brief Serves a table characteristic, the value is appended to the response from where it is stored.
+ */
+static int disTableAccessCb(uint16_t connHandle, uint16_t attrHandle, struct ble_gatt_access_ctxt* ctxt, void* arg) {
+    const NimBLEDisEntry* pEntry = static_cast<const NimBLEDisEntry*>(arg);
+    const char*           pStr   = nullptr;
+    size_t                maxLen = 0;
+    if (ctxt->op != BLE_GATT_ACCESS_OP_READ_CHR) {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    switch (pEntry->source) {
+        case NimBLEDisEntry::Bytes:
+            return os_mbuf_append(ctxt->om, pEntry->pValue, pEntry->length) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        case NimBLEDisEntry::AppVersion:
+            pStr   = esp_app_get_description()->version;
+            maxLen = sizeof(esp_app_get_description()->version);
+            break;
+        case NimBLEDisEntry::AppName:
+            pStr   = esp_app_get_description()->project_name;
+            maxLen = sizeof(esp_app_get_description()->project_name);
+            break;
+        case NimBLEDisEntry::IdfVersion:
+            pStr   = esp_app_get_description()->idf_ver;
+            maxLen = sizeof(esp_app_get_description()->idf_ver);
+            break;
+        default:
+            pStr   = static_cast<const char*>(pEntry->pValue);
+            maxLen = BLE_ATT_ATTR_MAX_LEN;
+            break;
+    }
+
+    return os_mbuf_append(ctxt->om, pStr, strnlen(pStr, maxLen)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+/**
+ * @brief Registers a Device Information Service whose values are read from a table, in one pass.
+ * @param [in] pTable The characteristics, must remain valid, usually a static const array.
+ * @param [in] count The number of entries in the table.
+ * @return True if the service was registered.
+ * @details Call before the server is started, e.g. before advertising, instead of init() and the setters.
+ * The values are served by a read callback from the table, RAM is only used for the NimBLE
+ * service definition: 2 service and count + 1 characteristic definitions and count + 1 16 bit UUIDs.
+ * Services added or removed on the server after it started reset the GATT database, which drops this service.
+ */
+bool NimBLEDis::init(const NimBLEDisEntry* pTable, size_t count) {
+    if (m_pDisService || m_pTableSvc) {
+        NIMBLE_LOGE(LOG_TAG, "Device Information Service already initialized");
+        return false;
+    }
+
+    size_t   defLen = 2 * sizeof(ble_gatt_svc_def) + (count + 1) * sizeof(ble_gatt_chr_def);
+    size_t   memLen = defLen + (count + 1) * sizeof(ble_uuid16_t);
+    uint8_t* pMem   = static_cast<uint8_t*>(calloc(1, memLen));
+    if (!pMem) {
+        NIMBLE_LOGE(LOG_TAG, "%s -  malloc fail", __func__);
+        return false;
+    }
+
+    ble_gatt_svc_def* pSvc   = reinterpret_cast<ble_gatt_svc_def*>(pMem);
+    ble_gatt_chr_def* pChrs  = reinterpret_cast<ble_gatt_chr_def*>(pSvc + 2);
+    ble_uuid16_t*     pUuids = reinterpret_cast<ble_uuid16_t*>(pMem + defLen);
+    for (size_t i = 0; i < count; i++) {
+        pUuids[i + 1].u.type = BLE_UUID_TYPE_16;
+        pUuids[i + 1].value  = pTable[i].uuid;
+        pChrs[i].uuid        = &pUuids[i + 1].u;
+        pChrs[i].access_cb   = disTableAccessCb;
+        pChrs[i].arg         = const_cast<NimBLEDisEntry*>(&pTable[i]);
+        pChrs[i].flags       = BLE_GATT_CHR_F_READ;
+    }
+
+    pUuids[0].u.type        = BLE_UUID_TYPE_16;
+    pUuids[0].value         = BLE_DIS_SERVICE_UUID;
+    pSvc[0].type            = BLE_GATT_SVC_TYPE_PRIMARY;
+    pSvc[0].uuid            = &pUuids[0].u;
+    pSvc[0].characteristics = pChrs;
+
+    int rc = ble_gatts_count_cfg(pSvc);
+    if (rc == 0) {
+        rc = ble_gatts_add_svcs(pSvc);
+    }
+
+    if (rc != 0) {
+        NIMBLE_LOGE(LOG_TAG, "Failed to register the service, rc=%d", rc);
+        free(pMem);
+        return false;
+    }
+
+    m_pTableSvc = pSvc;
+    NIMBLE_LOGI(LOG_TAG,
+                "Device Information Service registered, %u characteristics, %u bytes",
+                static_cast<unsigned>(count),
+                static_cast<unsigned>(memLen));
+    return true;
+}
+
 bool NimBLEDis::init() {
+    if (m_pTableSvc) {
+        NIMBLE_LOGE(LOG_TAG, "Device Information Service already initialized");
+        return false;
+    }
+
     NimBLEServer* pServer = NimBLEDevice::createServer();
     if (!pServer) {
         NIMBLE_LOGE(LOG_TAG, "Failed to get server");
@@ -140,6 +243,10 @@ bool NimBLEDis::start() {
         return m_pDisService->start();
     }
 
+    if (m_pTableSvc != nullptr) {
+        return true; // registered by init(), started with the server
+    }
+
     NIMBLE_LOGE(LOG_TAG, "Device Information Service not initialized");
     return false;
 }
@@ -5,8 +5,38 @@
 #ifndef NIMBLE_DIS_H_
 #define NIMBLE_DIS_H_
 
+#include <cstddef>
+#include <cstdint>
+
 class NimBLEService;
 class NimBLEUUID;
+struct ble_gatt_svc_def;
+
+/**
+ * @brief A characteristic of a Device Information Service table, see NimBLEDis::init(const NimBLEDisEntry*, size_t).
+ * @details The value is read from where it is stored when a client reads it, a string constant in flash
+ * or the app description of the running image, nothing is copied to RAM.
+ */
+struct NimBLEDisEntry {
+    enum Source : uint8_t {
+        Text,       // pValue is a NUL terminated string
+        Bytes,      // pValue points to length bytes
+        AppVersion, // version of the running app, from esp_app_get_description()
+        AppName,    // project name of the running app
+        IdfVersion, // ESP-IDF version the running app was built with
+    };
+
+    uint16_t    uuid;
+    Source      source;
+    const void* pValue;
+    uint16_t    length;
+
+    static constexpr NimBLEDisEntry text(uint16_t uuid, const char* value) { return {uuid, Text, value, 0}; }
+    static constexpr NimBLEDisEntry bytes(uint16_t uuid, const void* value, uint16_t length) {
+        return {uuid, Bytes, value, length};
+    }
+    static constexpr NimBLEDisEntry app(uint16_t uuid, Source source) { return {uuid, source, nullptr, 0}; }
+};
 
 /**
  * @brief A model of the BLE Device Information Service
@@ -14,7 +44,24 @@ class NimBLEUUID;
  */
 class NimBLEDis {
   public:
+    enum Characteristic : uint16_t {
+        SystemId         = 0x2a23,
+        ModelNumber      = 0x2a24,
+        SerialNumber     = 0x2a25,
+        FirmwareRevision = 0x2a26,
+        HardwareRevision = 0x2a27,
+        SoftwareRevision = 0x2a28,
+        ManufacturerName = 0x2a29,
+        RegulatoryCert   = 0x2a2a,
+        PnpId            = 0x2a50,
+    };
+
     bool init();
+    bool init(const NimBLEDisEntry* pTable, size_t count);
+    template <size_t N>
+    bool init(const NimBLEDisEntry (&table)[N]) {
+        return init(table, N);
+    }
     bool start();
     bool setModelNumber(const char* value);
     bool setSerialNumber(const char* value);
@@ -26,8 +73,9 @@ class NimBLEDis {
     bool setPnp(uint8_t src, uint16_t vid, uint16_t pid, uint16_t ver);
 
   private:
-    bool           createDisChar(const NimBLEUUID& uuid, const uint8_t* value, uint16_t length);
-    NimBLEService* m_pDisService{nullptr};
+    bool              createDisChar(const NimBLEUUID& uuid, const uint8_t* value, uint16_t length);
+    NimBLEService*    m_pDisService{nullptr};
+    ble_gatt_svc_def* m_pTableSvc{nullptr};
 };
 
-#endif // NIMBLE_DIS_H_
\ No newline at end of file
+#endif // NIMBLE_DIS_H_
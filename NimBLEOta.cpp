@@ -3,398 +3,1423 @@
 // MIT License
 
 #include "NimBLEOta.h"
+#include "NimBLEOtaCrc.h"
 #include "NimBLEDevice.h"
 #include "NimBLELog.h"
 
-#define CMD_ACK_LENGTH 20
-#define FW_ACK_LENGTH  20
-#define OTA_BLOCK_SIZE 4098
-
-static constexpr uint16_t otaServiceUuid = 0x8018;
-static constexpr uint16_t recvFwUuid     = 0x8020;
-static constexpr uint16_t otaBarUuid     = 0x8021;
-static constexpr uint16_t commandUuid    = 0x8022;
-static constexpr uint16_t customerUuid   = 0x8023;
-static constexpr uint16_t startOtaCmd    = 0x0001;
-static constexpr uint16_t stopOtaCmd     = 0x0002;
-static constexpr uint16_t ackOtaCmd      = 0x0003;
-static constexpr uint16_t otaAccept      = 0x0000;
-static constexpr uint16_t otaReject      = 0x0001;
-static constexpr uint16_t signError      = 0x0003;
-static constexpr uint16_t crcError       = 0x0001;
-static constexpr uint16_t indexError     = 0x0002;
-static constexpr uint16_t otaFwSuccess   = 0x0000;
-static constexpr uint16_t lenError       = 0x0003;
-static constexpr uint16_t startError     = 0x0005;
-static const char*        LOG_TAG        = "NimBLEOta";
+#include <esp_timer.h>
+
+#if NIMBLE_OTA_RESUME
+# include <nvs.h>
+#endif
+
+#if NIMBLE_OTA_SECTOR_SYNC || NIMBLE_OTA_SIGNATURE
+# include <mbedtls/sha256.h>
+# include <mbedtls/version.h>
+# if MBEDTLS_VERSION_NUMBER < 0x03000000
+#  define NIMBLE_OTA_SHA256(fn) fn##_ret
+# else
+#  define NIMBLE_OTA_SHA256(fn) fn
+# endif
+#endif
+
+static constexpr uint16_t otaServiceUuid  = 0x8018;
+static constexpr uint16_t recvFwUuid      = 0x8020;
+static constexpr uint16_t otaBarUuid      = 0x8021;
+static constexpr uint16_t commandUuid     = 0x8022;
+static constexpr uint16_t customerUuid    = 0x8023;
+static const char*        LOG_TAG         = "NimBLEOta";
+static const char*        nvsNamespace    = "nimble_ota";
+static const char*        checkpointKey   = "checkpoint";
+static constexpr uint32_t flashSectorSize = 4096;
+static constexpr uint32_t eraseStep       = NIMBLE_OTA_ERASE_AHEAD * flashSectorSize;
 static NimBLEOtaCallbacks defaultCallbacks;
+static constexpr int         uartAbortBreak  = 100; // bit times of the break after an aborted image
+static constexpr UBaseType_t callbackReserve = 3; // queue entries kept for the final progress and the events ending an update
 
 extern "C" struct ble_npl_eventq* nimble_port_get_dflt_eventq(void);
 
-void NimBLEOta::NimBLEOtaCharacteristicCallbacks::firmwareOnWrite(NimBLECharacteristic* pCharacteristic,
-                                                                  NimBLEConnInfo&       connInfo) {
-    if (!m_pOta->isInProgress()) {
-        NIMBLE_LOGW(LOG_TAG, "ota not started");
+NimBLEOta::NimBLEOtaFirmwareCharacteristic::NimBLEOtaFirmwareCharacteristic(NimBLEOta*     pOta,
+                                                                            uint16_t       properties,
+                                                                            NimBLEService* pService)
+    : NimBLECharacteristic(NimBLEUUID(recvFwUuid), properties, BLE_ATT_ATTR_MAX_LEN, pService), m_pOta(pOta) {}
+
+/**
+ * @brief Called by the server with the data of each firmware packet, replaces the default handling
+ * which copies the data into the characteristic value before calling onWrite.
+ */
+void NimBLEOta::NimBLEOtaFirmwareCharacteristic::writeEvent(const uint8_t* val, uint16_t len, NimBLEConnInfo& connInfo) {
+    if (m_pOta->isInProgress() && !m_pOta->m_client.isClient(connInfo.getIdAddress())) {
+        NIMBLE_LOGW(LOG_TAG, "Received write from unknown client - ignored");
         return;
     }
 
-    if (NimBLEAddress(connInfo.getIdAddress()) != m_pOta->m_clientAddr) {
-        NIMBLE_LOGW(LOG_TAG, "Received write from unknown client - ignored");
+    m_pOta->m_transport.m_attMtu = connInfo.getMTU();
+    m_pOta->handleFirmware(val, len);
+}
+
+void NimBLEOta::NimBLEOtaCharacteristicCallbacks::commandOnWrite(NimBLECharacteristic* pCharacteristic,
+                                                                 NimBLEConnInfo&       connInfo) {
+    // The client reconnecting to resume is on a new connection, the link requests follow it.
+    if (!m_pOta->m_client.bind(connInfo.getIdAddress(), connInfo.getConnHandle())) {
+        NIMBLE_LOGW(LOG_TAG, "Received command from unknown client - ignored");
         return;
     }
 
-    esp_err_t      err        = ESP_OK;
-    NimBLEAttValue data       = pCharacteristic->getValue();
-    auto           dataLen    = data.length();
-    uint16_t       otaResp    = otaFwSuccess;
-    uint16_t       crc        = 0;
-    uint32_t       writeLen   = 0;
-    uint16_t       recvSector = data[0] | (data[1] << 8);
-    uint8_t        fwAck[FW_ACK_LENGTH]{};
+    NimBLEAttValue data = pCharacteristic->getValue();
+    m_pOta->handleCommand(data.data(), data.length());
+}
 
-    fwAck[0] = data[0];
-    fwAck[1] = data[1];
+void NimBLEOta::NimBLEOtaCharacteristicCallbacks::onSubscribe(NimBLECharacteristic* pChar,
+                                                              NimBLEConnInfo&       connInfo,
+                                                              uint16_t              subValue) {
+    NIMBLE_LOGI(LOG_TAG, "Ota client conn_handle: %d, subscribed: %s", connInfo.getConnHandle(), subValue ? "true" : "false");
+    if (pChar->getUUID().equals(recvFwUuid)) {
+        m_pOta->m_transport.m_fwSubValue = subValue;
+    } else if (pChar->getUUID().equals(otaBarUuid)) {
+        m_pOta->m_statsSubscribed = subValue != 0;
+    }
 
-    if (recvSector != m_pOta->m_sector) {
-        if (recvSector == 0xffff) {
-            NIMBLE_LOGD(LOG_TAG, "Last sector received");
-        } else {
-            if (data[2] == 0xff) { // only send ack after last packet received due to write without response not waiting
-                NIMBLE_LOGE(LOG_TAG, "Sector index error, expected: %u, received: %u", m_pOta->m_sector, recvSector);
-                otaResp = indexError;
-                goto SendAck;
-            }
+    bool client = m_pOta->m_client.isClient(connInfo.getIdAddress());
+    if (client && subValue) {
+        m_pOta->m_client.bind(connInfo.getIdAddress(), connInfo.getConnHandle()); // reconnected
+    }
 
-            return;
+    if (m_pOta->isInProgress() && client && pChar->getUUID().equals(commandUuid)) {
+        if (!subValue) { // client disconnected
+            m_pOta->releaseLink();
+            m_pOta->dispatch(NimBLEOtaEvent::Stop, NimBLEOta::Disconnected);
         }
+    } else if (!subValue && pChar->getUUID().equals(commandUuid)) {
+        m_pOta->discardPending(); // a target or signature sent without starting an update
     }
+}
 
-    if (data[2] != m_pOta->m_packet) {
-        if (data[2] == 0xff) {
-            NIMBLE_LOGD(LOG_TAG, "last packet");
-            dataLen -= 2; // in the last packet the last 2 bytes are crc
-        } else {
-            // There is no response for out of sequence packet error, will fail crc or length check
-            NIMBLE_LOGE(LOG_TAG, "packet sequence error, cur: %" PRIu32 ", recv: %d", m_pOta->m_packet, data[2]);
+void NimBLEOta::NimBLEOtaCharacteristicCallbacks::onWrite(NimBLECharacteristic* pChar, NimBLEConnInfo& connInfo) {
+    if (pChar->getUUID().equals(commandUuid)) {
+        commandOnWrite(pChar, connInfo);
+    }
+}
+
+/**
+ * @brief Creates the OTA service.
+ * @param [in] pCallbacks The callbacks, nullptr uses the default callbacks.
+ * @param [in] secure Require an authenticated and encrypted connection.
+ * @param [in] pLinkParams The link parameters to request from the client when an update starts, 2M PHY, data length and
+ * connection interval, restored when it ends. nullptr leaves the link as the client set it up.
+ */
+NimBLEService* NimBLEOta::start(NimBLEOtaCallbacks* pCallbacks, bool secure, const NimBLEOtaLinkParams* pLinkParams) {
+    m_pCallbacks = pCallbacks;
+    if (m_pCallbacks == nullptr) {
+        m_pCallbacks = &defaultCallbacks;
+    }
+
+    m_secure       = secure;
+    m_linkGovernor = pLinkParams != nullptr;
+    if (pLinkParams) {
+        m_linkParams = *pLinkParams;
+    }
+
+#ifdef CONFIG_PM_ENABLE
+    if (m_linkGovernor && m_linkParams.pmLock && m_pmLock == nullptr &&
+        esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "nimble_ota", &m_pmLock) != ESP_OK) {
+        NIMBLE_LOGE(LOG_TAG, "esp_pm_lock_create failed");
+        m_pmLock = nullptr;
+    }
+#endif
+
+    m_timer.init(this);
+
+    NimBLEService* pService   = NimBLEDevice::createServer()->createService(otaServiceUuid);
+    uint32_t       properties = NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::WRITE_NR | NIMBLE_PROPERTY::INDICATE;
+    if (secure) {
+        if (!ble_hs_cfg.sm_mitm ||
+            (ble_hs_cfg.sm_io_cap != BLE_HS_IO_DISPLAY_ONLY && ble_hs_cfg.sm_io_cap != BLE_HS_IO_KEYBOARD_DISPLAY)) {
+            NIMBLE_LOGE(LOG_TAG, "Error: Security requested without passkey authentication enabled!");
         }
+        properties |= NIMBLE_PROPERTY::WRITE_AUTHEN | NIMBLE_PROPERTY::WRITE_ENC;
+    }
+
+    NimBLECharacteristic* pRecvFwCharacteristic =
+        new NimBLEOtaFirmwareCharacteristic(this, properties | NIMBLE_PROPERTY::NOTIFY, pService);
+    pRecvFwCharacteristic->setCallbacks(&m_charCallbacks); // for the subscription
+    pService->addCharacteristic(pRecvFwCharacteristic);
+
+    NimBLECharacteristic* pCommandCharacteristic = pService->createCharacteristic(commandUuid, properties);
+    pCommandCharacteristic->setCallbacks(&m_charCallbacks);
+
+    m_transport.m_pRecvFwChr  = pRecvFwCharacteristic;
+    m_transport.m_pCommandChr = pCommandCharacteristic;
+
+    /* TODO Customer Characteristic
+    NimBLECharacteristic *pCustomerCharacteristic = pService->createCharacteristic(CUSTOMER_UUID, NIMBLE_PROPERTY::WRITE
+    | NIMBLE_PROPERTY::INDICATE); pCustomerCharacteristic->setCallbacks(&m_charCallbacks);
+    */
+
+#if NIMBLE_OTA_STATS
+    // The update statistics, see NimBLEOtaCore::packStats for the format.
+    uint32_t statsProperties = NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY;
+    if (secure) {
+        statsProperties |= NIMBLE_PROPERTY::READ_AUTHEN | NIMBLE_PROPERTY::READ_ENC;
     }
+    m_pStatsChr = pService->createCharacteristic(otaBarUuid, statsProperties, NIMBLE_OTA_STATS_LENGTH);
+    m_pStatsChr->setCallbacks(&m_charCallbacks); // for the subscription
+    notifyStats(true);
+#endif
+
+    pService->start();
+    return pService;
+}
 
-    memcpy(m_pOta->m_pBuf + m_pOta->m_offset, data + 3, dataLen - 3);
-    m_pOta->m_offset += dataLen - 3;
+NimBLEUUID NimBLEOta::getServiceUUID() const {
+    return otaServiceUuid;
+}
 
-    NIMBLE_LOGD(LOG_TAG,
-                "Sector:%" PRIu32 ", total length:%" PRIu32 ", length:%d",
-                m_pOta->m_sector,
-                m_pOta->m_offset,
-                dataLen - 3);
-    if (data[2] != 0xff) { // not last packet
-        NIMBLE_LOGD(LOG_TAG, "waiting for next packet");
-        m_pOta->m_packet++;
+/**
+ * @brief Aborts the update, called from the callback task it runs later in the BLE host task.
+ */
+void NimBLEOta::abortUpdate() {
+    if (m_callbackTask != nullptr && xTaskGetCurrentTaskHandle() == m_callbackTask) {
+        ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &m_abortEvent);
         return;
     }
 
-    writeLen = std::min<size_t>(OTA_BLOCK_SIZE - 2, m_pOta->m_offset);
-    if ((recvSector != 0xffff && (m_pOta->m_recvLen + writeLen) != m_pOta->m_fileLen) &&
-        m_pOta->m_offset != OTA_BLOCK_SIZE - 2) {
-        NIMBLE_LOGE(LOG_TAG, "sector length error, received: %d bytes", m_pOta->m_offset);
-        otaResp = lenError;
-        goto SendAck;
+    NimBLEOtaCore::abortUpdate();
+    releaseLink();
+    m_client.clear();
+}
+
+void NimBLEOta::abortTimerCb(ble_npl_event* event) {
+    NimBLEOta* pOta = static_cast<NimBLEOta*>(ble_npl_event_get_arg(event));
+    pOta->onAbortTimerExpired();
+}
+
+void NimBLEOta::abortEventCb(ble_npl_event* event) {
+    static_cast<NimBLEOta*>(ble_npl_event_get_arg(event))->abortUpdate();
+}
+
+void NimBLEOta::onOtaStart(uint32_t firmwareSize, Reason reason) {
+    requestLink();
+    m_progressGate = NimBLEOtaProgressGate{};
+    m_imageGate    = NimBLEOtaProgressGate{};
+    dispatch(NimBLEOtaEvent::Start, reason, firmwareSize);
+}
+
+void NimBLEOta::onOtaProgress(uint32_t current, uint32_t total) {
+    checkLink();
+    notifyStats(false);
+    if (progressDue(m_progressGate, current, total) && dispatch(NimBLEOtaEvent::Progress, 0, current, total)) {
+        m_progressGate = NimBLEOtaProgressGate{current, esp_timer_get_time()};
+    }
+}
+
+void NimBLEOta::onOtaImageProgress(uint32_t written, uint32_t imageSize) {
+    if (progressDue(m_imageGate, written, imageSize) && dispatch(NimBLEOtaEvent::ImageProgress, 0, written, imageSize)) {
+        m_imageGate = NimBLEOtaProgressGate{written, esp_timer_get_time()};
     }
+}
+
+void NimBLEOta::onOtaStop(Reason reason) {
+    notifyStats(true);
+    dispatch(NimBLEOtaEvent::Stop, reason);
+}
+
+void NimBLEOta::onOtaComplete() {
+    notifyStats(true);
+    dispatch(NimBLEOtaEvent::Complete);
+}
+
+void NimBLEOta::onOtaError(int err, Reason reason) {
+    notifyStats(true);
+    dispatch(NimBLEOtaEvent::Error, reason, static_cast<uint32_t>(err));
+}
+
+/**
+ * @brief Delivers the callbacks from an application task instead of the BLE host task.
+ * @param [in] queueLength The number of events queued, at least 6. Progress and link updates are not queued when 3 entries
+ * or less are free, they are reported later. Start, stop, complete, error and the final progress use the last entries.
+ * @param [in] createTask Create a task to deliver the callbacks, false to call processCallbacks from an application task.
+ * @param [in] core The core to pin the callback task to.
+ * @return True if the queue and the task were created.
+ * @details Must be called before an update starts. A slow callback then no longer delays the acks,
+ * abortUpdate called from a callback runs shortly after in the BLE host task.
+ */
+bool NimBLEOta::enableAsyncCallbacks(uint8_t queueLength, bool createTask, BaseType_t core) {
+    if (m_eventQueue != nullptr) {
+        return true;
+    }
+
+    m_eventQueue = xQueueCreate(std::max<UBaseType_t>(queueLength, callbackReserve + 3), sizeof(NimBLEOtaEvent));
+    if (m_eventQueue == nullptr) {
+        return false;
+    }
+
+    ble_npl_event_init(&m_abortEvent, abortEventCb, this);
+    if (createTask && xTaskCreatePinnedToCore(callbackTask,
+                                              "ota_callbacks",
+                                              NIMBLE_OTA_CALLBACK_STACK_SIZE,
+                                              this,
+                                              NIMBLE_OTA_CALLBACK_PRIORITY,
+                                              &m_callbackTask,
+                                              core) != pdPASS) {
+        vQueueDelete(m_eventQueue);
+        m_eventQueue   = nullptr;
+        m_callbackTask = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Delivers the queued callbacks, from the application task when enableAsyncCallbacks created none.
+ * @param [in] wait The ticks to wait for the first event.
+ * @return True if a callback was delivered.
+ * @details Always call it from the same task.
+ */
+bool NimBLEOta::processCallbacks(TickType_t wait) {
+    if (m_eventQueue == nullptr) {
+        return false;
+    }
+
+    if (m_callbackTask == nullptr) {
+        m_callbackTask = xTaskGetCurrentTaskHandle();
+    }
+
+    NimBLEOtaEvent event;
+    bool           delivered = false;
+    while (xQueueReceive(m_eventQueue, &event, delivered ? 0 : wait) == pdTRUE) {
+        deliver(event);
+        delivered = true;
+    }
+
+    return delivered;
+}
+
+void NimBLEOta::callbackTask(void* arg) {
+    NimBLEOta* pOta = static_cast<NimBLEOta*>(arg);
+    for (;;) {
+        pOta->processCallbacks(portMAX_DELAY);
+    }
+}
+
+/**
+ * @brief Coalesces the progress callbacks, the first report is delivered as soon as the queue has room and the last always.
+ * @param [in] percent The progress to make before the next report, in percent of the total.
+ * @param [in] ms The time to pass before the next report, whichever comes first. Both 0 report every sector.
+ */
+void NimBLEOta::setProgressInterval(uint8_t percent, uint32_t ms) {
+    m_progressStep     = percent;
+    m_progressInterval = ms;
+}
+
+bool NimBLEOta::progressDue(const NimBLEOtaProgressGate& gate, uint32_t current, uint32_t total) const {
+    return current >= total || gate.sent == 0 || (m_progressStep == 0 && m_progressInterval == 0) ||
+           (m_progressStep && (uint64_t)(current - gate.sent) * 100 >= (uint64_t)total * m_progressStep) ||
+           (m_progressInterval && esp_timer_get_time() - gate.time >= (int64_t)m_progressInterval * 1000);
+}
+
+/**
+ * @brief Calls the callback now or queues it for the callback task.
+ * @return False if the event was not queued.
+ */
+bool NimBLEOta::dispatch(NimBLEOtaEvent::Type type, uint8_t reason, uint32_t current, uint32_t total) {
+    NimBLEOtaEvent event{};
+    event.type   = type;
+    event.reason = reason;
+    if (type == NimBLEOtaEvent::Error) {
+        event.err = static_cast<int32_t>(current);
+    } else {
+        event.progress.current = current;
+        event.progress.total   = total;
+    }
+
+    return post(event);
+}
 
-    crc = *reinterpret_cast<const uint16_t*>(data + dataLen);
-    if (crc != getCrc16(m_pOta->m_pBuf, m_pOta->m_offset)) {
-        NIMBLE_LOGE(LOG_TAG, "crc error");
-        otaResp = crcError;
-        goto SendAck;
+bool NimBLEOta::post(const NimBLEOtaEvent& event) {
+    if (m_eventQueue == nullptr) {
+        deliver(event);
+        return true;
     }
 
-    err = esp_ota_write(m_pOta->m_writeHandle, static_cast<const void*>(m_pOta->m_pBuf), writeLen);
+    // Progress and link updates are reported again later, the reserve keeps room for the final progress and the end.
+    bool deferrable = event.type == NimBLEOtaEvent::LinkUpdate ||
+                      ((event.type == NimBLEOtaEvent::Progress || event.type == NimBLEOtaEvent::ImageProgress) &&
+                       event.progress.current < event.progress.total);
+    if (deferrable && uxQueueSpacesAvailable(m_eventQueue) <= callbackReserve) {
+        return false;
+    }
+
+    if (xQueueSend(m_eventQueue, &event, 0) != pdTRUE) {
+        NIMBLE_LOGE(LOG_TAG, "callback queue full, event %u dropped", static_cast<unsigned>(event.type));
+        return false;
+    }
+    return true;
+}
+
+void NimBLEOta::deliver(const NimBLEOtaEvent& event) {
+    switch (event.type) {
+        case NimBLEOtaEvent::Start:
+            m_pCallbacks->onStart(this, event.progress.current, static_cast<Reason>(event.reason));
+            break;
+        case NimBLEOtaEvent::Progress:
+            m_pCallbacks->onProgress(this, event.progress.current, event.progress.total);
+            break;
+        case NimBLEOtaEvent::ImageProgress:
+            m_pCallbacks->onImageProgress(this, event.progress.current, event.progress.total);
+            break;
+        case NimBLEOtaEvent::Stop:
+            m_pCallbacks->onStop(this, static_cast<Reason>(event.reason));
+            break;
+        case NimBLEOtaEvent::Complete:
+            m_pCallbacks->onComplete(this);
+            break;
+        case NimBLEOtaEvent::Error:
+            m_pCallbacks->onError(this, event.err, static_cast<Reason>(event.reason));
+            break;
+        case NimBLEOtaEvent::LinkUpdate:
+            m_pCallbacks->onLinkUpdate(this, event.link);
+            break;
+    }
+}
+
+/**
+ * @brief Sets the minimum time between notifications of the statistics on the progress characteristic (0x8021).
+ * @param [in] ms The interval in milliseconds, 0 disables the notifications, the value can still be read.
+ */
+void NimBLEOta::setStatsInterval(uint32_t ms) {
+    m_statsInterval = ms;
+}
+
+#if NIMBLE_OTA_TRACE
+/**
+ * @brief Prints the trace events kept on the console as lines of hex starting with "NBOTA-TRACE",
+ * a capture of the console can be decoded with scripts/nimbleota_trace.py.
+ */
+void NimBLEOta::dumpTrace() const {
+    NimBLEOtaTraceRecord records[8];
+    size_t               offset = 0;
+    size_t               count;
+    while ((count = getTrace(records, 8, offset)) > 0) {
+        const uint8_t* pData = reinterpret_cast<const uint8_t*>(records);
+        printf("NBOTA-TRACE ");
+        for (size_t i = 0; i < count * sizeof(NimBLEOtaTraceRecord); i++) {
+            printf("%02x", pData[i]);
+        }
+        printf("\n");
+        offset += count;
+    }
+}
+#endif
+
+/**
+ * @brief Updates the progress characteristic with the current statistics and notifies the subscribed client.
+ * @param [in] force Send it even if the last notification was less than the stats interval ago.
+ */
+void NimBLEOta::notifyStats(bool force) {
+    int64_t now = esp_timer_get_time();
+    if (m_pStatsChr == nullptr || (!force && now - m_statsSent < m_statsInterval * 1000LL)) {
+        return;
+    }
+
+    uint8_t buf[NIMBLE_OTA_STATS_LENGTH];
+    size_t  len = packStats(getStats(), isInProgress(), buf);
+    m_pStatsChr->setValue(buf, len);
+    if (m_statsInterval && m_statsSubscribed) {
+        m_pStatsChr->notify();
+    }
+    m_statsSent = now;
+}
+
+/**
+ * @brief Reads the link parameters of the connection to the client.
+ * @return False if the client is no longer connected.
+ */
+static bool getLinkInfo(uint16_t connHandle, const NimBLEAddress& clientAddr, NimBLEOtaLinkInfo* pInfo) {
+    if (connHandle == BLE_HS_CONN_HANDLE_NONE) {
+        return false;
+    }
+
+    NimBLEServer*  pServer  = NimBLEDevice::getServer();
+    NimBLEConnInfo connInfo = pServer->getPeerInfoByHandle(connHandle);
+    if (connInfo.getIdAddress() != clientAddr) {
+        return false;
+    }
+
+    pInfo->interval = connInfo.getConnInterval();
+    pInfo->latency  = connInfo.getConnLatency();
+    pInfo->timeout  = connInfo.getConnTimeout();
+    pInfo->mtu      = connInfo.getMTU();
+    if (!pServer->getPhy(connHandle, &pInfo->txPhy, &pInfo->rxPhy)) {
+        pInfo->txPhy = pInfo->rxPhy = BLE_HCI_LE_PHY_1M;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Requests the link parameters set in start from the client and holds the power management lock.
+ * @details The client may refuse or pick other values, checkLink reports the parameters it used.
+ */
+void NimBLEOta::requestLink() {
+    if (!m_linkGovernor || m_linkActive || !getLinkInfo(m_client.connHandle(), m_client.address(), &m_savedLink)) {
+        return;
+    }
+
+    NimBLEServer* pServer    = NimBLEDevice::getServer();
+    uint16_t      connHandle = m_client.connHandle();
+    m_linkActive             = true;
+    m_reportedLink           = NimBLEOtaLinkInfo{};
+    if (m_linkParams.phy2M && !pServer->updatePhy(connHandle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK, 0)) {
+        NIMBLE_LOGW(LOG_TAG, "2M PHY request failed");
+    }
+
+    if (m_linkParams.dataLen && !pServer->setDataLen(connHandle, m_linkParams.dataLen)) {
+        NIMBLE_LOGW(LOG_TAG, "data length request failed");
+    }
+
+    if (!pServer->updateConnParams(connHandle,
+                                   m_linkParams.minInterval,
+                                   m_linkParams.maxInterval,
+                                   m_linkParams.latency,
+                                   m_linkParams.timeout)) {
+        NIMBLE_LOGW(LOG_TAG, "connection parameter request failed");
+    }
+
+#ifdef CONFIG_PM_ENABLE
+    if (m_pmLock) {
+        esp_pm_lock_acquire(m_pmLock);
+    }
+#endif
+}
+
+/**
+ * @brief Calls onLinkUpdate when the link parameters of the update have changed.
+ */
+void NimBLEOta::checkLink() {
+    NimBLEOtaLinkInfo info;
+    if (!m_linkActive || !getLinkInfo(m_client.connHandle(), m_client.address(), &info) ||
+        memcmp(&info, &m_reportedLink, sizeof(info)) == 0) {
+        return;
+    }
+
+    NimBLEOtaEvent event{};
+    event.type = NimBLEOtaEvent::LinkUpdate;
+    event.link = info;
+    if (post(event)) {
+        m_reportedLink = info; // reported again on the next progress otherwise
+    }
+}
+
+/**
+ * @brief Restores the connection interval and PHY the client used before the update and releases the lock.
+ * @details The data length is kept, it only raises the largest packet the link layer may send.
+ */
+void NimBLEOta::releaseLink() {
+    if (!m_linkActive) {
+        return;
+    }
+
+    m_linkActive = false;
+#ifdef CONFIG_PM_ENABLE
+    if (m_pmLock) {
+        esp_pm_lock_release(m_pmLock);
+    }
+#endif
+
+    NimBLEOtaLinkInfo info;
+    if (!getLinkInfo(m_client.connHandle(), m_client.address(), &info)) {
+        return; // disconnected
+    }
+
+    NimBLEServer* pServer = NimBLEDevice::getServer();
+    if (m_linkParams.phy2M && (info.txPhy != m_savedLink.txPhy || info.rxPhy != m_savedLink.rxPhy)) {
+        pServer->updatePhy(m_client.connHandle(), 1 << (m_savedLink.txPhy - 1), 1 << (m_savedLink.rxPhy - 1), 0);
+    }
+
+    if (info.interval != m_savedLink.interval || info.latency != m_savedLink.latency) {
+        pServer->updateConnParams(m_client.connHandle(),
+                                  m_savedLink.interval,
+                                  m_savedLink.interval,
+                                  m_savedLink.latency,
+                                  m_savedLink.timeout);
+    }
+}
+
+/**
+ * @brief Finds the partition the update is written to.
+ */
+static const esp_partition_t* getUpdatePartition() {
+    const esp_partition_t* partition_ptr = esp_ota_get_boot_partition();
+    if (partition_ptr == NULL) {
+        NIMBLE_LOGE(LOG_TAG, "boot partition NULL!\r\n");
+        return nullptr;
+    }
+
+    if (partition_ptr->type != ESP_PARTITION_TYPE_APP) {
+        NIMBLE_LOGE(LOG_TAG, "esp_current_partition->type != ESP_PARTITION_TYPE_APP\r\n");
+        return nullptr;
+    }
+
+    esp_partition_subtype_t subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0;
+    if (partition_ptr->subtype != ESP_PARTITION_SUBTYPE_APP_FACTORY) {
+        const esp_partition_t* next_partition = esp_ota_get_next_update_partition(partition_ptr);
+        if (next_partition) {
+            subtype = next_partition->subtype;
+        }
+    }
+
+    partition_ptr = esp_partition_find_first(ESP_PARTITION_TYPE_APP, subtype, NULL);
+    if (partition_ptr == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "partition NULL!\r\n");
+    }
+
+    return partition_ptr;
+}
+
+/**
+ * @brief Opens the update partition without erasing it, so the start command is acknowledged right away.
+ * @param [in] imageSize The image length, 0 if it is not known until the end, i.e. a delta update.
+ * @details Only the sectors the image reaches into are erased, ahead of the data as it is written.
+ */
+int NimBLEOta::NimBLEOtaEspFlash::begin(uint32_t imageSize) {
+    const esp_partition_t* partition_ptr = getUpdatePartition();
+    if (partition_ptr == nullptr) {
+        return ESP_FAIL;
+    }
+
+    if (imageSize > partition_ptr->size) {
+        NIMBLE_LOGE(LOG_TAG, "image too large, size: %" PRIu32 ", partition: %" PRIu32, imageSize, partition_ptr->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    memcpy(&m_partition, partition_ptr, sizeof(esp_partition_t));
+    esp_err_t err = esp_ota_begin(&m_partition, OTA_WITH_SEQUENTIAL_WRITES, &m_writeHandle);
     if (err != ESP_OK) {
-        NIMBLE_LOGE(LOG_TAG, "esp_ota_write failed! err=0x%x", err);
-        goto Done;
+        NIMBLE_LOGE(LOG_TAG, "esp_ota_begin failed! err=0x%x", err);
+        return err;
     }
 
-    m_pOta->m_recvLen += writeLen;
-    m_pOta->m_pCallbacks->onProgress(m_pOta, m_pOta->m_recvLen, m_pOta->m_fileLen);
-    if (m_pOta->m_recvLen >= m_pOta->m_fileLen) {
-        err = esp_ota_end(m_pOta->m_writeHandle);
+    // esp_ota_write_with_offset does not support encrypted partitions, esp_ota_write erases them a sector at a time.
+    m_eraseAhead = !m_partition.encrypted;
+    m_offset     = 0;
+    m_erased     = 0;
+    m_eraseEnd   = imageSize ? (imageSize + flashSectorSize - 1) & ~(flashSectorSize - 1) : m_partition.size;
+    return ESP_OK;
+}
+
+/**
+ * @brief Erases up to NIMBLE_OTA_ERASE_AHEAD sectors ahead of the data when it reaches the erased area and writes it.
+ * @details With enablePipeline this runs on the flash task so the erase overlaps with receiving the next sectors.
+ */
+int NimBLEOta::NimBLEOtaEspFlash::write(const uint8_t* data, size_t length) {
+    if (!m_eraseAhead) {
+        esp_err_t err = esp_ota_write(m_writeHandle, static_cast<const void*>(data), length);
         if (err != ESP_OK) {
-            NIMBLE_LOGE(LOG_TAG, "esp_ota_end failed! err=0x%x", err);
-            goto Done;
+            NIMBLE_LOGE(LOG_TAG, "esp_ota_write failed! err=0x%x", err);
+        }
+
+        return err;
+    }
+
+    esp_err_t err = ESP_OK;
+    if (m_offset + length > m_erased) {
+        uint32_t end      = m_offset + length;
+        uint32_t needed   = (end + flashSectorSize - 1) / flashSectorSize * flashSectorSize;
+        uint32_t ahead    = (end + eraseStep - 1) / eraseStep * eraseStep;
+        uint32_t eraseEnd = std::max(needed, std::min(ahead, m_eraseEnd));
+        err               = esp_partition_erase_range(&m_partition, m_erased, eraseEnd - m_erased);
+        m_erased          = eraseEnd;
+    }
+
+    if (err == ESP_OK) {
+        err = esp_ota_write_with_offset(m_writeHandle, data, length, m_offset);
+    }
+
+    if (err != ESP_OK) {
+        NIMBLE_LOGE(LOG_TAG, "esp_ota_write failed! err=0x%x", err);
+        return err;
+    }
+
+    m_offset += length;
+    return ESP_OK;
+}
+
+int NimBLEOta::NimBLEOtaEspFlash::end() {
+    esp_err_t err = esp_ota_end(m_writeHandle);
+    m_writeHandle = 0;
+    if (err != ESP_OK) {
+        NIMBLE_LOGE(LOG_TAG, "esp_ota_end failed! err=0x%x", err);
+        return err;
+    }
+
+    err = esp_ota_set_boot_partition(&m_partition);
+    if (err != ESP_OK) {
+        NIMBLE_LOGE(LOG_TAG, "esp_ota_set_boot_partition failed! err=0x%x", err);
+    }
+
+    return err;
+}
+
+void NimBLEOta::NimBLEOtaEspFlash::abort() {
+    if (m_writeHandle) {
+        esp_ota_abort(m_writeHandle);
+        m_writeHandle = 0;
+    }
+}
+
+#if NIMBLE_OTA_SECTOR_SYNC
+/**
+ * @brief Compares the start of the SHA-256 of a block of a partition with hash.
+ */
+static bool blockHashMatches(const esp_partition_t* partition, uint32_t offset, uint32_t length, const uint8_t* hash) {
+    if (partition == nullptr || offset + length > partition->size) {
+        return false;
+    }
+
+    uint8_t                buf[512];
+    uint8_t                digest[32];
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    bool ok = NIMBLE_OTA_SHA256(mbedtls_sha256_starts)(&ctx, 0) == 0;
+    for (uint32_t pos = 0; ok && pos < length; pos += sizeof(buf)) {
+        size_t len = std::min<size_t>(sizeof(buf), length - pos);
+        ok         = esp_partition_read(partition, offset + pos, buf, len) == ESP_OK &&
+             NIMBLE_OTA_SHA256(mbedtls_sha256_update)(&ctx, buf, len) == 0;
+    }
+
+    ok = ok && NIMBLE_OTA_SHA256(mbedtls_sha256_finish)(&ctx, digest) == 0;
+    mbedtls_sha256_free(&ctx);
+    return ok && memcmp(digest, hash, 8) == 0;
+}
+
+/**
+ * @brief Opens the update partition without erasing it, the blocks the device has are kept.
+ */
+int NimBLEOta::NimBLEOtaEspSectorSync::begin(uint32_t imageSize) {
+    m_pPartition = getUpdatePartition();
+    if (m_pPartition == nullptr || imageSize > m_pPartition->size) {
+        return ESP_FAIL;
+    }
+
+    if (m_pPartition->encrypted) {
+        NIMBLE_LOGE(LOG_TAG, "sync updates are not supported with flash encryption");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    m_offset      = 0;
+    m_written     = 0;
+    esp_err_t err = esp_ota_begin(m_pPartition, OTA_WITH_SEQUENTIAL_WRITES, &m_writeHandle);
+    if (err != ESP_OK) {
+        NIMBLE_LOGE(LOG_TAG, "esp_ota_begin failed! err=0x%x", err);
+    }
+
+    return err;
+}
+
+/**
+ * @brief Keeps the block if the update partition already has it, or copies it from the running image.
+ */
+bool NimBLEOta::NimBLEOtaEspSectorSync::reuse(uint32_t offset, uint32_t length, const uint8_t* hash) {
+    if (blockHashMatches(m_pPartition, offset, length, hash)) {
+        return true;
+    }
+
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    if (!blockHashMatches(running, offset, length, hash)) {
+        return false;
+    }
+
+    uint32_t eraseLen = (length + flashSectorSize - 1) / flashSectorSize * flashSectorSize;
+    if (esp_partition_erase_range(m_pPartition, offset, eraseLen) != ESP_OK) {
+        return false;
+    }
+
+    uint8_t buf[512];
+    for (uint32_t pos = 0; pos < length; pos += sizeof(buf)) {
+        size_t len = std::min<size_t>(sizeof(buf), length - pos);
+        if (esp_partition_read(running, offset + pos, buf, len) != ESP_OK ||
+            esp_ota_write_with_offset(m_writeHandle, buf, len, offset + pos) != ESP_OK) {
+            return false; // the block is sent by the client instead
         }
+    }
+
+    m_written += length;
+    return true;
+}
 
-        err = esp_ota_set_boot_partition(&m_pOta->m_partition);
+int NimBLEOta::NimBLEOtaEspSectorSync::seek(uint32_t offset) {
+    m_offset = offset;
+    return ESP_OK;
+}
+
+int NimBLEOta::NimBLEOtaEspSectorSync::write(const uint8_t* data, size_t length) {
+    uint32_t  eraseLen = (length + flashSectorSize - 1) / flashSectorSize * flashSectorSize;
+    esp_err_t err      = esp_partition_erase_range(m_pPartition, m_offset, eraseLen);
+    if (err == ESP_OK) {
+        err = esp_ota_write_with_offset(m_writeHandle, data, length, m_offset);
+    }
+
+    if (err != ESP_OK) {
+        NIMBLE_LOGE(LOG_TAG, "sync write failed! err=0x%x", err);
+        return err;
+    }
+
+    m_offset  += length;
+    m_written += length;
+    return ESP_OK;
+}
+
+int NimBLEOta::NimBLEOtaEspSectorSync::end() {
+    // esp_ota_end fails if nothing was written, the image is still verified when it is set as the boot partition.
+    esp_err_t err = m_written ? esp_ota_end(m_writeHandle) : esp_ota_abort(m_writeHandle);
+    m_writeHandle = 0;
+    if (err != ESP_OK) {
+        NIMBLE_LOGE(LOG_TAG, "esp_ota_end failed! err=0x%x", err);
+        return err;
+    }
+
+    err = esp_ota_set_boot_partition(m_pPartition);
+    if (err != ESP_OK) {
+        NIMBLE_LOGE(LOG_TAG, "esp_ota_set_boot_partition failed! err=0x%x", err);
+    }
+
+    return err;
+}
+
+void NimBLEOta::NimBLEOtaEspSectorSync::abort() {
+    if (m_writeHandle) {
+        esp_ota_abort(m_writeHandle);
+        m_writeHandle = 0;
+    }
+}
+#endif
+
+#if NIMBLE_OTA_RESUME
+/**
+ * @brief Checks the data written to the update partition before a reset and continues writing at offset.
+ * @details Each flash sector is erased as it is reached, so the data after the checkpoint is overwritten.
+ */
+int NimBLEOta::NimBLEOtaEspFlash::resume(uint32_t offset, uint16_t crc) {
+    const esp_partition_t* partition_ptr = getUpdatePartition();
+    if (partition_ptr == nullptr || offset > partition_ptr->size) {
+        return ESP_FAIL;
+    }
+
+    uint8_t  buf[512];
+    uint16_t calcCrc = 0;
+    for (uint32_t pos = 0; pos < offset; pos += sizeof(buf)) {
+        size_t    len = std::min<size_t>(sizeof(buf), offset - pos);
+        esp_err_t err = esp_partition_read(partition_ptr, pos, buf, len);
         if (err != ESP_OK) {
-            NIMBLE_LOGE(LOG_TAG, "esp_ota_set_boot_partition failed! err=0x%x", err);
-            goto Done;
+            return err;
         }
+        calcCrc = NimBLEOtaCrc::update(calcCrc, buf, len);
     }
 
-SendAck:
-    m_pOta->m_packet = 0;
-    m_pOta->m_offset = 0;
-    fwAck[2]         = otaResp;
-    fwAck[3]         = (otaResp >> 8) & 0xff;
-    fwAck[4]         = m_pOta->m_sector;
-    fwAck[5]         = (m_pOta->m_sector >> 8) & 0xff;
-    crc              = getCrc16(fwAck, 18);
-    fwAck[18]        = crc & 0xff;
-    fwAck[19]        = (crc & 0xff00) >> 8;
-    pCharacteristic->setValue(fwAck, FW_ACK_LENGTH);
-    pCharacteristic->indicate();
+    if (calcCrc != crc) {
+        return ESP_ERR_INVALID_CRC;
+    }
 
-    if (otaResp == otaFwSuccess) {
-        m_pOta->m_sector++;
+    memcpy(&m_partition, partition_ptr, sizeof(esp_partition_t));
+    m_eraseAhead  = false; // esp_ota_write erases the rest of the image as it is written
+    esp_err_t err = esp_ota_resume(&m_partition, OTA_WITH_SEQUENTIAL_WRITES, offset, &m_writeHandle);
+    if (err != ESP_OK) {
+        NIMBLE_LOGE(LOG_TAG, "esp_ota_resume failed! err=0x%x", err);
     }
 
-    if (m_pOta->m_recvLen < m_pOta->m_fileLen) {
-        return;
+    return err;
+}
+
+/**
+ * @brief Saved with the checkpoint, a checkpoint for a different update partition is ignored.
+ */
+struct NimBLEOtaNvsRecord {
+    NimBLEOtaCheckpointData data;
+    uint32_t                partitionAddr;
+};
+
+bool NimBLEOta::NimBLEOtaNvsCheckpoint::load(NimBLEOtaCheckpointData* pData) {
+    const esp_partition_t* partition_ptr = getUpdatePartition();
+    nvs_handle_t           handle;
+    if (partition_ptr == nullptr || nvs_open(nvsNamespace, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+
+    NimBLEOtaNvsRecord record{};
+    size_t             len = sizeof(record);
+    esp_err_t          err = nvs_get_blob(handle, checkpointKey, &record, &len);
+    nvs_close(handle);
+    if (err != ESP_OK || len != sizeof(record) || record.partitionAddr != partition_ptr->address) {
+        return false;
+    }
+
+    *pData = record.data;
+    return true;
+}
+
+bool NimBLEOta::NimBLEOtaNvsCheckpoint::save(const NimBLEOtaCheckpointData& data) {
+    const esp_partition_t* partition_ptr = getUpdatePartition();
+    nvs_handle_t           handle;
+    if (partition_ptr == nullptr || nvs_open(nvsNamespace, NVS_READWRITE, &handle) != ESP_OK) {
+        return false;
     }
 
-Done:
+    NimBLEOtaNvsRecord record{data, partition_ptr->address};
+    esp_err_t          err = nvs_set_blob(handle, checkpointKey, &record, sizeof(record));
     if (err == ESP_OK) {
-        m_pOta->abortUpdate(); // Reset the OTA state
-        m_pOta->m_pCallbacks->onComplete(m_pOta);
-    } else {
-        m_pOta->m_pCallbacks->onError(m_pOta, err, NimBLEOta::FlashError);
+        err = nvs_commit(handle);
     }
+
+    nvs_close(handle);
+    return err == ESP_OK;
 }
 
-void NimBLEOta::NimBLEOtaCharacteristicCallbacks::commandOnWrite(NimBLECharacteristic* pCharacteristic,
-                                                                 NimBLEConnInfo&       connInfo) {
-    if (m_pOta->m_clientAddr.isNull()) {
-        m_pOta->m_clientAddr = connInfo.getIdAddress();
-    } else if (connInfo.getIdAddress() != m_pOta->m_clientAddr) {
-        NIMBLE_LOGW(LOG_TAG, "Received command from unknown client - ignored");
-        return;
+void NimBLEOta::NimBLEOtaNvsCheckpoint::clear() {
+    nvs_handle_t handle;
+    if (nvs_open(nvsNamespace, NVS_READWRITE, &handle) == ESP_OK) {
+        if (nvs_erase_key(handle, checkpointKey) == ESP_OK) {
+            nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+}
+#endif
+
+#if NIMBLE_OTA_SINKS
+/**
+ * @brief Lets clients write to data partitions with the target command, except the system partitions
+ * (otadata, phy, nvs, nvs_keys, coredump and efuse).
+ * @return True if enabled, false if an update is in progress.
+ * @details The partition contents are invalid until an update completes.
+ */
+bool NimBLEOta::enablePartitionSink() {
+    return setSink(PartitionSink, &m_partitionSink);
+}
+
+/**
+ * @brief Lets clients write files below basePath with the target command.
+ * @param [in] basePath Where a filesystem is mounted, i.e. "/littlefs", clients can not write outside it.
+ * @param [in] maxSize The largest file accepted, the free space of the filesystem is not checked.
+ * @return True if enabled, false if an update is in progress.
+ */
+bool NimBLEOta::enableFileSink(const char* basePath, uint32_t maxSize) {
+    if (isInProgress()) {
+        return false;
     }
 
-    uint16_t crc = 0;
-    uint8_t  cmdAck[CMD_ACK_LENGTH]{};
-    cmdAck[0] = ackOtaCmd;
-    cmdAck[1] = (ackOtaCmd >> 8) & 0xff;
-    cmdAck[4] = otaReject;
-    cmdAck[5] = (otaReject >> 8) & 0xff;
+    m_fileSink.m_basePath = basePath;
+    m_fileSink.m_maxSize  = maxSize;
+    return setSink(FileSink, &m_fileSink);
+}
 
-    if (pCharacteristic->getValue().length() == 20) {
-        NimBLEAttValue data = pCharacteristic->getValue();
-        uint16_t       cmd  = data[0] | (data[1] << 8);
-        crc                 = data[18] | (data[19] << 8);
-        cmdAck[2]           = data[0];
-        cmdAck[3]           = data[1];
+/**
+ * @brief Lets clients stream an image to a co-processor on a UART with the target command.
+ * @param [in] port The UART, the application installs the driver with a transmit buffer and configures the flow control.
+ * @param [in] maxSize The largest image the co-processor accepts.
+ * @return True if enabled, false if an update is in progress.
+ * @details Writes block while the transmit buffer is full, use enablePipeline so this does not stall the BLE host.
+ */
+bool NimBLEOta::enableUartSink(uart_port_t port, uint32_t maxSize) {
+    if (isInProgress()) {
+        return false;
+    }
 
-        for (int i = 0; i < 20; i++) {
-            printf("%02x ", data[i]);
+    m_uartSink.m_port    = port;
+    m_uartSink.m_maxSize = maxSize;
+    return setSink(StreamSink, &m_uartSink);
+}
+
+int NimBLEOta::NimBLEOtaPartitionSink::open(const char* name) {
+    m_pPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+    if (m_pPartition == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "data partition %s not found", name);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    switch (m_pPartition->subtype) {
+        case ESP_PARTITION_SUBTYPE_DATA_OTA:
+        case ESP_PARTITION_SUBTYPE_DATA_PHY:
+        case ESP_PARTITION_SUBTYPE_DATA_NVS:
+        case ESP_PARTITION_SUBTYPE_DATA_NVS_KEYS:
+        case ESP_PARTITION_SUBTYPE_DATA_COREDUMP:
+        case ESP_PARTITION_SUBTYPE_DATA_EFUSE_EM:
+            NIMBLE_LOGE(LOG_TAG, "partition %s can not be updated", name);
+            m_pPartition = nullptr;
+            return ESP_ERR_NOT_SUPPORTED;
+        default:
+            return ESP_OK;
+    }
+}
+
+uint32_t NimBLEOta::NimBLEOtaPartitionSink::capacity() const {
+    return m_pPartition ? m_pPartition->size : 0;
+}
+
+int NimBLEOta::NimBLEOtaPartitionSink::begin(uint32_t imageSize) {
+    m_offset = 0;
+    m_erased = 0;
+    return m_pPartition ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+/**
+ * @brief Erases the flash sectors the data reaches into and writes it.
+ */
+int NimBLEOta::NimBLEOtaPartitionSink::write(const uint8_t* data, size_t length) {
+    esp_err_t err = ESP_OK;
+    if (m_offset + length > m_erased) {
+        uint32_t eraseEnd = (m_offset + length + flashSectorSize - 1) & ~(flashSectorSize - 1);
+        err               = esp_partition_erase_range(m_pPartition, m_erased, eraseEnd - m_erased);
+        m_erased          = eraseEnd;
+    }
+
+    if (err == ESP_OK) {
+        err = esp_partition_write(m_pPartition, m_offset, data, length);
+    }
+
+    if (err != ESP_OK) {
+        NIMBLE_LOGE(LOG_TAG, "partition write failed! err=0x%x", err);
+        return err;
+    }
+
+    m_offset += length;
+    return ESP_OK;
+}
+
+int NimBLEOta::NimBLEOtaPartitionSink::end() {
+    m_pPartition = nullptr;
+    return ESP_OK;
+}
+
+void NimBLEOta::NimBLEOtaPartitionSink::abort() {
+    m_pPartition = nullptr;
+}
+
+/**
+ * @brief Accepts paths below the base path without parent directory references.
+ * @details Restores the file from its backup if the device was reset while the last update replaced it.
+ */
+int NimBLEOta::NimBLEOtaFileSink::open(const char* name) {
+    size_t baseLen = strlen(m_basePath);
+    if (strncmp(name, m_basePath, baseLen) != 0 || name[baseLen] != '/' || strstr(name, "/..") != nullptr ||
+        strlen(name) >= sizeof(m_path)) {
+        NIMBLE_LOGE(LOG_TAG, "file %s is not below %s", name, m_basePath);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    strcpy(m_path, name);
+    snprintf(m_tmpPath, sizeof(m_tmpPath), "%s~", m_path);
+    snprintf(m_bakPath, sizeof(m_bakPath), "%s^", m_path);
+
+    struct stat st;
+    if (stat(m_bakPath, &st) == 0) {
+        if (stat(m_path, &st) == 0) {
+            remove(m_bakPath); // the new file was in place
+        } else if (rename(m_bakPath, m_path) == 0) {
+            NIMBLE_LOGW(LOG_TAG, "%s restored from its backup", m_path);
         }
-        printf("\n");
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Writes to a temporary file, which replaces the file when the update completes.
+ */
+int NimBLEOta::NimBLEOtaFileSink::begin(uint32_t imageSize) {
+    m_pFile = fopen(m_tmpPath, "wb");
+    if (m_pFile == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "failed to create %s", m_tmpPath);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+int NimBLEOta::NimBLEOtaFileSink::write(const uint8_t* data, size_t length) {
+    if (fwrite(data, 1, length, m_pFile) != length) {
+        NIMBLE_LOGE(LOG_TAG, "file write failed, filesystem full?");
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
 
-        if (getCrc16(data, 18) != crc || (cmd != startOtaCmd && cmd != stopOtaCmd)) {
-            NIMBLE_LOGE(LOG_TAG, "command %s error", cmd == startOtaCmd || cmd == stopOtaCmd ? "CRC" : "invalid");
-        } else if (cmd == startOtaCmd) {
-            if (m_pOta->isInProgress()) {
-                if (*reinterpret_cast<const uint32_t*>(data + 2) == m_pOta->m_fileLen) {
-                    NIMBLE_LOGW(LOG_TAG, "Ota resuming");
-                    m_pOta->m_pCallbacks->onStart(m_pOta, m_pOta->m_fileLen, NimBLEOta::Reconnected);
-                    cmdAck[4] = otaAccept;
-                    cmdAck[5] = (otaAccept >> 8) & 0xff;
-                } else {
-                    NIMBLE_LOGE(LOG_TAG, "Ota command error, file length mismatch - aborting");
-                    m_pOta->abortUpdate();
-                    m_pOta->m_pCallbacks->onError(m_pOta, ESP_FAIL, NimBLEOta::LengthError);
-                }
-            } else {
-                m_pOta->m_fileLen = *reinterpret_cast<const uint32_t*>(data + 2);
-                m_pOta->m_pBuf    = static_cast<uint8_t*>(malloc(OTA_BLOCK_SIZE * sizeof(uint8_t)));
-                if (m_pOta->m_pBuf == nullptr) {
-                    NIMBLE_LOGE(LOG_TAG, "%s -  malloc fail", __func__);
-                    goto SendAck;
-                } else {
-                    memset(m_pOta->m_pBuf, 0x0, OTA_BLOCK_SIZE);
-                }
-
-                const esp_partition_t* partition_ptr = esp_ota_get_boot_partition();
-                if (partition_ptr == NULL) {
-                    NIMBLE_LOGE(LOG_TAG, "boot partition NULL!\r\n");
-                    goto SendAck;
-                }
-
-                if (partition_ptr->type != ESP_PARTITION_TYPE_APP) {
-                    NIMBLE_LOGE(LOG_TAG, "esp_current_partition->type != ESP_PARTITION_TYPE_APP\r\n");
-                    goto SendAck;
-                }
-
-                if (partition_ptr->subtype == ESP_PARTITION_SUBTYPE_APP_FACTORY) {
-                    m_pOta->m_partition.subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0;
-                } else {
-                    const esp_partition_t* next_partition = esp_ota_get_next_update_partition(partition_ptr);
-                    if (next_partition) {
-                        m_pOta->m_partition.subtype = next_partition->subtype;
-                    } else {
-                        m_pOta->m_partition.subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0;
-                    }
-                }
-                m_pOta->m_partition.type = ESP_PARTITION_TYPE_APP;
-
-                partition_ptr = esp_partition_find_first(m_pOta->m_partition.type, m_pOta->m_partition.subtype, NULL);
-                if (partition_ptr == nullptr) {
-                    NIMBLE_LOGE(LOG_TAG, "partition NULL!\r\n");
-                    goto SendAck;
-                }
-
-                memcpy(&m_pOta->m_partition, partition_ptr, sizeof(esp_partition_t));
-                if (esp_ota_begin(&m_pOta->m_partition, OTA_SIZE_UNKNOWN, &m_pOta->m_writeHandle) != ESP_OK) {
-                    NIMBLE_LOGE(LOG_TAG, "esp_ota_begin failed!\r\n");
-                    goto SendAck;
-                }
-
-                cmdAck[4]            = otaAccept;
-                cmdAck[5]            = (otaAccept >> 8) & 0xff;
-                m_pOta->m_inProgress = true;
-                m_pOta->m_pCallbacks->onStart(m_pOta, m_pOta->m_fileLen, NimBLEOta::StartCmd);
-            }
-        } else if (cmd == stopOtaCmd) {
-            if (!m_pOta->isInProgress()) {
-                NIMBLE_LOGW(LOG_TAG, "ota not started");
-            } else {
-                cmdAck[4] = otaAccept;
-                cmdAck[5] = (otaAccept >> 8) & 0xff;
-                m_pOta->m_pCallbacks->onStop(m_pOta, NimBLEOta::StopCmd);
-            }
+/**
+ * @brief Replaces the file with the temporary file, one of them exists under its own name at any time.
+ * @details LittleFS renames over an existing file, FAT does not: the old file is then moved to a backup
+ * first, which open() restores if the device is reset before the new file is in place.
+ */
+int NimBLEOta::NimBLEOtaFileSink::end() {
+    int err = fclose(m_pFile);
+    m_pFile = nullptr;
+    if (err == 0 && rename(m_tmpPath, m_path) != 0) {
+        err = rename(m_path, m_bakPath) != 0 || rename(m_tmpPath, m_path) != 0;
+        if (err) {
+            rename(m_bakPath, m_path);
         } else {
-            NIMBLE_LOGE(LOG_TAG, "Unknown Command");
+            remove(m_bakPath);
         }
-    } else {
-        NIMBLE_LOGE(LOG_TAG, "command length error");
     }
 
-SendAck:
-    crc        = getCrc16(cmdAck, 18);
-    cmdAck[18] = crc;
-    cmdAck[19] = (crc >> 8) & 0xff;
-    pCharacteristic->setValue(cmdAck, CMD_ACK_LENGTH);
-    pCharacteristic->indicate();
+    if (err != 0) {
+        NIMBLE_LOGE(LOG_TAG, "failed to write %s", m_path);
+        remove(m_tmpPath);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
 }
 
-void NimBLEOta::NimBLEOtaCharacteristicCallbacks::onSubscribe(NimBLECharacteristic* pChar,
-                                                              NimBLEConnInfo&       connInfo,
-                                                              uint16_t              subValue) {
-    NIMBLE_LOGI(LOG_TAG, "Ota client conn_handle: %d, subscribed: %s", connInfo.getConnHandle(), subValue ? "true" : "false");
-    if (m_pOta->isInProgress() && m_pOta->m_clientAddr == connInfo.getIdAddress() && pChar->getUUID().equals(commandUuid)) {
-        if (!subValue) { // client disconnected
-            m_pOta->m_pCallbacks->onStop(m_pOta, NimBLEOta::Disconnected);
-        }
+void NimBLEOta::NimBLEOtaFileSink::abort() {
+    if (m_pFile != nullptr) {
+        fclose(m_pFile);
+        m_pFile = nullptr;
+        remove(m_tmpPath);
     }
 }
 
-void NimBLEOta::NimBLEOtaCharacteristicCallbacks::onWrite(NimBLECharacteristic* pChar, NimBLEConnInfo& connInfo) {
-    if (pChar->getUUID().equals(commandUuid)) {
-        commandOnWrite(pChar, connInfo);
-    } else if (pChar->getUUID().equals(recvFwUuid)) {
-        firmwareOnWrite(pChar, connInfo);
+int NimBLEOta::NimBLEOtaUartSink::begin(uint32_t imageSize) {
+    if (!uart_is_driver_installed(m_port)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (!sendAbortMarker()) {
+        NIMBLE_LOGE(LOG_TAG, "uart still sending the aborted image");
+        return ESP_ERR_INVALID_STATE;
     }
+
+    m_streaming = true;
+    return ESP_OK;
 }
 
-NimBLEService* NimBLEOta::start(NimBLEOtaCallbacks* pCallbacks, bool secure) {
-    m_pCallbacks = pCallbacks;
-    if (m_pCallbacks == nullptr) {
-        m_pCallbacks = &defaultCallbacks;
+int NimBLEOta::NimBLEOtaUartSink::write(const uint8_t* data, size_t length) {
+    if (uart_write_bytes(m_port, data, length) != static_cast<int>(length)) {
+        NIMBLE_LOGE(LOG_TAG, "uart write failed");
+        return ESP_FAIL;
     }
 
-    ble_npl_callout_init(&m_otaCallout, nimble_port_get_dflt_eventq(), NimBLEOta::abortTimerCb, this);
+    return ESP_OK;
+}
 
-    NimBLEService* pService   = NimBLEDevice::createServer()->createService(otaServiceUuid);
-    uint32_t       properties = NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::WRITE_NR | NIMBLE_PROPERTY::INDICATE;
-    if (secure) {
-        if (!ble_hs_cfg.sm_mitm ||
-            (ble_hs_cfg.sm_io_cap != BLE_HS_IO_DISPLAY_ONLY && ble_hs_cfg.sm_io_cap != BLE_HS_IO_KEYBOARD_DISPLAY)) {
-            NIMBLE_LOGE(LOG_TAG, "Error: Security requested without passkey authentication enabled!");
-        }
-        properties |= NIMBLE_PROPERTY::WRITE_AUTHEN | NIMBLE_PROPERTY::WRITE_ENC;
+int NimBLEOta::NimBLEOtaUartSink::end() {
+    int err = uart_wait_tx_done(m_port, pdMS_TO_TICKS(10000));
+    if (err == ESP_OK) {
+        m_streaming = false;
     }
+    return err;
+}
 
-    NimBLECharacteristic* pRecvFwCharacteristic = pService->createCharacteristic(recvFwUuid, properties);
-    pRecvFwCharacteristic->setCallbacks(&m_charCallbacks);
+/**
+ * @brief Ends the image early with the abort marker, the bytes already queued for transmission cannot be taken back.
+ */
+void NimBLEOta::NimBLEOtaUartSink::abort() {
+    if (m_streaming) {
+        m_streaming    = false;
+        m_abortPending = true;
+        sendAbortMarker();
+    }
+}
 
-    NimBLECharacteristic* pCommandCharacteristic = pService->createCharacteristic(commandUuid, properties);
-    pCommandCharacteristic->setCallbacks(&m_charCallbacks);
+/**
+ * @brief Sends the abort marker, a CAN byte followed by a break, once the transmit buffer is empty.
+ * @details Does not wait, a write would block while the co-processor holds the flow control.
+ * @return False if the marker is still pending.
+ */
+bool NimBLEOta::NimBLEOtaUartSink::sendAbortMarker() {
+    if (!m_abortPending) {
+        return true;
+    }
 
-    /* TODO Customer Characteristic
-    NimBLECharacteristic *pCustomerCharacteristic = pService->createCharacteristic(CUSTOMER_UUID, NIMBLE_PROPERTY::WRITE
-    | NIMBLE_PROPERTY::INDICATE); pCustomerCharacteristic->setCallbacks(&m_charCallbacks);
-    */
+    if (uart_wait_tx_done(m_port, 0) != ESP_OK) {
+        return false;
+    }
 
-    /* TODO OTA Bar Characteristic
-    NimBLECharacteristic *pOtaBarCharacteristic = pService->createCharacteristic(OTA_BAR_UUID, NIMBLE_PROPERTY::WRITE |
-    NIMBLE_PROPERTY::INDICATE); pOtaBarCharacteristic->setCallbacks(&m_charCallbacks);
-    */
+    static const char cancel = 0x18;
+    uart_write_bytes_with_break(m_port, &cancel, 1, uartAbortBreak);
+    m_abortPending = false;
+    return true;
+}
+#endif
 
-    pService->start();
-    return pService;
+#if NIMBLE_OTA_L2CAP
+/**
+ * @brief Offers an L2CAP channel for the firmware packets, clients that support it send them as SDUs
+ * with credit based flow control instead of GATT writes. Commands and acks stay on GATT.
+ * @param [in] psm The dynamic LE PSM to listen on, 0x80 to 0xff.
+ * @param [in] mtu The largest SDU accepted, a whole sector with its crc and the 3 byte header is sent in one.
+ * @return True if the L2CAP service was created, false if an update is in progress or it failed.
+ * @details Call after NimBLEDevice::init, the PSM is sent in the start command ACK.
+ */
+bool NimBLEOta::enableL2cap(uint16_t psm, uint16_t mtu) {
+    if (isInProgress()) {
+        return false;
+    }
+
+    if (NimBLEDevice::createL2CAPServer()->createService(psm, mtu, &m_l2capCallbacks) == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "L2CAP service create failed, psm: 0x%x", psm);
+        return false;
+    }
+
+    m_transport.m_psm = psm;
+    return true;
 }
 
-NimBLEUUID NimBLEOta::getServiceUUID() const {
-    return otaServiceUuid;
+/**
+ * @brief Checks the channel is from the client updating, encrypted and authenticated if the service is secure,
+ * as the firmware characteristic requires for writes.
+ * @details The peer is matched by its identity address, a client that reconnected to resume opens its channel
+ * on a new connection.
+ */
+bool NimBLEOta::NimBLEOtaL2capCallbacks::isClientChannel(NimBLEL2CAPChannel* pChannel) const {
+    NimBLEConnInfo connInfo = NimBLEDevice::getServer()->getPeerInfoByHandle(pChannel->getConnHandle());
+    if (!m_pOta->isInProgress() || !m_pOta->m_client.isClient(connInfo.getIdAddress())) {
+        NIMBLE_LOGW(LOG_TAG, "L2CAP data from unknown client - rejected");
+        return false;
+    }
+
+    if (m_pOta->m_secure && (!connInfo.isEncrypted() || !connInfo.isAuthenticated())) {
+        NIMBLE_LOGW(LOG_TAG, "L2CAP channel not encrypted and authenticated - rejected");
+        return false;
+    }
+
+    return true;
 }
 
-void NimBLEOta::abortUpdate() {
-    if (m_pBuf != nullptr) {
-        free(m_pBuf);
-        m_pBuf = nullptr;
+/**
+ * @brief Accepts one channel at a time from the client once it has started an update.
+ */
+bool NimBLEOta::NimBLEOtaL2capCallbacks::shouldAcceptConnection(NimBLEL2CAPChannel* pChannel) {
+    return m_pChannel == nullptr && isClientChannel(pChannel);
+}
+
+void NimBLEOta::NimBLEOtaL2capCallbacks::onConnect(NimBLEL2CAPChannel* pChannel, uint16_t negotiatedMTU) {
+    NIMBLE_LOGI(LOG_TAG, "L2CAP data channel connected, mtu: %u", negotiatedMTU);
+    m_pChannel                     = pChannel;
+    m_pOta->m_transport.m_l2capMtu = negotiatedMTU;
+}
+
+void NimBLEOta::NimBLEOtaL2capCallbacks::onRead(NimBLEL2CAPChannel* pChannel, std::vector<uint8_t>& data) {
+    if (pChannel == m_pChannel && isClientChannel(pChannel)) {
+        m_pOta->handleFirmware(data.data(), data.size());
     }
+}
 
-    m_recvLen    = 0;
-    m_offset     = 0;
-    m_packet     = 0;
-    m_sector     = 0;
-    m_fileLen    = 0;
-    m_clientAddr = NimBLEAddress{};
-    m_inProgress = false;
-    esp_ota_abort(m_writeHandle);
+void NimBLEOta::NimBLEOtaL2capCallbacks::onDisconnect(NimBLEL2CAPChannel* pChannel) {
+    if (pChannel == m_pChannel) {
+        m_pChannel                     = nullptr;
+        m_pOta->m_transport.m_l2capMtu = 0;
+    }
 }
+#endif
 
-bool NimBLEOta::startAbortTimer(uint32_t seconds) {
-    ble_npl_time_t ticks;
-    ble_npl_time_ms_to_ticks(seconds * 1000, &ticks);
-    return ble_npl_callout_reset(&m_otaCallout, ticks) == BLE_NPL_OK;
+#if NIMBLE_OTA_SIGNATURE
+/**
+ * @brief Sets the key that checks the signature clients send with the signature command before the image is committed.
+ * @param [in] key The public key in PEM, including the terminating null, or DER format, ECDSA or RSA.
+ * @param [in] length The length of the key.
+ * @param [in] required Reject updates without a signature, otherwise only images sent with one are checked.
+ * @return True if the key was parsed, false if it is invalid or an update is in progress.
+ * @details Signed updates can not use sync updates or resume after a reset as the whole image has to be hashed in order.
+ */
+bool NimBLEOta::setPublicKey(const uint8_t* key, size_t length, bool required) {
+    if (isInProgress()) {
+        return false;
+    }
+
+    if (m_verifier.setKey(key, length) != 0) {
+        NIMBLE_LOGE(LOG_TAG, "invalid public key");
+        setVerifier(nullptr, false);
+        return false;
+    }
+
+    setVerifier(&m_verifier, required);
+    return true;
 }
 
-void NimBLEOta::stopAbortTimer() {
-    ble_npl_callout_stop(&m_otaCallout);
+NimBLEOta::NimBLEOtaSignatureVerifier::NimBLEOtaSignatureVerifier() {
+    mbedtls_sha256_init(&m_sha);
+    mbedtls_pk_init(&m_key);
 }
 
-void NimBLEOta::abortTimerCb(ble_npl_event* event) {
-    NimBLEOta* pOta = static_cast<NimBLEOta*>(ble_npl_event_get_arg(event));
-    NIMBLE_LOGW(LOG_TAG, "Abort timer expired: aborting update!");
-    pOta->abortUpdate();
+NimBLEOta::NimBLEOtaSignatureVerifier::~NimBLEOtaSignatureVerifier() {
+    mbedtls_sha256_free(&m_sha);
+    mbedtls_pk_free(&m_key);
 }
 
-uint16_t NimBLEOta::NimBLEOtaCharacteristicCallbacks::getCrc16(const uint8_t* buf, int len) {
-    uint16_t crc = 0;
-    int32_t  i;
+int NimBLEOta::NimBLEOtaSignatureVerifier::setKey(const uint8_t* key, size_t length) {
+    mbedtls_pk_free(&m_key);
+    mbedtls_pk_init(&m_key);
+    return mbedtls_pk_parse_public_key(&m_key, key, length);
+}
 
-    while (len--) {
-        crc ^= *buf++ << 8;
+int NimBLEOta::NimBLEOtaSignatureVerifier::begin() {
+    return NIMBLE_OTA_SHA256(mbedtls_sha256_starts)(&m_sha, 0) == 0 ? ESP_OK : ESP_FAIL;
+}
 
-        for (i = 0; i < 8; i++) {
-            if (crc & 0x8000) {
-                crc = (crc << 1) ^ 0x1021;
-            } else {
-                crc = crc << 1;
-            }
-        }
+int NimBLEOta::NimBLEOtaSignatureVerifier::update(const uint8_t* data, size_t length) {
+    return NIMBLE_OTA_SHA256(mbedtls_sha256_update)(&m_sha, data, length) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+int NimBLEOta::NimBLEOtaSignatureVerifier::finish(uint8_t* digest) {
+    return NIMBLE_OTA_SHA256(mbedtls_sha256_finish)(&m_sha, digest) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+bool NimBLEOta::NimBLEOtaSignatureVerifier::verify(const uint8_t* digest, const uint8_t* sig, size_t length) {
+    int ret = mbedtls_pk_verify(&m_key, MBEDTLS_MD_SHA256, digest, 32, sig, length);
+    if (ret != 0) {
+        NIMBLE_LOGE(LOG_TAG, "signature verify failed, err=-0x%x", static_cast<unsigned>(-ret));
+    }
+
+    return ret == 0;
+}
+#endif
+
+#if NIMBLE_OTA_DELTA_UPDATES
+int NimBLEOta::NimBLEOtaRunningImage::read(uint32_t offset, uint8_t* data, size_t length) {
+    return esp_partition_read(esp_ota_get_running_partition(), offset, data, length);
+}
+
+uint32_t NimBLEOta::NimBLEOtaRunningImage::size() const {
+    return esp_ota_get_running_partition()->size;
+}
+
+bool NimBLEOta::NimBLEOtaRunningImage::getHash(uint8_t* hash) {
+    return esp_partition_get_sha256(esp_ota_get_running_partition(), hash) == ESP_OK;
+}
+#endif
+
+void NimBLEOta::NimBLEOtaAckTransport::sendCommandAck(const uint8_t* data, size_t length) {
+    m_pCommandChr->setValue(data, length);
+    m_pCommandChr->indicate();
+}
+
+/**
+ * @brief Sends a firmware ack, may be called from the pipeline workers.
+ * @details The value is passed to notify or indicate directly rather than set on the characteristic,
+ * so the attribute value is not shared with the BLE host task.
+ */
+void NimBLEOta::NimBLEOtaAckTransport::sendFirmwareAck(const uint8_t* data, size_t length, bool notify) {
+    // Use the requested ack type if the client subscribed to it, otherwise fall back to what it did subscribe to.
+    bool subNotify = m_fwSubValue & 0x1;
+    bool subIndic  = m_fwSubValue & 0x2;
+    if (notify ? subNotify || !subIndic : subNotify && !subIndic) {
+        m_pRecvFwChr->notify(data, length);
+    } else {
+        m_pRecvFwChr->indicate(data, length);
+    }
+}
+
+/**
+ * @brief Moves the sector verification and flash writes out of the BLE host task into worker tasks.
+ * @param [in] buffers The number of 4KB sector buffers, 2 to NIMBLE_OTA_MAX_BUFFERS.
+ * @param [in] core The core to pin the worker tasks to, by default the app core on dual core devices.
+ * @return True if the workers were started.
+ * @details Must be called when an update is not in progress. The client is asked to resend a sector
+ * when all buffers are waiting to be written to flash.
+ */
+bool NimBLEOta::enablePipeline(uint8_t buffers, BaseType_t core) {
+    m_scheduler.m_core = core;
+    return setPipeline(&m_scheduler, std::max<uint8_t>(2, buffers));
+}
+
+bool NimBLEOta::NimBLEOtaTaskScheduler::begin(NimBLEOtaCore* pCore) {
+    if (m_verifyTask != nullptr) {
+        return true;
+    }
+
+    ble_npl_event_init(&m_hostEvent, hostEventCb, pCore);
+    if (xTaskCreatePinnedToCore(verifyTask,
+                                "ota_verify",
+                                NIMBLE_OTA_WORKER_STACK_SIZE,
+                                pCore,
+                                NIMBLE_OTA_WORKER_PRIORITY,
+                                &m_verifyTask,
+                                m_core) != pdPASS) {
+        m_verifyTask = nullptr;
+        return false;
+    }
+
+    if (xTaskCreatePinnedToCore(flashTask,
+                                "ota_flash",
+                                NIMBLE_OTA_WORKER_STACK_SIZE,
+                                pCore,
+                                NIMBLE_OTA_WORKER_PRIORITY,
+                                &m_flashTask,
+                                m_core) != pdPASS) {
+        vTaskDelete(m_verifyTask);
+        m_verifyTask = nullptr;
+        m_flashTask  = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+void NimBLEOta::NimBLEOtaTaskScheduler::wake(Stage stage) {
+    switch (stage) {
+        case Verify:
+            xTaskNotifyGive(m_verifyTask);
+            break;
+        case Flash:
+            xTaskNotifyGive(m_flashTask);
+            break;
+        case Host:
+            ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &m_hostEvent);
+            break;
+    }
+}
+
+void NimBLEOta::NimBLEOtaTaskScheduler::yield() {
+    vTaskDelay(1);
+}
+
+void NimBLEOta::NimBLEOtaTaskScheduler::verifyTask(void* arg) {
+    NimBLEOtaCore* pCore = static_cast<NimBLEOtaCore*>(arg);
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        pCore->runVerifyStage();
     }
+}
+
+void NimBLEOta::NimBLEOtaTaskScheduler::flashTask(void* arg) {
+    NimBLEOtaCore* pCore = static_cast<NimBLEOtaCore*>(arg);
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        pCore->runFlashStage();
+    }
+}
 
-    return crc;
+void NimBLEOta::NimBLEOtaTaskScheduler::hostEventCb(ble_npl_event* event) {
+    static_cast<NimBLEOtaCore*>(ble_npl_event_get_arg(event))->runHostStage();
+}
+
+void NimBLEOta::NimBLEOtaCalloutTimer::init(NimBLEOta* pOta) {
+    ble_npl_callout_init(&m_callout, nimble_port_get_dflt_eventq(), NimBLEOta::abortTimerCb, pOta);
+}
+
+bool NimBLEOta::NimBLEOtaCalloutTimer::start(uint32_t ms) {
+    ble_npl_time_t ticks;
+    ble_npl_time_ms_to_ticks(ms, &ticks);
+    return ble_npl_callout_reset(&m_callout, ticks) == BLE_NPL_OK;
+}
+
+void NimBLEOta::NimBLEOtaCalloutTimer::stop() {
+    ble_npl_callout_stop(&m_callout);
 }
 
 static const char* CB_LOG_TAG = "Default-NimBLEOtaCallbacks";
 
 void NimBLEOtaCallbacks::onStart(NimBLEOta* ota, uint32_t firmwareSize, NimBLEOta::Reason reason) {
-    NIMBLE_LOGI(CB_LOG_TAG, "OTA started, firmware size: %" PRIu32, "Reason: %u", firmwareSize, reason);
+    NIMBLE_LOGI(CB_LOG_TAG, "OTA started, firmware size: %" PRIu32 ", Reason: %u", firmwareSize, reason);
 }
 
 void NimBLEOtaCallbacks::onProgress(NimBLEOta* ota, uint32_t current, uint32_t total) {
-    NIMBLE_LOGI(CB_LOG_TAG, "OTA progress: %.f%%", current / total * 100.f);
+    NIMBLE_LOGI(CB_LOG_TAG, "OTA progress: %.f%%", total ? current * 100.f / total : 0.f);
+}
+
+void NimBLEOtaCallbacks::onImageProgress(NimBLEOta* ota, uint32_t written, uint32_t imageSize) {
+    NIMBLE_LOGD(CB_LOG_TAG, "OTA image written: %" PRIu32 " of %" PRIu32 " bytes", written, imageSize);
 }
 
 void NimBLEOtaCallbacks::onStop(NimBLEOta* ota, NimBLEOta::Reason reason) {
@@ -403,6 +1428,11 @@ void NimBLEOtaCallbacks::onStop(NimBLEOta* ota, NimBLEOta::Reason reason) {
 }
 
 void NimBLEOtaCallbacks::onComplete(NimBLEOta* ota) {
+    if (ota->getSinkType() != NimBLEOta::AppSink) {
+        NIMBLE_LOGI(CB_LOG_TAG, "OTA complete, sink type: %u", ota->getSinkType());
+        return;
+    }
+
     NIMBLE_LOGI(CB_LOG_TAG, "OTA complete - restarting in 2 seconds");
     vTaskDelay(2000 / portTICK_PERIOD_MS);
     esp_restart();
@@ -411,4 +1441,16 @@ void NimBLEOtaCallbacks::onComplete(NimBLEOta* ota) {
 void NimBLEOtaCallbacks::onError(NimBLEOta* ota, esp_err_t err, NimBLEOta::Reason reason) {
     NIMBLE_LOGE(CB_LOG_TAG, "OTA error: 0x%x, Reason: %u - aborting", err, reason);
     ota->abortUpdate();
+}
+
+void NimBLEOtaCallbacks::onLinkUpdate(NimBLEOta* ota, const NimBLEOtaLinkInfo& info) {
+    NIMBLE_LOGI(CB_LOG_TAG,
+                "OTA link: interval %u.%02u ms, latency %u, timeout %u ms, MTU %u, PHY tx %u rx %u",
+                info.interval * 125 / 100,
+                info.interval * 125 % 100,
+                info.latency,
+                info.timeout * 10,
+                info.mtu,
+                info.txPhy,
+                info.rxPhy);
 }
\ No newline at end of file
@@ -5,37 +5,244 @@
 #ifndef NIMBLE_OTA_H_
 #define NIMBLE_OTA_H_
 
+#include <esp_idf_version.h>
 #include <esp_ota_ops.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
 #include <NimBLEAddress.h>
 #include <NimBLECharacteristic.h>
+#include "NimBLEOtaCore.h"
+#include "NimBLEOtaInflate.h"
+#include "NimBLEOtaPatch.h"
+
+#ifdef CONFIG_PM_ENABLE
+# include <esp_pm.h>
+#endif
+
+#ifndef NIMBLE_OTA_WORKER_CORE
+# define NIMBLE_OTA_WORKER_CORE (portNUM_PROCESSORS - 1)
+#endif
+
+#ifndef NIMBLE_OTA_WORKER_STACK_SIZE
+# define NIMBLE_OTA_WORKER_STACK_SIZE 4096
+#endif
+
+#ifndef NIMBLE_OTA_WORKER_PRIORITY
+# define NIMBLE_OTA_WORKER_PRIORITY (tskIDLE_PRIORITY + 5)
+#endif
+
+/** Events queued for the application when the callbacks are asynchronous, see NimBLEOta::enableAsyncCallbacks. */
+#ifndef NIMBLE_OTA_CALLBACK_QUEUE_LENGTH
+# define NIMBLE_OTA_CALLBACK_QUEUE_LENGTH 8
+#endif
+
+#ifndef NIMBLE_OTA_CALLBACK_STACK_SIZE
+# define NIMBLE_OTA_CALLBACK_STACK_SIZE 4096
+#endif
+
+#ifndef NIMBLE_OTA_CALLBACK_PRIORITY
+# define NIMBLE_OTA_CALLBACK_PRIORITY (tskIDLE_PRIORITY + 1)
+#endif
+
+/** Flash sectors erased ahead of the write position, 16 lets the flash use 64KB block erases. */
+#ifndef NIMBLE_OTA_ERASE_AHEAD
+# define NIMBLE_OTA_ERASE_AHEAD 16
+#endif
+
+#ifndef NIMBLE_OTA_DELTA_UPDATES
+# define NIMBLE_OTA_DELTA_UPDATES 1
+#endif
+
+#ifndef NIMBLE_OTA_SINKS
+# define NIMBLE_OTA_SINKS 1
+#endif
+
+#if NIMBLE_OTA_SINKS
+# include <driver/uart.h>
+# include <stdio.h>
+# include <sys/stat.h>
+#endif
+
+#ifndef NIMBLE_OTA_SECTOR_SYNC
+# define NIMBLE_OTA_SECTOR_SYNC 1
+#endif
+
+// The firmware data channel needs L2CAP CoC enabled in the NimBLE config
+#ifndef NIMBLE_OTA_L2CAP
+# if defined(CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM) && CONFIG_BT_NIMBLE_L2CAP_COC_MAX_NUM > 0
+#  define NIMBLE_OTA_L2CAP 1
+# else
+#  define NIMBLE_OTA_L2CAP 0
+# endif
+#endif
+
+#if NIMBLE_OTA_L2CAP
+# include <NimBLEL2CAPChannel.h>
+# include <NimBLEL2CAPServer.h>
+#endif
+
+/** The dynamic LE PSM of the firmware data channel. */
+#ifndef NIMBLE_OTA_L2CAP_PSM
+# define NIMBLE_OTA_L2CAP_PSM 0x0080
+#endif
+
+/** The largest SDU received on the data channel, a 4KB block with its crc and the packet header by default. */
+#ifndef NIMBLE_OTA_L2CAP_MTU
+# define NIMBLE_OTA_L2CAP_MTU (4096 + 2 + 3)
+#endif
+
+#ifndef NIMBLE_OTA_SIGNATURE
+# define NIMBLE_OTA_SIGNATURE 1
+#endif
+
+#if NIMBLE_OTA_SIGNATURE
+# include <mbedtls/pk.h>
+# include <mbedtls/sha256.h>
+#endif
+
+// Resuming after a reset needs esp_ota_resume, added in esp-idf 5.3
+#ifndef NIMBLE_OTA_RESUME
+# define NIMBLE_OTA_RESUME (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 3, 0))
+#endif
+
+// The statistics characteristic, the counters are kept by the core and available with getStats() either way
+#ifndef NIMBLE_OTA_STATS
+# define NIMBLE_OTA_STATS 1
+#endif
+
+/** Minimum time between notifications of the statistics on the progress characteristic, in ms. */
+#ifndef NIMBLE_OTA_STATS_INTERVAL
+# define NIMBLE_OTA_STATS_INTERVAL 1000
+#endif
 
 class NimBLEOtaCallbacks;
 struct ble_npl_callout;
 
+/**
+ * @brief The link parameters requested from the client while an update is in progress, see NimBLEOta::start.
+ * @details The defaults suit most phones, the central decides what is used.
+ */
+struct NimBLEOtaLinkParams {
+    uint16_t minInterval{6};  // 1.25ms units, 7.5ms
+    uint16_t maxInterval{12}; // 1.25ms units, 15ms
+    uint16_t latency{0};
+    uint16_t timeout{400};    // 10ms units, 4s
+    uint16_t dataLen{251};    // link layer payload, 0 leaves it unchanged
+    bool     phy2M{true};
+    bool     pmLock{true};    // hold the CPU at its maximum frequency, with power management enabled
+};
+
+/**
+ * @brief The link parameters in use, reported by NimBLEOtaCallbacks::onLinkUpdate.
+ */
+struct NimBLEOtaLinkInfo {
+    uint16_t interval; // 1.25ms units
+    uint16_t latency;
+    uint16_t timeout;  // 10ms units
+    uint16_t mtu;
+    uint8_t  txPhy;    // 1 1M, 2 2M, 3 coded
+    uint8_t  rxPhy;
+};
+
 /**
  * @brief A model of the BLE OTA Service
  */
-class NimBLEOta {
+class NimBLEOta : public NimBLEOtaCore {
   public:
-    NimBLEOta() = default;
-    NimBLEService* start(NimBLEOtaCallbacks* pCallbacks = nullptr, bool secure = false);
-    void           abortUpdate();
-    bool           startAbortTimer(uint32_t seconds);
-    void           stopAbortTimer();
-    bool           isInProgress() const { return m_inProgress; };
+    NimBLEOta() : NimBLEOtaCore(&m_flash, &m_transport, &m_timer) {
+#if NIMBLE_OTA_HAS_INFLATE
+        setDecompressor(&m_inflate);
+#endif
+#if NIMBLE_OTA_DELTA_UPDATES
+        setPatcher(&m_patcher);
+#endif
+#if NIMBLE_OTA_RESUME
+        setCheckpoint(&m_checkpoint);
+#endif
+#if NIMBLE_OTA_SECTOR_SYNC
+        setSectorSync(&m_sync);
+#endif
+    }
+
+    NimBLEService* start(NimBLEOtaCallbacks*        pCallbacks  = nullptr,
+                         bool                       secure      = false,
+                         const NimBLEOtaLinkParams* pLinkParams = nullptr);
+    void           abortUpdate() override;
+    bool           enablePipeline(uint8_t buffers = 4, BaseType_t core = NIMBLE_OTA_WORKER_CORE);
+    void           setStatsInterval(uint32_t ms);
+    bool           enableAsyncCallbacks(uint8_t    queueLength = NIMBLE_OTA_CALLBACK_QUEUE_LENGTH,
+                                        bool       createTask  = true,
+                                        BaseType_t core        = NIMBLE_OTA_WORKER_CORE);
+    bool           processCallbacks(TickType_t wait = 0);
+    void           setProgressInterval(uint8_t percent, uint32_t ms = 0);
+#if NIMBLE_OTA_SINKS
+    bool enablePartitionSink();
+    bool enableFileSink(const char* basePath, uint32_t maxSize);
+    bool enableUartSink(uart_port_t port, uint32_t maxSize);
+#endif
+#if NIMBLE_OTA_L2CAP
+    bool enableL2cap(uint16_t psm = NIMBLE_OTA_L2CAP_PSM, uint16_t mtu = NIMBLE_OTA_L2CAP_MTU);
+#endif
+#if NIMBLE_OTA_SIGNATURE
+    bool setPublicKey(const uint8_t* key, size_t length, bool required = true);
+#endif
+#if NIMBLE_OTA_TRACE
+    void dumpTrace() const;
+#endif
     NimBLEUUID     getServiceUUID() const;
 
-    enum Reason {
-        StartCmd,
-        StopCmd,
-        Disconnected,
-        Reconnected,
-        FlashError,
-        LengthError,
+  private:
+    template <uint32_t, uint8_t, uint32_t>
+    friend class NimBLEOtaStatic;
+
+    /** @brief A callback to deliver, queued when the callbacks are asynchronous. */
+    struct NimBLEOtaEvent {
+        enum Type : uint8_t {
+            Start,
+            Progress,
+            ImageProgress,
+            Stop,
+            Complete,
+            Error,
+            LinkUpdate,
+        };
+
+        Type    type;
+        uint8_t reason;
+        union {
+            struct {
+                uint32_t current; // firmware size for Start
+                uint32_t total;
+            } progress;
+            int32_t           err;
+            NimBLEOtaLinkInfo link;
+        };
+    };
+
+    /** @brief The last progress delivered, for the coalescing set with setProgressInterval. */
+    struct NimBLEOtaProgressGate {
+        uint32_t sent;
+        int64_t  time; // us
     };
 
-  private:
     static void abortTimerCb(ble_npl_event* event);
+    static void abortEventCb(ble_npl_event* event);
+    static void callbackTask(void* arg);
+    bool        dispatch(NimBLEOtaEvent::Type type, uint8_t reason = 0, uint32_t current = 0, uint32_t total = 0);
+    bool        post(const NimBLEOtaEvent& event);
+    void        deliver(const NimBLEOtaEvent& event);
+    bool        progressDue(const NimBLEOtaProgressGate& gate, uint32_t current, uint32_t total) const;
+    void        notifyStats(bool force);
+    void        requestLink();
+    void        checkLink();
+    void        releaseLink();
+    void        onOtaStart(uint32_t firmwareSize, Reason reason) override;
+    void        onOtaProgress(uint32_t current, uint32_t total) override;
+    void        onOtaImageProgress(uint32_t written, uint32_t imageSize) override;
+    void        onOtaStop(Reason reason) override;
+    void        onOtaComplete() override;
+    void        onOtaError(int err, Reason reason) override;
 
     class NimBLEOtaCharacteristicCallbacks : public NimBLECharacteristicCallbacks {
       public:
@@ -43,25 +250,259 @@ class NimBLEOta {
         void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override;
         void onSubscribe(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo, uint16_t subValue) override;
         void commandOnWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo);
-        void firmwareOnWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo);
 
       private:
-        uint16_t   getCrc16(const uint8_t* buf, int len);
         NimBLEOta* m_pOta{nullptr};
     } m_charCallbacks{this};
 
-    NimBLEOtaCallbacks* m_pCallbacks{nullptr};
-    ble_npl_callout     m_otaCallout{};
-    NimBLEAddress       m_clientAddr{};
-    esp_ota_handle_t    m_writeHandle{};
-    esp_partition_t     m_partition{};
-    uint32_t            m_fileLen{};
-    uint32_t            m_recvLen{};
-    uint8_t*            m_pBuf{nullptr};
-    uint16_t            m_sector{};
-    uint16_t            m_offset{};
-    uint8_t             m_packet{};
-    bool                m_inProgress{false};
+    /**
+     * @brief The firmware characteristic, the written data is passed straight to the receive path
+     * without being stored in the characteristic value.
+     */
+    class NimBLEOtaFirmwareCharacteristic : public NimBLECharacteristic {
+      public:
+        NimBLEOtaFirmwareCharacteristic(NimBLEOta* pOta, uint16_t properties, NimBLEService* pService);
+
+      private:
+        void writeEvent(const uint8_t* val, uint16_t len, NimBLEConnInfo& connInfo) override;
+
+        NimBLEOta* m_pOta{nullptr};
+    };
+
+    class NimBLEOtaEspFlash : public NimBLEOtaFlash {
+      public:
+        int  begin(uint32_t imageSize) override;
+        int  write(const uint8_t* data, size_t length) override;
+        int  end() override;
+        void abort() override;
+#if NIMBLE_OTA_RESUME
+        int resume(uint32_t offset, uint16_t crc) override;
+#endif
+
+      private:
+        esp_ota_handle_t m_writeHandle{};
+        esp_partition_t  m_partition{};
+        uint32_t         m_offset{};
+        uint32_t         m_erased{};
+        uint32_t         m_eraseEnd{}; // image size rounded up to a sector
+        bool             m_eraseAhead{false};
+    } m_flash;
+
+    class NimBLEOtaAckTransport : public NimBLEOtaTransport {
+      public:
+        void sendCommandAck(const uint8_t* data, size_t length) override;
+        void sendFirmwareAck(const uint8_t* data, size_t length, bool notify) override;
+        uint16_t dataChannel() const override { return m_psm; }
+        uint16_t mtu() const override { return m_l2capMtu ? m_l2capMtu : m_attMtu; }
+
+        NimBLECharacteristic* m_pCommandChr{nullptr};
+        NimBLECharacteristic* m_pRecvFwChr{nullptr};
+        uint16_t              m_fwSubValue{};
+        uint16_t              m_psm{};
+        uint16_t              m_attMtu{};   // of the client connection
+        uint16_t              m_l2capMtu{}; // of the data channel while it is connected
+    } m_transport;
+
+    class NimBLEOtaCalloutTimer : public NimBLEOtaTimer {
+      public:
+        void init(NimBLEOta* pOta);
+        bool start(uint32_t ms) override;
+        void stop() override;
+
+      private:
+        ble_npl_callout m_callout{};
+    } m_timer;
+
+    class NimBLEOtaTaskScheduler : public NimBLEOtaScheduler {
+      public:
+        bool begin(NimBLEOtaCore* pCore) override;
+        void wake(Stage stage) override;
+        void yield() override;
+
+        BaseType_t m_core{NIMBLE_OTA_WORKER_CORE};
+
+      private:
+        static void verifyTask(void* arg);
+        static void flashTask(void* arg);
+        static void hostEventCb(ble_npl_event* event);
+
+        TaskHandle_t  m_verifyTask{nullptr};
+        TaskHandle_t  m_flashTask{nullptr};
+        ble_npl_event m_hostEvent{};
+    } m_scheduler;
+
+#if NIMBLE_OTA_HAS_INFLATE
+    NimBLEOtaInflate m_inflate;
+#endif
+
+#if NIMBLE_OTA_DELTA_UPDATES
+    class NimBLEOtaRunningImage : public NimBLEOtaBaseImage {
+      public:
+        int      read(uint32_t offset, uint8_t* data, size_t length) override;
+        uint32_t size() const override;
+        bool     getHash(uint8_t* hash) override;
+    } m_runningImage;
+
+    NimBLEOtaDeltaPatcher m_patcher{&m_runningImage, &m_flash};
+#endif
+
+#if NIMBLE_OTA_SECTOR_SYNC
+    class NimBLEOtaEspSectorSync : public NimBLEOtaSectorSync {
+      public:
+        int  begin(uint32_t imageSize) override;
+        int  write(const uint8_t* data, size_t length) override;
+        int  end() override;
+        void abort() override;
+        bool reuse(uint32_t offset, uint32_t length, const uint8_t* hash) override;
+        int  seek(uint32_t offset) override;
+
+      private:
+        esp_ota_handle_t       m_writeHandle{};
+        const esp_partition_t* m_pPartition{nullptr};
+        uint32_t               m_offset{};
+        uint32_t               m_written{};
+    } m_sync;
+#endif
+
+#if NIMBLE_OTA_SINKS
+    /**
+     * @brief Writes the image to a data partition selected by its label, erasing it as it is written.
+     */
+    class NimBLEOtaPartitionSink : public NimBLEOtaSink {
+      public:
+        int      open(const char* name) override;
+        uint32_t capacity() const override;
+        int      begin(uint32_t imageSize) override;
+        int      write(const uint8_t* data, size_t length) override;
+        int      end() override;
+        void     abort() override;
+
+      private:
+        const esp_partition_t* m_pPartition{nullptr};
+        uint32_t               m_offset{};
+        uint32_t               m_erased{};
+    } m_partitionSink;
+
+    /**
+     * @brief Writes the image to a file below a base path, it replaces the file once complete.
+     */
+    class NimBLEOtaFileSink : public NimBLEOtaSink {
+      public:
+        int      open(const char* name) override;
+        uint32_t capacity() const override { return m_maxSize; }
+        int      begin(uint32_t imageSize) override;
+        int      write(const uint8_t* data, size_t length) override;
+        int      end() override;
+        void     abort() override;
+
+        const char* m_basePath{nullptr};
+        uint32_t    m_maxSize{};
+
+      private:
+        char  m_path[NIMBLE_OTA_MAX_SINK_NAME]{};
+        char  m_tmpPath[NIMBLE_OTA_MAX_SINK_NAME + 1]{};
+        char  m_bakPath[NIMBLE_OTA_MAX_SINK_NAME + 1]{}; // the old file while the new one is moved into place
+        FILE* m_pFile{nullptr};
+    } m_fileSink;
+
+    /**
+     * @brief Streams the image to a co-processor over a UART configured by the application,
+     * writes block while the transmit buffer is full. An aborted image is followed by a CAN byte (0x18) and a break,
+     * sent when the transmit buffer has drained or before the next image.
+     */
+    class NimBLEOtaUartSink : public NimBLEOtaSink {
+      public:
+        int      open(const char* name) override { return ESP_OK; }
+        uint32_t capacity() const override { return m_maxSize; }
+        int      begin(uint32_t imageSize) override;
+        int      write(const uint8_t* data, size_t length) override;
+        int      end() override;
+        void     abort() override;
+
+        uart_port_t m_port{UART_NUM_1};
+        uint32_t    m_maxSize{};
+
+      private:
+        bool sendAbortMarker();
+
+        bool m_streaming{false};
+        bool m_abortPending{false};
+    } m_uartSink;
+#endif
+
+#if NIMBLE_OTA_SIGNATURE
+    /**
+     * @brief Hashes the image with mbedtls and checks its ECDSA or RSA signature with the public key set.
+     */
+    class NimBLEOtaSignatureVerifier : public NimBLEOtaVerifier {
+      public:
+        NimBLEOtaSignatureVerifier();
+        ~NimBLEOtaSignatureVerifier() override;
+        int  setKey(const uint8_t* key, size_t length);
+        int  begin() override;
+        int  update(const uint8_t* data, size_t length) override;
+        int  finish(uint8_t* digest) override;
+        bool verify(const uint8_t* digest, const uint8_t* sig, size_t length) override;
+
+      private:
+        mbedtls_sha256_context m_sha{};
+        mbedtls_pk_context     m_key{};
+    } m_verifier;
+#endif
+
+#if NIMBLE_OTA_L2CAP
+    /**
+     * @brief Receives the firmware packets of the update on an L2CAP channel, one packet per SDU.
+     */
+    class NimBLEOtaL2capCallbacks : public NimBLEL2CAPChannelCallbacks {
+      public:
+        NimBLEOtaL2capCallbacks(NimBLEOta* pOta) : m_pOta(pOta) {}
+        bool shouldAcceptConnection(NimBLEL2CAPChannel* pChannel) override;
+        void onConnect(NimBLEL2CAPChannel* pChannel, uint16_t negotiatedMTU) override;
+        void onRead(NimBLEL2CAPChannel* pChannel, std::vector<uint8_t>& data) override;
+        void onDisconnect(NimBLEL2CAPChannel* pChannel) override;
+
+      private:
+        bool isClientChannel(NimBLEL2CAPChannel* pChannel) const;
+
+        NimBLEOta*          m_pOta{nullptr};
+        NimBLEL2CAPChannel* m_pChannel{nullptr};
+    } m_l2capCallbacks{this};
+#endif
+
+#if NIMBLE_OTA_RESUME
+    class NimBLEOtaNvsCheckpoint : public NimBLEOtaCheckpoint {
+      public:
+        bool load(NimBLEOtaCheckpointData* pData) override;
+        bool save(const NimBLEOtaCheckpointData& data) override;
+        void clear() override;
+    } m_checkpoint;
+#endif
+
+    using ClientSession = NimBLEOtaClientSession<NimBLEAddress>;
+
+    NimBLEOtaCallbacks*   m_pCallbacks{nullptr};
+    ClientSession         m_client{};
+    bool                  m_secure{false};
+    bool                  m_linkGovernor{false};
+    bool                  m_linkActive{false};
+    NimBLEOtaLinkParams   m_linkParams{};
+    NimBLEOtaLinkInfo     m_savedLink{}; // restored when the update ends
+    NimBLEOtaLinkInfo     m_reportedLink{};
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_lock_handle_t  m_pmLock{nullptr};
+#endif
+    NimBLECharacteristic* m_pStatsChr{nullptr};
+    bool                  m_statsSubscribed{false};
+    uint32_t              m_statsInterval{NIMBLE_OTA_STATS_INTERVAL};
+    int64_t               m_statsSent{}; // us
+    QueueHandle_t         m_eventQueue{nullptr};
+    TaskHandle_t          m_callbackTask{nullptr}; // the task delivering the queued callbacks
+    ble_npl_event         m_abortEvent{};
+    uint8_t               m_progressStep{0};     // percent, 0 reports every sector
+    uint32_t              m_progressInterval{0}; // ms
+    NimBLEOtaProgressGate m_progressGate{};
+    NimBLEOtaProgressGate m_imageGate{};
 };
 
 class NimBLEOtaCallbacks {
@@ -69,9 +510,55 @@ class NimBLEOtaCallbacks {
     virtual ~NimBLEOtaCallbacks() = default;
     virtual void onStart(NimBLEOta* ota, uint32_t firmwareSize, NimBLEOta::Reason reason);
     virtual void onProgress(NimBLEOta* ota, uint32_t current, uint32_t total);
+    virtual void onImageProgress(NimBLEOta* ota, uint32_t written, uint32_t imageSize);
     virtual void onStop(NimBLEOta* ota, NimBLEOta::Reason reason);
     virtual void onComplete(NimBLEOta* ota);
     virtual void onError(NimBLEOta* ota, esp_err_t err, NimBLEOta::Reason reason);
+    virtual void onLinkUpdate(NimBLEOta* ota, const NimBLEOtaLinkInfo& info);
+};
+
+/**
+ * @brief NimBLEOta with the memory for an update reserved statically, no heap is allocated when an update starts.
+ * @tparam BlockSize The largest block size a client may request, a power of 2 from 4096 to NIMBLE_OTA_MAX_BLOCK_SIZE.
+ * @tparam Buffers The number of sector buffers, 2 or more to use the receive pipeline.
+ * @tparam MaxImageSize The largest image of a sync update, sizes the map of the sectors the client has to send.
+ * @details Features are removed with the NIMBLE_OTA_* build flags, their buffers are then not reserved either.
+ */
+template <uint32_t BlockSize = 4096, uint8_t Buffers = 1, uint32_t MaxImageSize = 0x400000>
+class NimBLEOtaStatic : public NimBLEOta {
+    static_assert(BlockSize >= 4096 && BlockSize <= NIMBLE_OTA_MAX_BLOCK_SIZE && (BlockSize & (BlockSize - 1)) == 0,
+                  "BlockSize must be a power of 2 from 4096 to NIMBLE_OTA_MAX_BLOCK_SIZE");
+    static_assert(Buffers >= 1 && Buffers <= NIMBLE_OTA_MAX_BUFFERS, "Buffers must be 1 to NIMBLE_OTA_MAX_BUFFERS");
+
+  public:
+    NimBLEOtaStatic() {
+        setMaxBlockSize(BlockSize);
+        setBuffers({m_pool,
+                    sizeof(m_pool),
+                    NIMBLE_OTA_SECTOR_SYNC ? m_sectorMap : nullptr,
+                    sizeof(m_sectorMap),
+                    NIMBLE_OTA_SIGNATURE ? m_signature : nullptr});
+#if NIMBLE_OTA_HAS_INFLATE
+        m_inflate.setBuffers(&m_inflator, m_dict);
+#endif
+    }
+
+    /**
+     * @brief Starts the receive pipeline with the sector buffers reserved.
+     */
+    bool enablePipeline(BaseType_t core = NIMBLE_OTA_WORKER_CORE) {
+        static_assert(Buffers >= 2, "the pipeline needs at least 2 buffers");
+        return NimBLEOta::enablePipeline(Buffers, core);
+    }
+
+  private:
+    uint8_t m_pool[Buffers * (BlockSize + 2)]{};
+    uint8_t m_sectorMap[NIMBLE_OTA_SECTOR_SYNC ? (MaxImageSize / 4096 + 7) / 8 : 1]{};
+    uint8_t m_signature[NIMBLE_OTA_SIGNATURE ? NIMBLE_OTA_MAX_SIGNATURE : 1]{};
+#if NIMBLE_OTA_HAS_INFLATE
+    tinfl_decompressor m_inflator{};
+    uint8_t            m_dict[NIMBLE_OTA_INFLATE_DICT_SIZE]{};
+#endif
 };
 
 #endif // NIMBLE_OTA_H_
\ No newline at end of file
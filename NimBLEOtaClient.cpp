@@ -0,0 +1,405 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#include "NimBLEOtaClient.h"
+#include "NimBLEOtaLog.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#define MIN_BLOCK_SIZE 4096u
+#define MAX_PACKET     512u // largest attribute value
+
+static constexpr uint16_t startOtaCmd   = 0x0001;
+static constexpr uint16_t ackOtaCmd     = 0x0003;
+static constexpr uint16_t otaFwSuccess  = 0x0000;
+static constexpr uint16_t crcError      = 0x0001;
+static constexpr uint16_t lenError      = 0x0003;
+static constexpr uint16_t busyError     = 0x0004;
+static constexpr uint16_t missingError  = 0x0005;
+static constexpr uint8_t  flagNotifyAck = 0x01;
+static constexpr uint8_t  flagBlockPos  = 3;
+static constexpr uint8_t  flagSelective = 0x40;
+static constexpr uint8_t  missingSpan   = 80;
+static constexpr uint8_t  maxStartTries = 3;
+static constexpr uint8_t  maxTimeouts   = 3; // in a row before the target is given up
+static const char*        LOG_TAG       = "NimBLEOtaClient";
+
+/**
+ * @brief Allocates the sector slots and reads the image id used to resume an interrupted update.
+ * @param [in] maxBlockSize The largest block size a target may use.
+ * @param [in] slots The number of sectors cached, at least one per target sending at the same time.
+ */
+bool NimBLEOtaSectorCache::begin(uint32_t maxBlockSize, uint8_t slots) {
+    end();
+    slots   = std::min<uint8_t>(std::max<uint8_t>(slots, 1), NIMBLE_OTA_CLIENT_MAX_SLOTS);
+    m_pPool = static_cast<uint8_t*>(malloc(slots * (maxBlockSize + 2)));
+    if (m_pPool == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "%s -  malloc fail", __func__);
+        return false;
+    }
+
+    for (uint8_t i = 0; i < slots; i++) {
+        m_slots[i]       = Slot{};
+        m_slots[i].pData = m_pPool + i * (maxBlockSize + 2);
+    }
+
+    uint8_t hash[32];
+    if (m_pImage->getHash(hash)) {
+        memcpy(m_imageId, hash, sizeof(m_imageId));
+    } else {
+        memset(m_imageId, 0, sizeof(m_imageId)); // the targets will not resume
+    }
+
+    m_maxBlockSize = maxBlockSize;
+    m_slotCount    = slots;
+    m_useCount     = 0;
+    m_reads        = 0;
+    return true;
+}
+
+void NimBLEOtaSectorCache::end() {
+    free(m_pPool);
+    m_pPool     = nullptr;
+    m_slotCount = 0;
+}
+
+/**
+ * @brief Gets a sector followed by its crc, reading it from the image if it is not cached.
+ * @param [out] ppData The sector, held until released.
+ * @param [out] pLength The sector length including the crc.
+ * @return Acquired, or why the sector is not available, only NoSlot is temporary.
+ */
+NimBLEOtaSectorCache::Result NimBLEOtaSectorCache::acquire(uint32_t        sector,
+                                                           uint32_t        blockSize,
+                                                           const uint8_t** ppData,
+                                                           size_t*         pLength) {
+    uint32_t offset = sector * blockSize;
+    if (offset >= m_imageSize || blockSize > m_maxBlockSize) {
+        return BadSector;
+    }
+
+    Slot* pFree = nullptr;
+    for (uint8_t i = 0; i < m_slotCount; i++) {
+        Slot& slot = m_slots[i];
+        if (slot.blockSize == blockSize && slot.sector == sector) {
+            slot.refs++;
+            slot.lastUse = ++m_useCount;
+            *ppData      = slot.pData;
+            *pLength     = slot.length;
+            return Acquired;
+        }
+
+        if (slot.refs == 0 && (pFree == nullptr || slot.lastUse < pFree->lastUse)) {
+            pFree = &slot;
+        }
+    }
+
+    if (pFree == nullptr) {
+        return NoSlot;
+    }
+
+    uint32_t len     = std::min(blockSize, m_imageSize - offset);
+    pFree->blockSize = 0;
+    if (m_pImage->read(offset, pFree->pData, len) != 0) {
+        NIMBLE_LOGE(LOG_TAG, "image read failed, offset: %u", static_cast<unsigned>(offset));
+        return ReadError;
+    }
+
+    uint16_t crc          = NimBLEOtaCore::getCrc16(pFree->pData, len);
+    pFree->pData[len]     = crc & 0xff;
+    pFree->pData[len + 1] = crc >> 8;
+    pFree->sector         = sector;
+    pFree->blockSize      = blockSize;
+    pFree->length         = len + 2;
+    pFree->refs           = 1;
+    pFree->lastUse        = ++m_useCount;
+    *ppData               = pFree->pData;
+    *pLength              = pFree->length;
+    m_reads++;
+    return Acquired;
+}
+
+void NimBLEOtaSectorCache::release(const uint8_t* pData) {
+    for (uint8_t i = 0; i < m_slotCount; i++) {
+        if (m_slots[i].pData == pData && m_slots[i].refs) {
+            m_slots[i].refs--;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Sends the start command, the target resumes the image if it was interrupted.
+ * @param [in] window The sectors to keep in flight, the target may lower it.
+ * @param [in] blockSize The largest block size to request, rounded down to 4096 << n, the target may lower it.
+ * @return False if the command could not be sent.
+ */
+bool NimBLEOtaClientCore::start(uint8_t window, uint32_t blockSize, uint32_t nowMs) {
+    uint32_t fileLen   = m_pCache->imageSize();
+    uint8_t  blockBits = 0;
+    while ((MIN_BLOCK_SIZE << (blockBits + 1)) <= blockSize && blockBits < 3) { // the cache slots hold blockSize
+        blockBits++;
+    }
+
+    abort();
+    memset(m_startCmd, 0, sizeof(m_startCmd));
+    m_startCmd[0] = startOtaCmd & 0xff;
+    m_startCmd[1] = (startOtaCmd >> 8) & 0xff;
+    m_startCmd[2] = fileLen & 0xff;
+    m_startCmd[3] = (fileLen >> 8) & 0xff;
+    m_startCmd[4] = (fileLen >> 16) & 0xff;
+    m_startCmd[5] = (fileLen >> 24) & 0xff;
+    m_startCmd[6] = (window > 1 ? flagNotifyAck : 0) | flagSelective | (blockBits << flagBlockPos);
+    m_startCmd[7] = window;
+    memcpy(m_startCmd + 12, m_pCache->imageId(), 6);
+    uint16_t crc   = NimBLEOtaCore::getCrc16(m_startCmd, 18);
+    m_startCmd[18] = crc & 0xff;
+    m_startCmd[19] = crc >> 8;
+
+    m_bytesSent  = 0;
+    m_retries    = 0;
+    m_timeouts   = 0;
+    m_startTries = 1;
+    m_waitMs     = nowMs;
+    m_state      = m_pLink->sendCommand(m_startCmd, sizeof(m_startCmd)) ? Starting : Failed;
+    return m_state == Starting;
+}
+
+void NimBLEOtaClientCore::handleCommandAck(const uint8_t* data, size_t length, uint32_t nowMs) {
+    if (m_state != Starting || length < 20) {
+        return;
+    }
+
+    uint16_t ack = data[0] | (data[1] << 8);
+    uint16_t cmd = data[2] | (data[3] << 8);
+    if (NimBLEOtaCore::getCrc16(data, 18) != (data[18] | (data[19] << 8))) {
+        // Corrupted, send the command again.
+        m_pLink->sendCommand(m_startCmd, sizeof(m_startCmd));
+        m_waitMs = nowMs;
+        return;
+    }
+
+    if (ack != ackOtaCmd || cmd != startOtaCmd) {
+        return;
+    }
+
+    if (data[4] != 0 || data[5] != 0) {
+        NIMBLE_LOGE(LOG_TAG, "start command rejected");
+        m_state = Failed;
+        return;
+    }
+
+    m_window       = std::max<uint8_t>(1, data[7]);
+    m_blockSize    = MIN_BLOCK_SIZE << ((data[6] >> flagBlockPos) & 0x07);
+    m_resumeOffset = data[8] | (data[9] << 8) | (data[10] << 16) | (static_cast<uint32_t>(data[11]) << 24);
+    m_sectors      = (m_pCache->imageSize() + m_blockSize - 1) / m_blockSize;
+    m_base         = m_resumeOffset / m_blockSize;
+    m_next         = m_base;
+    m_waitMs       = nowMs;
+    m_state        = m_base >= m_sectors ? Complete : Sending;
+    NIMBLE_LOGI(LOG_TAG,
+                "update started, window: %u, block size: %u, resume at: %u",
+                m_window,
+                static_cast<unsigned>(m_blockSize),
+                static_cast<unsigned>(m_resumeOffset));
+}
+
+/**
+ * @brief Handles a firmware ack the same way scripts/nimbleota.py does.
+ */
+void NimBLEOtaClientCore::handleFirmwareAck(const uint8_t* data, size_t length, uint32_t nowMs) {
+    if (m_state != Sending || length < 20) {
+        return;
+    }
+
+    m_waitMs = nowMs;
+    if (NimBLEOtaCore::getCrc16(data, 18) != (data[18] | (data[19] << 8))) {
+        m_retries++;
+        dropSector();
+        m_next = m_base;
+        return;
+    }
+
+    uint16_t status = data[2] | (data[3] << 8);
+    uint32_t pos    = std::min<uint32_t>(data[4] | (data[5] << 8), m_sectors);
+    m_timeouts      = 0; // the target is responding, even if it asks for a resend
+    if (status == otaFwSuccess) {
+        // Acks are cumulative, the sector acked is the last one written.
+        m_base = std::max(m_base, pos + 1);
+        if (m_base >= m_sectors) {
+            dropSector();
+            m_state = Complete;
+        }
+        return;
+    }
+
+    m_retries++;
+    if (status == missingError && pos < m_sectors) {
+        // Resend the missing packets followed by the last one, the sectors in flight after it were dropped.
+        dropSector();
+        if (!acquireSector(pos)) {
+            rewind(pos); // the whole sector is sent once a slot is free, unless the update failed
+            return;
+        }
+
+        m_sendSector   = pos;
+        m_packet       = 0;
+        m_missingFirst = data[6] | (data[7] << 8);
+        memcpy(m_missingMap, data + 8, sizeof(m_missingMap));
+        m_base = pos;
+        m_next = pos + 1;
+        return;
+    }
+
+    if (status == busyError) {
+        m_backoff   = true;
+        m_backoffMs = nowMs + NIMBLE_OTA_CLIENT_BUSY_BACKOFF_MS;
+    } else if (status != crcError && status != lenError) {
+        NIMBLE_LOGD(LOG_TAG, "sector error, resending sector: %u", static_cast<unsigned>(pos));
+    }
+
+    rewind(pos);
+}
+
+/**
+ * @brief Sends what the window allows and checks the ack timeout, returns when the link has no room.
+ */
+void NimBLEOtaClientCore::poll(uint32_t nowMs) {
+    uint32_t timeout = NIMBLE_OTA_CLIENT_ACK_TIMEOUT_MS * (m_blockSize / MIN_BLOCK_SIZE);
+    if (m_state == Starting) {
+        if (nowMs - m_waitMs > NIMBLE_OTA_CLIENT_ACK_TIMEOUT_MS) {
+            m_waitMs = nowMs;
+            if (m_startTries++ >= maxStartTries || !m_pLink->sendCommand(m_startCmd, sizeof(m_startCmd))) {
+                NIMBLE_LOGE(LOG_TAG, "no start command ack");
+                m_state = Failed;
+            }
+        }
+        return;
+    }
+
+    if (m_state != Sending) {
+        return;
+    }
+
+    if (m_backoff) {
+        if (static_cast<int32_t>(nowMs - m_backoffMs) < 0) {
+            return;
+        }
+        m_backoff = false;
+    }
+
+    while (m_state == Sending) {
+        if (m_pSector == nullptr && m_next < m_sectors && m_next - m_base < m_window && acquireSector(m_next)) {
+            m_sendSector   = m_next++;
+            m_packet       = 0;
+            m_missingFirst = 0xffff;
+        }
+
+        if (m_pSector != nullptr && sendPackets(nowMs)) {
+            dropSector();
+            continue;
+        }
+
+        // The window is full, the other targets hold every slot or the link has no room.
+        if (m_state != Sending || nowMs - m_waitMs <= timeout) {
+            return;
+        }
+
+        NIMBLE_LOGD(LOG_TAG, "ack timeout, resending from sector %u", static_cast<unsigned>(m_base));
+        m_retries++;
+        m_waitMs = nowMs;
+        rewind(m_base);
+        if (++m_timeouts >= maxTimeouts) {
+            NIMBLE_LOGE(LOG_TAG, "target stopped responding");
+            m_state = Failed;
+        }
+    }
+}
+
+/**
+ * @brief Sends the packets of the sector held, or the missing ones and the last when resending.
+ * @return False if the link had no room, the next poll continues from the same packet.
+ */
+bool NimBLEOtaClientCore::sendPackets(uint32_t nowMs) {
+    uint8_t  pkt[3 + MAX_PACKET];
+    size_t   maxBytes = std::min<size_t>(MAX_PACKET, m_pLink->mtu() - 3) - 3;
+    uint16_t chunks   = (m_sectorLen + maxBytes - 1) / maxBytes;
+    uint16_t secIdx   = m_sectorLen == m_blockSize + 2 ? m_sendSector : 0xffff; // the last sector is sent as 0xffff
+
+    for (; m_packet < chunks; m_packet++) {
+        uint16_t i    = m_packet;
+        uint16_t span = i - m_missingFirst - 1;
+        if (m_missingFirst != 0xffff && i != chunks - 1 && i != m_missingFirst &&
+            (i < m_missingFirst || span >= missingSpan || !(m_missingMap[span / 8] & (1 << (span % 8))))) {
+            continue;
+        }
+
+        size_t off   = i * maxBytes;
+        size_t chunk = std::min(maxBytes, m_sectorLen - off);
+        pkt[0]       = secIdx & 0xff;
+        pkt[1]       = secIdx >> 8;
+        pkt[2]       = i == chunks - 1 ? 0xff : (i ? (i - 1) % 254 + 1 : 0); // wraps from 254 to 1 in large blocks
+        memcpy(pkt + 3, m_pSector + off, chunk);
+        if (!m_pLink->sendFirmware(pkt, chunk + 3)) {
+            return false;
+        }
+
+        m_bytesSent += chunk;
+        m_waitMs     = nowMs;
+    }
+
+    return true;
+}
+
+void NimBLEOtaClientCore::rewind(uint32_t pos) {
+    dropSector();
+    m_base = pos;
+    m_next = pos;
+}
+
+/**
+ * @brief Holds a sector of the image to send, the update fails if it cannot be read.
+ * @return False if no slot is free or the update failed.
+ */
+bool NimBLEOtaClientCore::acquireSector(uint32_t sector) {
+    NimBLEOtaSectorCache::Result res = m_pCache->acquire(sector, m_blockSize, &m_pSector, &m_sectorLen);
+    if (res == NimBLEOtaSectorCache::Acquired) {
+        return true;
+    }
+
+    if (res != NimBLEOtaSectorCache::NoSlot) {
+        NIMBLE_LOGE(LOG_TAG,
+                    "cannot send sector %u, %s",
+                    static_cast<unsigned>(sector),
+                    res == NimBLEOtaSectorCache::ReadError ? "image read failed" : "block size larger than the cache");
+        m_state = Failed;
+    }
+    return false;
+}
+
+void NimBLEOtaClientCore::dropSector() {
+    if (m_pSector != nullptr) {
+        m_pCache->release(m_pSector);
+        m_pSector = nullptr;
+    }
+    m_missingFirst = 0xffff;
+}
+
+/**
+ * @brief Stops sending, the target keeps what it verified and resumes from it on the next start.
+ */
+void NimBLEOtaClientCore::abort() {
+    dropSector();
+    m_backoff = false;
+    m_state   = Idle;
+}
+
+uint32_t NimBLEOtaClientCore::getAcked() const {
+    if (m_state == Complete) {
+        return m_pCache->imageSize();
+    }
+    return m_state == Sending ? std::min(m_base * m_blockSize, m_pCache->imageSize()) : 0;
+}
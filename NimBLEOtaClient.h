@@ -0,0 +1,147 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#ifndef NIMBLE_OTA_CLIENT_H_
+#define NIMBLE_OTA_CLIENT_H_
+
+#include "NimBLEOtaPatch.h"
+
+#include <cstddef>
+#include <cstdint>
+
+/** Sector slots of the cache shared by the targets of a fan-out update. */
+#ifndef NIMBLE_OTA_CLIENT_MAX_SLOTS
+# define NIMBLE_OTA_CLIENT_MAX_SLOTS 16
+#endif
+
+/** Ack timeout per 4KB of block size and the busy back-off, as used by scripts/nimbleota.py. */
+#ifndef NIMBLE_OTA_CLIENT_ACK_TIMEOUT_MS
+# define NIMBLE_OTA_CLIENT_ACK_TIMEOUT_MS 5000
+#endif
+
+#ifndef NIMBLE_OTA_CLIENT_BUSY_BACKOFF_MS
+# define NIMBLE_OTA_CLIENT_BUSY_BACKOFF_MS 100
+#endif
+
+/**
+ * @brief Writes to one target device, i.e. the remote OTA characteristics of a NimBLEClient on device.
+ */
+class NimBLEOtaClientLink {
+  public:
+    virtual ~NimBLEOtaClientLink()                                    = default;
+    virtual bool     sendCommand(const uint8_t* data, size_t length)  = 0; // write with response, command characteristic
+    virtual bool     sendFirmware(const uint8_t* data, size_t length) = 0; // write without response, false if no room
+    virtual uint16_t mtu() const                                      = 0;
+};
+
+/**
+ * @brief Sectors of the image read once and shared by the targets of a fan-out update.
+ * @details A slot holds a sector followed by its crc, it is read when a target first asks for it and
+ * handed to the other targets while it is cached. Targets hold a slot while they send the sector,
+ * the least recently used free slot is replaced, so targets more than the free slots apart read a sector again.
+ */
+class NimBLEOtaSectorCache {
+  public:
+    explicit NimBLEOtaSectorCache(NimBLEOtaBaseImage* pImage, uint32_t imageSize)
+        : m_pImage(pImage), m_imageSize(imageSize) {}
+    ~NimBLEOtaSectorCache() { end(); }
+
+    enum Result : uint8_t {
+        Acquired,
+        NoSlot,    // the other targets hold every slot, try again later
+        ReadError, // the image could not be read
+        BadSector, // beyond the image, or a block larger than the slots
+    };
+
+    bool           begin(uint32_t maxBlockSize, uint8_t slots);
+    void           end();
+    Result         acquire(uint32_t sector, uint32_t blockSize, const uint8_t** ppData, size_t* pLength);
+    void           release(const uint8_t* pData);
+    uint32_t       imageSize() const { return m_imageSize; }
+    const uint8_t* imageId() const { return m_imageId; }
+    uint32_t       reads() const { return m_reads; }
+
+  private:
+    struct Slot {
+        uint8_t* pData;
+        uint32_t sector;
+        uint32_t blockSize; // 0 if empty
+        uint32_t lastUse;
+        uint16_t length;    // with the crc
+        uint16_t refs;
+    };
+
+    NimBLEOtaBaseImage* m_pImage;
+    uint32_t            m_imageSize;
+    uint8_t*            m_pPool{nullptr};
+    uint32_t            m_maxBlockSize{0};
+    Slot                m_slots[NIMBLE_OTA_CLIENT_MAX_SLOTS]{};
+    uint8_t             m_slotCount{0};
+    uint8_t             m_imageId[6]{};
+    uint32_t            m_useCount{0};
+    uint32_t            m_reads{0};
+};
+
+/**
+ * @brief The OTA protocol as a client, sending an image to one target device.
+ * @details Speaks to the 0x8018 service like scripts/nimbleota.py: a window of sectors in flight, cumulative acks,
+ * rewinds on errors, a back-off when the device is busy, only the missing packets resent and resuming where an
+ * interrupted update of the same image stopped. Independent of the BLE stack, the owner passes the acks in and
+ * calls poll with the time in ms, from one task.
+ */
+class NimBLEOtaClientCore {
+  public:
+    enum State : uint8_t {
+        Idle,
+        Starting, // start command sent, waiting for its ack
+        Sending,
+        Complete,
+        Failed,
+    };
+
+    NimBLEOtaClientCore(NimBLEOtaSectorCache* pCache, NimBLEOtaClientLink* pLink) : m_pCache(pCache), m_pLink(pLink) {}
+
+    bool     start(uint8_t window, uint32_t blockSize, uint32_t nowMs);
+    void     handleCommandAck(const uint8_t* data, size_t length, uint32_t nowMs);
+    void     handleFirmwareAck(const uint8_t* data, size_t length, uint32_t nowMs);
+    void     poll(uint32_t nowMs);
+    void     abort();
+    State    getState() const { return m_state; }
+    uint32_t getAcked() const; // bytes of the image the target has verified
+    uint32_t getResumeOffset() const { return m_resumeOffset; }
+    uint32_t getBytesSent() const { return m_bytesSent; }
+    uint16_t getRetries() const { return m_retries; }
+
+  private:
+    bool acquireSector(uint32_t sector);
+    void dropSector();
+    bool sendPackets(uint32_t nowMs);
+    void rewind(uint32_t pos);
+
+    NimBLEOtaSectorCache* m_pCache;
+    NimBLEOtaClientLink*  m_pLink;
+    State                 m_state{Idle};
+    uint8_t               m_window{1};
+    uint32_t              m_blockSize{4096};
+    uint32_t              m_sectors{0};
+    uint32_t              m_base{0};        // oldest sector not acked
+    uint32_t              m_next{0};        // next sector to send
+    uint32_t              m_resumeOffset{0};
+    uint32_t              m_waitMs{0};      // last ack or packet sent, for the ack timeout
+    uint32_t              m_backoffMs{0};   // do not send before, after a busy ack
+    bool                  m_backoff{false};
+    uint8_t               m_startTries{0};
+    uint8_t               m_startCmd[20]{};
+    const uint8_t*        m_pSector{nullptr}; // sector being sent, held in the cache
+    size_t                m_sectorLen{0};
+    uint32_t              m_sendSector{0};
+    uint16_t              m_packet{0};      // next packet of the sector to send
+    uint16_t              m_missingFirst{0xffff};
+    uint8_t               m_missingMap[10]{}; // missing packets after m_missingFirst, when resending
+    uint32_t              m_bytesSent{0};
+    uint16_t              m_retries{0};
+    uint8_t               m_timeouts{0}; // ack timeouts since the last ack
+};
+
+#endif // NIMBLE_OTA_CLIENT_H_
@@ -0,0 +1,1557 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#include "NimBLEOtaCore.h"
+#include "NimBLEOtaCrc.h"
+#include "NimBLEOtaLog.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#define CMD_ACK_LENGTH 20
+#define FW_ACK_LENGTH  20
+#define MIN_BLOCK_SIZE 4096u
+
+static constexpr uint16_t startOtaCmd   = 0x0001;
+static constexpr uint16_t stopOtaCmd    = 0x0002;
+static constexpr uint16_t ackOtaCmd     = 0x0003;
+static constexpr uint16_t syncOtaCmd    = 0x0004;
+static constexpr uint16_t targetOtaCmd  = 0x0005;
+static constexpr uint16_t signOtaCmd    = 0x0006;
+static constexpr uint16_t otaAccept     = 0x0000;
+static constexpr uint16_t otaReject     = 0x0001;
+static constexpr uint16_t crcError      = 0x0001;
+static constexpr uint16_t indexError    = 0x0002;
+static constexpr uint16_t otaFwSuccess  = 0x0000;
+static constexpr uint16_t lenError      = 0x0003;
+static constexpr uint16_t busyError     = 0x0004;
+static constexpr uint16_t missingError  = 0x0005;
+static constexpr uint8_t  flagNotifyAck = 0x01;
+static constexpr uint8_t  flagCompress  = 0x02;
+static constexpr uint8_t  flagDelta     = 0x04;
+static constexpr uint8_t  flagBlockMask = 0x38; // block size as 4KB << n
+static constexpr uint8_t  flagBlockPos  = 3;
+static constexpr uint8_t  flagSelective = 0x40; // nack missing packets instead of failing the sector
+static constexpr uint8_t  flagSync      = 0x80; // only the sectors the device does not have are sent
+static constexpr size_t   syncHashLen   = 8;
+static constexpr size_t   syncMaxHashes = 63; // fits the largest attribute value
+static constexpr uint8_t  missingSpan   = 80;   // packets after the first missing one reported in a nack
+static constexpr int      otaOk         = 0;
+static constexpr int      otaFail       = -1; // ESP_FAIL
+static const char*        LOG_TAG       = "NimBLEOta";
+
+#if NIMBLE_OTA_TRACE
+# define OTA_TRACE(event, sector, arg, value) \
+     m_trace.record(NimBLEOtaTrace::event, sector, arg, value, static_cast<uint32_t>(nowUs()))
+#else
+# define OTA_TRACE(event, sector, arg, value)
+#endif
+
+void NimBLEOtaCore::handleFirmware(const uint8_t* data, size_t length) {
+    if (!m_inProgress) {
+        NIMBLE_LOGW(LOG_TAG, "ota not started");
+        return;
+    }
+
+    if (length < 3) {
+        NIMBLE_LOGE(LOG_TAG, "firmware packet too short: %u bytes", static_cast<unsigned>(length));
+        return;
+    }
+
+    if (m_syncBusy.load(std::memory_order_acquire)) {
+        if (data[2] == 0xff) { // the client sent firmware before the sync ack
+            sendFirmwareAck(data[0] | (data[1] << 8), busyError, data[0] | (data[1] << 8));
+        }
+        return;
+    }
+
+    syncRewind();
+    HostStats& stats = m_hostStats.local();
+    stats.packets++;
+    stats.bytesReceived += length - 3;
+    uint16_t mtu         = m_pTransport->mtu(); // estimated from the largest write if the transport does not know it
+    stats.mtu            = mtu ? mtu : std::max<uint16_t>(stats.mtu, length + 3);
+    m_hostStats.publish();
+
+    NimBLEOtaSector* pSector    = nullptr;
+    uint16_t         otaResp    = otaFwSuccess;
+    uint32_t         sectorPos  = static_cast<uint32_t>(m_sector) * m_blockSize;
+    uint32_t         sectorLen  = std::min(m_blockSize, m_fileLen - std::min(sectorPos, m_fileLen)) + 2; // with the crc
+    uint16_t         recvSector = data[0] | (data[1] << 8);
+    OTA_TRACE(Packet, recvSector, data[2], length - 3);
+
+    // The last sector is sent with the index 0xffff.
+    if (recvSector != m_sector && !(recvSector == 0xffff && m_fileLen - sectorPos <= m_blockSize)) {
+        if (data[2] == 0xff) { // only send ack after last packet received due to write without response not waiting
+            if (m_nacked) {
+                // Sectors in flight when the missing packets were requested, the client will resend them.
+                return;
+            }
+
+            if (m_rewinding) {
+                // Sectors already in flight when the error ack was sent, the client will resend them.
+                resetSector();
+                return;
+            }
+
+            NIMBLE_LOGE(LOG_TAG, "Sector index error, expected: %u, received: %u", m_sector, recvSector);
+            otaResp = indexError;
+            goto SendAck;
+        }
+
+        return;
+    }
+
+    if (!m_nacked && (data[2] == 0 || (data[2] == 0xff && length - 3 == sectorLen))) {
+        // First packet of the sector (or the whole last sector), drop anything left from an incomplete one.
+        m_rewinding = false;
+        resetSector();
+        m_sectorStart = nowUs();
+        if (m_sector < m_nextNewSector) {
+            stats.retransmits++;
+        } else {
+            m_nextNewSector = m_sector + 1;
+        }
+    } else if (m_rewinding) {
+        // Waiting for the client to resend the sector from the start.
+        return;
+    }
+
+    if (m_pCurSector == nullptr && !m_freeQueue.pop(m_pCurSector)) {
+        // All sector buffers are waiting for the flash, tell the client to resend this sector later.
+        NIMBLE_LOGW(LOG_TAG, "No free sector buffer, sector: %u", m_sector);
+        otaResp = busyError;
+        goto SendAck;
+    }
+
+    if (m_selective) {
+        if (!storePacket(data[2], data + 3, length - 3, sectorLen)) {
+            otaResp = lenError;
+            goto SendAck;
+        }
+    } else {
+        if (data[2] != m_packet && data[2] != 0xff) {
+            // There is no response for out of sequence packet error, will fail crc or length check
+            NIMBLE_LOGE(LOG_TAG, "packet sequence error, cur: %u, recv: %u", m_packet, data[2]);
+        }
+
+        if (m_offset + length - 3 > m_blockSize + 2u) {
+            // Drop the data so the buffer is not overrun, the sector will fail the length check.
+            NIMBLE_LOGE(LOG_TAG, "sector overflow, offset: %u, length: %u", m_offset, static_cast<unsigned>(length - 3));
+        } else {
+            memcpy(m_pCurSector->pData + m_offset, data + 3, length - 3);
+            m_offset += length - 3;
+        }
+    }
+
+#if NIMBLE_OTA_CRC_INCREMENTAL
+    // Fold the new data into the sector crc while it is in cache, holding back the last 2 bytes
+    // as they may be the crc sent by the client.
+    if (m_offset > m_crcOffset + 2) {
+        uint64_t start = nowUs();
+        m_calcCrc      = NimBLEOtaCrc::update(m_calcCrc, m_pCurSector->pData + m_crcOffset, m_offset - 2 - m_crcOffset);
+        m_crcOffset    = m_offset - 2;
+        m_sectorCrcUs += nowUs() - start;
+    }
+#endif
+
+    if (data[2] != 0xff) { // not last packet
+        // The sequence wraps from 254 to 1 in large blocks, 0 is the first packet and 0xff the last.
+        m_packet = m_packet == 0xfe ? 1 : m_packet + 1;
+        return;
+    }
+
+    if (m_selective && m_offset != sectorLen) {
+        // Ask for the packets that were dropped, the client resends them followed by the last packet again.
+        sendMissingAck(recvSector);
+        return;
+    }
+
+    // The last 2 bytes of the sector are the crc, they may be split across the last two packets.
+    if (m_offset < 2) {
+        NIMBLE_LOGE(LOG_TAG, "sector too short for crc");
+        otaResp = lenError;
+        goto SendAck;
+    }
+
+    m_offset -= 2;
+    if (sectorPos + m_offset > m_fileLen || (sectorPos + m_offset != m_fileLen && m_offset != m_blockSize)) {
+        NIMBLE_LOGE(LOG_TAG, "sector length error, received: %u bytes", m_offset);
+        otaResp = lenError;
+        goto SendAck;
+    }
+
+    // Hand the sector to the verify stage and start receiving the next one.
+    pSector            = m_pCurSector;
+    pSector->length    = m_offset;
+    pSector->crc       = pSector->pData[m_offset] | (pSector->pData[m_offset + 1] << 8);
+    pSector->calcCrc   = m_calcCrc;
+    pSector->index     = m_sector;
+    pSector->recvIndex = recvSector;
+    pSector->epoch     = m_hostEpoch;
+    pSector->drop      = false;
+    m_pCurSector       = nullptr;
+    m_sector           = nextSector(m_sector + 1);
+    pSector->last      = static_cast<uint32_t>(m_sector) * m_blockSize >= m_fileLen;
+    OTA_TRACE(Sector, pSector->index, pSector->last, pSector->length);
+    if (m_sectorStart != 0) {
+        stats.sectorTime.add(nowUs() - m_sectorStart);
+        m_sectorStart = 0;
+    }
+#if NIMBLE_OTA_CRC_INCREMENTAL
+    stats.crcTime.add(m_sectorCrcUs);
+#endif
+    m_hostStats.publish();
+    resetSector();
+    m_outstanding++;
+    m_verifyQueue.push(pSector);
+
+    if (m_pScheduler) {
+        m_pScheduler->wake(NimBLEOtaScheduler::Verify);
+    } else {
+        runVerifyStage();
+        runFlashStage();
+        runHostStage();
+    }
+    return;
+
+SendAck:
+    if (otaResp == indexError) {
+        stats.indexErrors++;
+    } else if (otaResp == lenError) {
+        stats.lengthErrors++;
+    } else if (otaResp == busyError) {
+        stats.busyErrors++;
+    }
+    m_hostStats.publish();
+
+    resetSector();
+    m_rewinding = m_window > 1 || otaResp == busyError;
+    sendFirmwareAck(recvSector, otaResp, m_sector);
+}
+
+/**
+ * @brief Adopts a rewind requested by the verify stage after a crc error.
+ */
+void NimBLEOtaCore::syncRewind() {
+    uint8_t epoch = m_epoch.load(std::memory_order_acquire);
+    if (epoch != m_hostEpoch) {
+        m_hostEpoch = epoch;
+        m_sector    = m_rewindSector.load(std::memory_order_relaxed);
+        m_rewinding = true;
+        resetSector();
+    }
+}
+
+/**
+ * @brief Discards the packets received for the current sector.
+ */
+void NimBLEOtaCore::resetSector() {
+    memset(m_packetMap, 0, (m_packetCount + 31) / 32 * sizeof(m_packetMap[0]));
+    m_packetCount = 0;
+    m_nextPacket  = 0;
+    m_lastPacket  = 0xffff;
+    m_seqRef      = 0;
+    m_nacked      = false;
+    m_packet      = 0;
+    m_offset      = 0;
+    m_crcOffset   = 0;
+    m_calcCrc     = 0;
+    m_sectorCrcUs = 0;
+}
+
+/**
+ * @brief The index of a packet in the sector from its sequence number, which wraps from 254 to 1.
+ * @details Packets are sent in order, so this is the first index from the next expected one with a matching sequence.
+ */
+uint16_t NimBLEOtaCore::packetIndex(uint8_t seq) const {
+    if (seq == 0) {
+        return 0;
+    }
+
+    uint16_t ref    = std::max<uint16_t>(m_seqRef, 1);
+    uint8_t  refSeq = (ref - 1) % 254 + 1;
+    return ref + (seq + 254 - refSeq) % 254;
+}
+
+/**
+ * @brief Places a packet in the current sector by its sequence number and records it as received.
+ * @details All but the last packet of a sector carry the same length, which is taken from the first one received.
+ * Packets that can not be placed are dropped and requested again, m_offset is the length received without gaps.
+ * @param [in] sectorLen The expected sector length, including the crc.
+ * @return False if the last packet does not match the sector length.
+ */
+bool NimBLEOtaCore::storePacket(uint8_t seq, const uint8_t* data, size_t length, uint32_t sectorLen) {
+    uint16_t index = 0;
+    if (seq == 0xff) {
+        if (length != sectorLen) {
+            if (m_chunkSize == 0) {
+                return true; // the packet length is not known yet, reported missing from the first packet
+            }
+            index = (sectorLen - 1) / m_chunkSize;
+        }
+
+        if (static_cast<uint32_t>(index) * m_chunkSize + length != sectorLen || index >= NIMBLE_OTA_MAX_SECTOR_PACKETS) {
+            NIMBLE_LOGE(LOG_TAG, "last packet length error: %u", static_cast<unsigned>(length));
+            return false;
+        }
+
+        m_lastPacket = index;
+    } else {
+        if (m_chunkSize == 0) {
+            m_chunkSize = length;
+        }
+
+        index = packetIndex(seq);
+        if (length != m_chunkSize || static_cast<uint32_t>(index + 1) * m_chunkSize >= sectorLen ||
+            index >= NIMBLE_OTA_MAX_SECTOR_PACKETS) {
+            NIMBLE_LOGE(LOG_TAG, "packet dropped, seq: %u, length: %u", seq, static_cast<unsigned>(length));
+            return true;
+        }
+
+        m_seqRef = index + 1;
+    }
+
+    uint32_t bit = 1u << (index % 32);
+    if (m_packetMap[index / 32] & bit) {
+        return true; // already received
+    }
+
+    m_packetMap[index / 32] |= bit;
+    m_packetCount            = std::max<uint16_t>(m_packetCount, index + 1);
+    memcpy(m_pCurSector->pData + index * m_chunkSize, data, length);
+
+    while (m_nextPacket < m_packetCount && (m_packetMap[m_nextPacket / 32] & (1u << (m_nextPacket % 32)))) {
+        m_nextPacket++;
+    }
+
+    m_offset = m_nextPacket > m_lastPacket ? sectorLen : m_nextPacket * m_chunkSize;
+    return true;
+}
+
+/**
+ * @brief Checks the crc of the received sectors and acks them, runs in the verify worker if pipelined.
+ */
+void NimBLEOtaCore::runVerifyStage() {
+    NimBLEOtaSector* pSector;
+    while (m_verifyQueue.pop(pSector)) {
+        if (m_aborting || pSector->epoch != m_epoch.load(std::memory_order_relaxed)) {
+            pSector->drop = true;
+        } else if (pSector->crc != sectorCrc(pSector)) {
+            NIMBLE_LOGE(LOG_TAG, "crc error, sector: %u", pSector->index);
+            m_verifyStats.local().crcErrors++;
+            m_verifyStats.publish();
+            pSector->drop = true;
+            m_unacked     = 0;
+            m_rewindSector.store(pSector->index, std::memory_order_relaxed);
+            m_epoch.store(pSector->epoch + 1, std::memory_order_release);
+            sendFirmwareAck(pSector->recvIndex, crcError, pSector->index);
+        } else if (!pSector->last && ++m_unacked >= m_ackInterval) {
+            // In window mode the ack is cumulative, only every m_ackInterval sectors are acked.
+            // The last sector is acked by the flash stage once the image is complete.
+            m_unacked = 0;
+            sendFirmwareAck(pSector->recvIndex, otaFwSuccess, pSector->index);
+        }
+
+        OTA_TRACE(Crc, pSector->index, !pSector->drop, pSector->crc);
+        m_flashQueue.push(pSector);
+        if (m_pScheduler) {
+            m_pScheduler->wake(NimBLEOtaScheduler::Flash);
+        }
+    }
+}
+
+/**
+ * @brief The crc of the sector data, calculated as it was received unless NIMBLE_OTA_CRC_INCREMENTAL is 0.
+ */
+uint16_t NimBLEOtaCore::sectorCrc(const NimBLEOtaSector* pSector) {
+#if NIMBLE_OTA_CRC_INCREMENTAL
+    return pSector->calcCrc;
+#else
+    uint64_t start = nowUs();
+    uint16_t crc   = NimBLEOtaCrc::compute(pSector->pData, pSector->length);
+    m_verifyStats.local().crcTime.add(nowUs() - start);
+    m_verifyStats.publish();
+    return crc;
+#endif
+}
+
+/**
+ * @brief Writes the verified sectors to flash and returns the buffers, runs in the flash worker if pipelined.
+ */
+void NimBLEOtaCore::runFlashStage() {
+    if (m_syncBusy.load(std::memory_order_acquire) && m_pSyncJob != nullptr) {
+        runSyncJob();
+    }
+
+    NimBLEOtaSector* pSector;
+    bool             wakeHost = false;
+    while (m_flashQueue.pop(pSector)) {
+        if (!pSector->drop && !m_aborting && m_flashErr == otaOk) {
+            int err = m_sync ? m_pSync->seek(pSector->index * m_blockSize) : otaOk;
+            if (err == otaOk) {
+                OTA_TRACE(FlashBegin, pSector->index, 0, 0);
+                uint64_t start = nowUs();
+                err            = writeImage(pSector->pData, pSector->length);
+                m_flashStats.local().flashTime.add(nowUs() - start);
+                OTA_TRACE(FlashEnd, pSector->index, err != otaOk, err);
+            }
+
+            if (err == otaOk) {
+                m_recvLen += pSector->length;
+                m_flashStats.local().bytesWritten += pSector->length;
+                m_flashStats.local().sectors++;
+                m_flashStats.publish();
+                if (m_resumable) {
+                    m_imageCrc = NimBLEOtaCrc::update(m_imageCrc, pSector->pData, pSector->length);
+                }
+
+                if (pSector->last) {
+                    err = endImage();
+                    if (err == otaOk) {
+                        if (m_resumable) {
+                            m_pCheckpoint->clear();
+                        }
+                        sendFirmwareAck(pSector->recvIndex, otaFwSuccess, pSector->index);
+                        m_complete = true;
+                    }
+                } else if (m_resumable && m_recvLen - m_checkpointLen >= m_checkpointInterval) {
+                    saveCheckpoint();
+                }
+            }
+
+            if (err != otaOk) {
+                NIMBLE_LOGE(LOG_TAG, "flash write failed! err=0x%x", err);
+                m_flashErr = err;
+            }
+            wakeHost = true;
+        }
+
+        m_freeQueue.push(pSector);
+        m_outstanding--;
+    }
+
+    if (wakeHost && m_pScheduler) {
+        m_pScheduler->wake(NimBLEOtaScheduler::Host);
+    }
+}
+
+/**
+ * @brief Writes the sector data to flash, through the decompressor if the image is compressed.
+ */
+int NimBLEOtaCore::writeImage(const uint8_t* data, size_t length) {
+    NimBLEOtaFlash* pSink = m_delta ? m_pPatcher : m_sync ? m_pSync : m_pTarget;
+    int             err   = m_compressed ? m_pDecompressor->write(data, length) : pSink->write(data, length);
+    if (m_delta) {
+        m_writtenLen = m_pPatcher->written();
+        m_outputLen  = m_pPatcher->imageSize();
+    } else if (m_compressed) {
+        m_writtenLen = m_pDecompressor->written();
+    } else if (err == otaOk) {
+        m_writtenLen += length;
+    }
+
+    return err;
+}
+
+/**
+ * @brief Finishes the image after the last sector has been written.
+ */
+int NimBLEOtaCore::endImage() {
+    if (m_compressed) {
+        int err = m_pDecompressor->end();
+        if (err != otaOk) {
+            NIMBLE_LOGE(LOG_TAG, "decompression failed! err=0x%x", err);
+            return err;
+        }
+
+        if (m_pDecompressor->written() != m_imageLen) {
+            NIMBLE_LOGE(LOG_TAG,
+                        "decompressed length error, expected: %u, written: %u",
+                        static_cast<unsigned>(m_imageLen),
+                        static_cast<unsigned>(m_pDecompressor->written()));
+            return otaFail;
+        }
+    }
+
+    if (m_delta) {
+        int err = m_pPatcher->end();
+        if (err != otaOk) {
+            return err;
+        }
+    }
+
+    return m_sync ? m_pSync->end() : m_pTarget->end();
+}
+
+/**
+ * @brief Reports the progress and result of the flash stage to the application, runs in the BLE host task.
+ */
+void NimBLEOtaCore::runHostStage() {
+    if (!m_inProgress) {
+        return;
+    }
+
+    uint32_t recvLen = m_recvLen;
+    if (recvLen != m_reportedLen) {
+        m_reportedLen = recvLen;
+        onOtaProgress(recvLen, m_fileLen);
+    }
+
+    uint32_t writtenLen = m_writtenLen;
+    if ((m_compressed || m_delta) && writtenLen != m_reportedImageLen) {
+        m_reportedImageLen = writtenLen;
+        onOtaImageProgress(writtenLen, m_outputLen);
+    }
+
+    int err = m_flashErr.exchange(otaOk);
+    if (err != otaOk) {
+        m_aborting = true; // stop writing until the application aborts
+        if (m_resumable) {
+            m_resumable = false;
+            m_pCheckpoint->clear();
+        }
+        OTA_TRACE(Error, m_sector, m_verifyFailed ? VerifyError : FlashError, err);
+        onOtaError(err, m_verifyFailed ? VerifyError : FlashError);
+    } else if (m_complete) {
+        abortUpdate(); // Reset the OTA state
+        onOtaComplete();
+    }
+}
+
+/**
+ * @brief Sends a firmware ack.
+ * @param [in] pInfo Optional status details for bytes 6 to 17 of the ack.
+ */
+void NimBLEOtaCore::sendFirmwareAck(uint16_t recvSector, uint16_t status, uint16_t sector, const uint8_t* pInfo) {
+    uint8_t fwAck[FW_ACK_LENGTH]{};
+    if (pInfo != nullptr) {
+        memcpy(fwAck + 6, pInfo, 12);
+    }
+
+    fwAck[0]     = recvSector & 0xff;
+    fwAck[1]     = (recvSector >> 8) & 0xff;
+    fwAck[2]     = status & 0xff;
+    fwAck[3]     = (status >> 8) & 0xff;
+    fwAck[4]     = sector & 0xff;
+    fwAck[5]     = (sector >> 8) & 0xff;
+    uint16_t crc = getCrc16(fwAck, 18);
+    fwAck[18]    = crc & 0xff;
+    fwAck[19]    = (crc >> 8) & 0xff;
+    OTA_TRACE(Ack, recvSector, status, sector);
+    m_pTransport->sendFirmwareAck(fwAck, FW_ACK_LENGTH, m_notifyAck);
+}
+
+/**
+ * @brief Requests the missing packets of the current sector.
+ * @details Bytes 6 and 7 of the ack are the first missing packet, bytes 8 to 17 a bitmap of the
+ * missing packets in the 80 that follow it, bit 0 of byte 8 is the packet after the first missing one.
+ */
+void NimBLEOtaCore::sendMissingAck(uint16_t recvSector) {
+    m_hostStats.local().missingRequests++;
+    m_hostStats.publish();
+    uint8_t info[12]{};
+    info[0] = m_nextPacket & 0xff;
+    info[1] = (m_nextPacket >> 8) & 0xff;
+    for (uint16_t i = 0; i < missingSpan && m_lastPacket != 0xffff; i++) {
+        uint16_t index = m_nextPacket + 1 + i;
+        if (index >= m_lastPacket) {
+            break;
+        }
+
+        if (!(m_packetMap[index / 32] & (1u << (index % 32)))) {
+            info[2 + i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    NIMBLE_LOGD(LOG_TAG, "Sector: %u, missing packets from %u", m_sector, m_nextPacket);
+    m_nacked = true;
+    m_seqRef = m_nextPacket;
+    sendFirmwareAck(recvSector, missingError, m_sector, info);
+}
+
+void NimBLEOtaCore::handleCommand(const uint8_t* data, size_t length) {
+    uint16_t crc = 0;
+    uint8_t  cmdAck[CMD_ACK_LENGTH]{};
+    cmdAck[0] = ackOtaCmd;
+    cmdAck[1] = (ackOtaCmd >> 8) & 0xff;
+    cmdAck[4] = otaReject;
+    cmdAck[5] = (otaReject >> 8) & 0xff;
+
+    if (length >= 6 + syncHashLen && (data[0] | (data[1] << 8)) == syncOtaCmd) {
+        cmdAck[2] = data[0];
+        cmdAck[3] = data[1];
+        if (syncSectors(data, length, cmdAck)) {
+            return; // acked by the flash stage
+        }
+    } else if (length >= 5 && (data[0] | (data[1] << 8)) == targetOtaCmd) {
+        cmdAck[2] = data[0];
+        cmdAck[3] = data[1];
+        targetCommand(data, length, cmdAck);
+    } else if (length >= 5 && (data[0] | (data[1] << 8)) == signOtaCmd) {
+        cmdAck[2] = data[0];
+        cmdAck[3] = data[1];
+        signatureCommand(data, length, cmdAck);
+    } else if (length == 20) {
+        uint16_t cmd        = data[0] | (data[1] << 8);
+        uint32_t fileLen    = data[2] | (data[3] << 8) | (data[4] << 16) | (static_cast<uint32_t>(data[5]) << 24);
+        bool     compressed = data[6] & flagCompress;
+        bool     delta      = data[6] & flagDelta;
+        uint32_t imageLen   = compressed ? data[8] | (data[9] << 8) | (data[10] << 16) | (static_cast<uint32_t>(data[11]) << 24)
+                                         : fileLen;
+        crc                 = data[18] | (data[19] << 8);
+        cmdAck[2]           = data[0];
+        cmdAck[3]           = data[1];
+
+        if (getCrc16(data, 18) != crc || (cmd != startOtaCmd && cmd != stopOtaCmd)) {
+            NIMBLE_LOGE(LOG_TAG, "command %s error", cmd == startOtaCmd || cmd == stopOtaCmd ? "CRC" : "invalid");
+        } else if (cmd == startOtaCmd) {
+            if (m_inProgress) {
+                if (fileLen == m_fileLen && imageLen == m_imageLen && compressed == m_compressed && delta == m_delta) {
+                    NIMBLE_LOGW(LOG_TAG, "Ota resuming");
+                    setTransferMode(data[6], data[7], cmdAck);
+                    onOtaStart(m_imageLen, Reconnected);
+                    cmdAck[4] = otaAccept;
+                    cmdAck[5] = (otaAccept >> 8) & 0xff;
+                } else {
+                    NIMBLE_LOGE(LOG_TAG, "Ota command error, file length mismatch - aborting");
+                    if (m_resumable) {
+                        m_pCheckpoint->clear();
+                    }
+                    OTA_TRACE(Error, m_sector, LengthError, otaFail);
+                    abortUpdate();
+                    onOtaError(otaFail, LengthError);
+                }
+            } else {
+                // Delta and sync updates rebuild an app image, a sink only receives plain or compressed data.
+                // A sync update is not written in order so its image can not be hashed for a signature.
+                bool    sign      = m_pSignature != nullptr || m_requireSignature;
+                uint8_t supported = flagNotifyAck | (m_pDecompressor ? flagCompress : 0) |
+                                    (m_pPatcher && !m_pSelected ? flagDelta : 0) |
+                                    (m_pSync && !m_pSelected && !sign && !compressed && !delta ? flagSync : 0);
+                if (data[6] & ~supported & (flagCompress | flagDelta | flagSync)) {
+                    NIMBLE_LOGE(LOG_TAG, "image type not supported, flags: 0x%02x", data[6]);
+                    cmdAck[6] = data[6] & supported;
+                    goto SendAck;
+                }
+
+                if (m_requireSignature && m_pSignature == nullptr) {
+                    NIMBLE_LOGE(LOG_TAG, "image signature required");
+                    cmdAck[6] = data[6] & supported;
+                    goto SendAck;
+                }
+
+                if (m_pSelected && imageLen > m_pSelected->capacity()) {
+                    NIMBLE_LOGE(LOG_TAG,
+                                "image too large for the sink, size: %u, capacity: %u",
+                                static_cast<unsigned>(imageLen),
+                                static_cast<unsigned>(m_pSelected->capacity()));
+                    cmdAck[6] = data[6] & supported;
+                    goto SendAck;
+                }
+
+                if (delta && !m_pPatcher->checkBase(data + 12, 6)) {
+                    NIMBLE_LOGE(LOG_TAG, "delta patch was not made for the running image");
+                    cmdAck[6] = data[6] & supported;
+                    goto SendAck;
+                }
+
+                // Use the requested block size if allowed, or the largest the free heap or the application's pool allows.
+                uint32_t blockSize = std::min<uint32_t>(MIN_BLOCK_SIZE << ((data[6] & flagBlockMask) >> flagBlockPos),
+                                                        m_maxBlockSize);
+                while (!allocBuffers(blockSize)) {
+                    if (blockSize == MIN_BLOCK_SIZE) {
+                        NIMBLE_LOGE(LOG_TAG, "%s -  no memory for the sector buffers", __func__);
+                        goto SendAck;
+                    }
+                    blockSize /= 2;
+                }
+
+                m_sync = data[6] & flagSync;
+                if (m_sync) {
+                    // All sectors are needed until the client sends their hashes.
+                    size_t mapLen = ((fileLen + blockSize - 1) / blockSize + 7) / 8;
+                    if (m_buffers.pSectorMap) {
+                        m_pNeeded = mapLen <= m_buffers.sectorMapLen ? m_buffers.pSectorMap : nullptr;
+                    } else {
+                        m_pNeeded = static_cast<uint8_t*>(malloc(mapLen));
+                    }
+                    if (m_pNeeded == nullptr) {
+                        NIMBLE_LOGE(LOG_TAG, "%s -  no memory for the sector map", __func__);
+                        m_sync = false;
+                        freeBuffers();
+                        goto SendAck;
+                    }
+                    memset(m_pNeeded, 0xff, mapLen);
+                }
+
+                // A raw image identified by its hash can continue from the checkpoint of an earlier update.
+                static const uint8_t noImageId[6]{};
+                m_pTarget   = m_pSelected ? static_cast<NimBLEOtaFlash*>(m_pSelected) : m_pFlash;
+                m_resumable = m_pCheckpoint && m_checkpointInterval && !compressed && !delta && !m_sync && !m_pSelected && !sign &&
+                              memcmp(data + 12, noImageId, sizeof(noImageId)) != 0;
+                uint32_t resumeLen = m_resumable ? resumeImage(data + 12, fileLen) : 0;
+                m_hasDigest    = false;
+                m_verifyFailed = false;
+                if (resumeLen == 0) {
+                    if (m_pCheckpoint) {
+                        m_pCheckpoint->clear(); // the partition is erased
+                    }
+
+                    if (m_pVerifier && !m_sync) {
+                        m_verifyStage.m_pOut = m_pTarget;
+                        m_pTarget            = &m_verifyStage;
+                    }
+
+                    if (beginImage(data[6], imageLen) != otaOk) {
+                        m_pTarget   = m_pFlash;
+                        m_resumable = false;
+                        m_sync      = false;
+                        freeSectorMap();
+                        freeBuffers();
+                        goto SendAck;
+                    }
+                }
+
+                setTransferMode(data[6], data[7], cmdAck);
+                memcpy(m_imageId, data + 12, sizeof(m_imageId));
+                m_sector        = resumeLen / m_blockSize;
+                m_recvLen       = resumeLen;
+                m_writtenLen    = resumeLen;
+                m_checkpointLen = resumeLen;
+                cmdAck[8]       = resumeLen & 0xff;
+                cmdAck[9]       = (resumeLen >> 8) & 0xff;
+                cmdAck[10]      = (resumeLen >> 16) & 0xff;
+                cmdAck[11]      = (resumeLen >> 24) & 0xff;
+                cmdAck[12]      = m_pTransport->dataChannel() & 0xff;
+                cmdAck[13]      = (m_pTransport->dataChannel() >> 8) & 0xff;
+                m_fileLen       = fileLen;
+                m_imageLen   = imageLen;
+                m_outputLen  = delta ? 0 : imageLen;
+                m_compressed = compressed;
+                m_delta      = delta;
+                cmdAck[4]    = otaAccept;
+                cmdAck[5]    = (otaAccept >> 8) & 0xff;
+                m_inProgress = true;
+                m_sinkType      = m_selectedType; // the selection is used by this update only
+                m_pSelected     = nullptr;
+                m_selectedType  = AppSink;
+                m_verifyStats.reset(); // the workers are idle until the first sector is queued
+                m_flashStats.reset();
+                m_hostStats.reset();
+                m_hostStats.local().startUs = nowUs();
+                m_hostStats.publish();
+                m_nextNewSector = m_sector;
+                onOtaStart(m_imageLen, resumeLen ? Resumed : StartCmd);
+            }
+        } else if (cmd == stopOtaCmd) {
+            if (!m_inProgress) {
+                NIMBLE_LOGW(LOG_TAG, "ota not started");
+            } else {
+                if (m_resumable) {
+                    m_resumable = false; // stopped by the client, start over next time
+                    m_pCheckpoint->clear();
+                }
+                cmdAck[4] = otaAccept;
+                cmdAck[5] = (otaAccept >> 8) & 0xff;
+                onOtaStop(StopCmd);
+            }
+        }
+    } else {
+        NIMBLE_LOGE(LOG_TAG, "command length error");
+    }
+
+SendAck:
+    OTA_TRACE(Command, length >= 2 ? data[0] | (data[1] << 8) : 0, cmdAck[4] == otaAccept, length);
+    sendCommandAck(cmdAck);
+}
+
+void NimBLEOtaCore::sendCommandAck(uint8_t* cmdAck) {
+    uint16_t crc = getCrc16(cmdAck, 18);
+    cmdAck[18]   = crc;
+    cmdAck[19]   = (crc >> 8) & 0xff;
+    m_pTransport->sendCommandAck(cmdAck, CMD_ACK_LENGTH);
+}
+
+/**
+ * @brief Prepares the flash, patcher and decompressor for a new image.
+ * @param [in] flags The start command flags, selects the compressed and delta stages.
+ * @param [in] imageLen The length of the image after decompression, the patch length for a delta update.
+ */
+int NimBLEOtaCore::beginImage(uint8_t flags, uint32_t imageLen) {
+    if (flags & flagSync) {
+        return m_pSync->begin(imageLen); // erased as it is written, uncompressed only
+    }
+
+    bool delta = flags & flagDelta;
+    int  err   = m_pTarget->begin(delta ? 0 : imageLen);
+    if (err != otaOk) {
+        NIMBLE_LOGE(LOG_TAG, "flash begin failed!");
+        return err;
+    }
+
+    if (delta) {
+        m_pPatcher->setOutput(m_pTarget);
+    }
+
+    if (delta && (err = m_pPatcher->begin(imageLen)) != otaOk) {
+        NIMBLE_LOGE(LOG_TAG, "patcher begin failed!");
+        m_pTarget->abort();
+        return err;
+    }
+
+    if ((flags & flagCompress) && (err = m_pDecompressor->begin(delta ? m_pPatcher : m_pTarget)) != otaOk) {
+        NIMBLE_LOGE(LOG_TAG, "decompressor begin failed!");
+        if (delta) {
+            m_pPatcher->abort();
+        }
+        m_pTarget->abort();
+        return err;
+    }
+
+    return otaOk;
+}
+
+/**
+ * @brief Reopens the image saved in the checkpoint if it is the one being sent.
+ * @return The number of bytes already written, 0 to start from the beginning.
+ */
+uint32_t NimBLEOtaCore::resumeImage(const uint8_t* imageId, uint32_t fileLen) {
+    NimBLEOtaCheckpointData checkpoint{};
+    if (!m_pCheckpoint->load(&checkpoint) || memcmp(checkpoint.imageId, imageId, sizeof(checkpoint.imageId)) != 0 ||
+        checkpoint.fileLen != fileLen || checkpoint.offset == 0 || checkpoint.offset >= fileLen ||
+        checkpoint.offset % m_blockSize != 0) {
+        return 0;
+    }
+
+    if (m_pFlash->resume(checkpoint.offset, checkpoint.crc) != otaOk) {
+        NIMBLE_LOGW(LOG_TAG, "checkpoint does not match the flash, starting over");
+        return 0;
+    }
+
+    NIMBLE_LOGI(LOG_TAG, "resuming at %u bytes", static_cast<unsigned>(checkpoint.offset));
+    m_imageCrc = checkpoint.crc;
+    return checkpoint.offset;
+}
+
+/**
+ * @brief Saves the progress of a resumable update, runs in the flash worker if pipelined.
+ */
+void NimBLEOtaCore::saveCheckpoint() {
+    NimBLEOtaCheckpointData checkpoint{};
+    memcpy(checkpoint.imageId, m_imageId, sizeof(checkpoint.imageId));
+    checkpoint.fileLen = m_fileLen;
+    checkpoint.offset  = m_recvLen;
+    checkpoint.crc     = m_imageCrc;
+    if (!m_pCheckpoint->save(checkpoint)) {
+        NIMBLE_LOGW(LOG_TAG, "checkpoint save failed");
+    }
+
+    m_checkpointLen = checkpoint.offset; // on failure try again at the next interval
+}
+
+/**
+ * @brief Handles a sector hash command of a sync update.
+ * @details Bytes 2 and 3 are the first sector, followed by 8 bytes of the SHA-256 of each sector and the crc.
+ * The hashes are copied to a free sector buffer and checked by the flash stage, which acks the command.
+ * The command is answered busy while the previous one is being checked.
+ * @return True if the flash stage acks the command.
+ */
+bool NimBLEOtaCore::syncSectors(const uint8_t* data, size_t length, uint8_t* cmdAck) {
+    size_t count = (length - 6) / syncHashLen;
+    if ((length - 6) % syncHashLen != 0 || count > syncMaxHashes ||
+        getCrc16(data, length - 2) != (data[length - 2] | (data[length - 1] << 8))) {
+        NIMBLE_LOGE(LOG_TAG, "sync command error");
+        return false;
+    }
+
+    if (!m_inProgress || !m_sync) {
+        NIMBLE_LOGW(LOG_TAG, "sync update not started");
+        return false;
+    }
+
+    if (m_syncBusy.load(std::memory_order_acquire) || !m_freeQueue.pop(m_pSyncJob)) {
+        cmdAck[4] = busyError;
+        cmdAck[5] = (busyError >> 8) & 0xff;
+        return false;
+    }
+
+    m_pSyncJob->index  = data[2] | (data[3] << 8);
+    m_pSyncJob->length = count * syncHashLen;
+    memcpy(m_pSyncJob->pData, data + 4, m_pSyncJob->length);
+    m_outstanding++;
+    m_syncBusy.store(true, std::memory_order_release);
+    if (m_pScheduler) {
+        m_pScheduler->wake(NimBLEOtaScheduler::Flash);
+    } else {
+        runSyncJob();
+    }
+    return true;
+}
+
+/**
+ * @brief Keeps or copies the sectors of a sync command the device has and acks it, runs in the flash worker if pipelined.
+ * @details Bytes 6 to 17 of the ack are a bitmap of the sectors the client has to send, bit 0 of byte 6 is the first
+ * sector of the command. The client sends no firmware before the ack, the host stage finishes the update if the device
+ * had every sector.
+ */
+void NimBLEOtaCore::runSyncJob() {
+    NimBLEOtaSector* pJob     = m_pSyncJob;
+    bool             complete = false;
+    uint8_t          cmdAck[CMD_ACK_LENGTH]{};
+    cmdAck[0] = ackOtaCmd;
+    cmdAck[1] = (ackOtaCmd >> 8) & 0xff;
+    cmdAck[2] = syncOtaCmd;
+    cmdAck[3] = (syncOtaCmd >> 8) & 0xff;
+
+    uint32_t sectors = (m_fileLen + m_blockSize - 1) / m_blockSize;
+    size_t   count   = pJob->length / syncHashLen;
+    for (size_t i = 0; i < count && pJob->index + i < sectors && !m_aborting; i++) {
+        uint16_t sector = pJob->index + i;
+        uint8_t  bit    = 1 << (sector % 8);
+        uint32_t offset = static_cast<uint32_t>(sector) * m_blockSize;
+        uint32_t len    = std::min(m_blockSize, m_fileLen - offset);
+        if ((m_pNeeded[sector / 8] & bit) && m_pSync->reuse(offset, len, pJob->pData + i * syncHashLen)) {
+            m_pNeeded[sector / 8] &= ~bit;
+            m_recvLen             += len;
+        }
+
+        if (m_pNeeded[sector / 8] & bit) {
+            cmdAck[6 + i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    cmdAck[4] = otaAccept;
+    cmdAck[5] = (otaAccept >> 8) & 0xff;
+    if (m_offset == 0) {
+        m_sector = nextSector(m_sector); // skip to the first sector the client sends
+    }
+
+    if (m_sector >= sectors && !m_aborting) {
+        int err = endImage();
+        if (err != otaOk) {
+            NIMBLE_LOGE(LOG_TAG, "sync update end failed! err=0x%x", err);
+            m_flashErr = err;
+        } else {
+            m_complete = true;
+        }
+        complete = true;
+    }
+
+    m_pSyncJob = nullptr;
+    m_freeQueue.push(pJob);
+    m_syncBusy.store(false, std::memory_order_release);
+    if (!m_aborting) {
+        sendCommandAck(cmdAck);
+    }
+    m_outstanding--;
+
+    if (complete) { // the device already had every sector
+        if (m_pScheduler) {
+            m_pScheduler->wake(NimBLEOtaScheduler::Host);
+        } else {
+            runHostStage();
+        }
+    }
+}
+
+/**
+ * @brief Handles a target command, which selects the sink the next update is written to.
+ * @details Byte 2 is the sink type followed by its name, i.e. a partition label or file path, and the crc.
+ * Bytes 6 to 9 of the ack are the capacity of the sink.
+ */
+void NimBLEOtaCore::targetCommand(const uint8_t* data, size_t length, uint8_t* cmdAck) {
+    size_t nameLen = length - 5;
+    if (getCrc16(data, length - 2) != (data[length - 2] | (data[length - 1] << 8)) || nameLen >= NIMBLE_OTA_MAX_SINK_NAME ||
+        memchr(data + 3, '\0', nameLen) != nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "target command error");
+        return;
+    }
+
+    if (m_inProgress) {
+        NIMBLE_LOGE(LOG_TAG, "Cannot change the sink during an update");
+        return;
+    }
+
+    char name[NIMBLE_OTA_MAX_SINK_NAME];
+    memcpy(name, data + 3, nameLen);
+    name[nameLen] = '\0';
+    if (!selectSink(data[2], name)) {
+        return;
+    }
+
+    uint32_t capacity = m_pSelected ? m_pSelected->capacity() : 0;
+    cmdAck[4]         = otaAccept;
+    cmdAck[5]         = (otaAccept >> 8) & 0xff;
+    cmdAck[6]         = capacity & 0xff;
+    cmdAck[7]         = (capacity >> 8) & 0xff;
+    cmdAck[8]         = (capacity >> 16) & 0xff;
+    cmdAck[9]         = (capacity >> 24) & 0xff;
+}
+
+/**
+ * @brief Handles a signature command, the signature of the SHA-256 of the next image.
+ * @details Bytes 2 to length - 3 are the signature followed by the crc, it is checked before the image is committed.
+ */
+void NimBLEOtaCore::signatureCommand(const uint8_t* data, size_t length, uint8_t* cmdAck) {
+    size_t sigLen = length - 4;
+    if (getCrc16(data, length - 2) != (data[length - 2] | (data[length - 1] << 8)) || sigLen == 0 ||
+        sigLen > NIMBLE_OTA_MAX_SIGNATURE) {
+        NIMBLE_LOGE(LOG_TAG, "signature command error");
+        return;
+    }
+
+    if (m_inProgress || m_pVerifier == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "%s", m_inProgress ? "Cannot change the signature during an update" : "signatures not supported");
+        return;
+    }
+
+    uint8_t* pSignature = m_buffers.pSignature;
+    if (pSignature == nullptr) {
+        pSignature = static_cast<uint8_t*>(realloc(m_pSignature, sigLen));
+    }
+
+    if (pSignature == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "%s -  malloc fail", __func__);
+        return;
+    }
+
+    memcpy(pSignature, data + 2, sigLen);
+    m_pSignature   = pSignature;
+    m_signatureLen = sigLen;
+    cmdAck[4]      = otaAccept;
+    cmdAck[5]      = (otaAccept >> 8) & 0xff;
+}
+
+/**
+ * @brief The first sector from sector the client has to send, all of them unless it is a sync update.
+ */
+uint16_t NimBLEOtaCore::nextSector(uint16_t sector) const {
+    uint32_t sectors = (m_fileLen + m_blockSize - 1) / m_blockSize;
+    while (m_sync && sector < sectors && !(m_pNeeded[sector / 8] & (1 << (sector % 8)))) {
+        sector++;
+    }
+
+    return sector;
+}
+
+/**
+ * @brief Negotiates the sector window and ack type requested in the start command.
+ * @param [in] flags The requested option flags, start command byte 6.
+ * @param [in] window The number of sectors the client wants to have in flight, start command byte 7.
+ * @param [out] cmdAck The command ack, the accepted flags, block size and window are returned in bytes 6 and 7.
+ */
+void NimBLEOtaCore::setTransferMode(uint8_t flags, uint8_t window, uint8_t* cmdAck) {
+    m_window      = std::max<uint8_t>(1, std::min(window, m_maxWindow));
+    m_ackInterval = (m_window + 1) / 2;
+    m_notifyAck   = flags & flagNotifyAck;
+    m_unacked     = 0;
+    m_rewinding   = false;
+    m_selective   = flags & flagSelective;
+    m_chunkSize   = 0; // the packet length may change with the connection
+    resetSector();
+
+    uint8_t blockBits = 0;
+    while ((MIN_BLOCK_SIZE << blockBits) < m_blockSize) {
+        blockBits++;
+    }
+
+    cmdAck[6] = (flags & (flagNotifyAck | flagCompress | flagDelta | flagSelective | flagSync)) | (blockBits << flagBlockPos);
+    cmdAck[7] = m_window;
+    NIMBLE_LOGI(LOG_TAG,
+                "block: %u bytes, window: %u, ack every %u, %s%s",
+                static_cast<unsigned>(m_blockSize),
+                m_window,
+                m_ackInterval,
+                m_notifyAck ? "notify" : "indicate",
+                m_selective ? ", selective retransmit" : "");
+}
+
+/**
+ * @brief Sets the storage used to resume an update after a reset.
+ * @details Only uncompressed images sent with their hash in the start command are resumed.
+ */
+void NimBLEOtaCore::setCheckpoint(NimBLEOtaCheckpoint* pCheckpoint) {
+    m_pCheckpoint = pCheckpoint;
+}
+
+/**
+ * @brief Sets the update partition used for sync updates, which only receive the sectors the device does not have.
+ */
+void NimBLEOtaCore::setSectorSync(NimBLEOtaSectorSync* pSync) {
+    m_pSync = pSync;
+}
+
+/**
+ * @brief Sets the verifier that hashes each image as it is written and checks its signature.
+ * @param [in] pVerifier The verifier, nullptr to disable.
+ * @param [in] requireSignature Reject updates without a signature command,
+ * otherwise only images the client sent a signature for are checked.
+ * @details When the start command carries the image hash it is also checked against the image written.
+ */
+void NimBLEOtaCore::setVerifier(NimBLEOtaVerifier* pVerifier, bool requireSignature) {
+    if (m_inProgress) {
+        NIMBLE_LOGE(LOG_TAG, "Cannot change the verifier during an update");
+        return;
+    }
+
+    m_pVerifier        = pVerifier;
+    m_requireSignature = pVerifier && requireSignature;
+}
+
+/**
+ * @brief The SHA-256 of the image written by the last update, available once it has completed.
+ * @param [out] digest 32 bytes.
+ * @return False if no verifier is set or the image was not hashed, i.e. a resumed or sync update.
+ */
+bool NimBLEOtaCore::getImageDigest(uint8_t* digest) const {
+    if (!m_hasDigest) {
+        return false;
+    }
+
+    memcpy(digest, m_digest, sizeof(m_digest));
+    return true;
+}
+
+/**
+ * @brief Drops the target and signature sent by a client that disconnected without starting an update.
+ */
+void NimBLEOtaCore::discardPending() {
+    if (m_inProgress) {
+        return;
+    }
+
+    selectSink(AppSink, nullptr);
+    freeSignature();
+}
+
+int NimBLEOtaCore::NimBLEOtaVerifyStage::begin(uint32_t imageSize) {
+    int err = m_pCore->m_pVerifier->begin();
+    return err != otaOk ? err : m_pOut->begin(imageSize);
+}
+
+int NimBLEOtaCore::NimBLEOtaVerifyStage::write(const uint8_t* data, size_t length) {
+    int err = m_pCore->m_pVerifier->update(data, length);
+    return err != otaOk ? err : m_pOut->write(data, length);
+}
+
+/**
+ * @brief Checks the image hash and signature, the output is only ended, i.e. the boot partition set, if they match.
+ */
+int NimBLEOtaCore::NimBLEOtaVerifyStage::end() {
+    NimBLEOtaCore* pCore = m_pCore;
+    int            err   = pCore->m_pVerifier->finish(pCore->m_digest);
+    if (err != otaOk) {
+        return err;
+    }
+
+    // The start command carries the start of the image hash for raw images, the base hash for delta.
+    static const uint8_t noImageId[sizeof(pCore->m_imageId)]{};
+    bool idMatch = pCore->m_delta || memcmp(pCore->m_imageId, noImageId, sizeof(noImageId)) == 0 ||
+                   memcmp(pCore->m_imageId, pCore->m_digest, sizeof(pCore->m_imageId)) == 0;
+    if (!idMatch || (pCore->m_pSignature != nullptr &&
+                     !pCore->m_pVerifier->verify(pCore->m_digest, pCore->m_pSignature, pCore->m_signatureLen))) {
+        NIMBLE_LOGE(LOG_TAG, "image %s verification failed", idMatch ? "signature" : "hash");
+        pCore->m_verifyFailed = true;
+        return otaFail;
+    }
+
+    pCore->m_hasDigest = true;
+    return m_pOut->end();
+}
+
+/**
+ * @brief Registers the sink used when a client selects type in the target command.
+ * @param [in] type The sink type, 1 to NIMBLE_OTA_MAX_SINKS - 1, see SinkType, types above StreamSink are free for the application.
+ * @param [in] pSink The sink, nullptr to remove it.
+ * @return False if the type is invalid or an update is in progress.
+ */
+bool NimBLEOtaCore::setSink(uint8_t type, NimBLEOtaSink* pSink) {
+    if (type == AppSink || type >= NIMBLE_OTA_MAX_SINKS || m_inProgress) {
+        NIMBLE_LOGE(LOG_TAG, "Cannot set sink type %u", type);
+        return false;
+    }
+
+    if (m_pSelected == m_sinks[type]) {
+        m_pSelected    = nullptr;
+        m_selectedType = AppSink;
+    }
+
+    m_sinks[type] = pSink;
+    return true;
+}
+
+/**
+ * @brief Selects the sink the next update is written to, as the target command does.
+ * @param [in] type The sink type, AppSink for the app partition.
+ * @param [in] name The name passed to the sink's open, i.e. a partition label or file path.
+ * @return False if the sink is not registered or failed to open the name.
+ */
+bool NimBLEOtaCore::selectSink(uint8_t type, const char* name) {
+    if (m_inProgress) {
+        return false;
+    }
+
+    m_pSelected    = nullptr;
+    m_selectedType = AppSink;
+    if (type == AppSink) {
+        return true;
+    }
+
+    NimBLEOtaSink* pSink = type < NIMBLE_OTA_MAX_SINKS ? m_sinks[type] : nullptr;
+    if (pSink == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "sink type %u not supported", type);
+        return false;
+    }
+
+    int err = pSink->open(name ? name : "");
+    if (err != otaOk) {
+        NIMBLE_LOGE(LOG_TAG, "sink open failed! type: %u, name: %s, err=0x%x", type, name ? name : "", err);
+        return false;
+    }
+
+    m_pSelected    = pSink;
+    m_selectedType = type;
+    return true;
+}
+
+/**
+ * @brief Sets how often the progress is saved, in bytes written to flash, 0 disables resuming after a reset.
+ */
+void NimBLEOtaCore::setCheckpointInterval(uint32_t bytes) {
+    m_checkpointInterval = bytes;
+}
+
+/**
+ * @brief Sets the largest block (sector) size a client may request, 4096 to 32768 bytes, default NIMBLE_OTA_MAX_BLOCK_SIZE.
+ * @details Each sector buffer holds a block, larger blocks need fewer acks and flash writes.
+ */
+void NimBLEOtaCore::setMaxBlockSize(uint32_t size) {
+    m_maxBlockSize = MIN_BLOCK_SIZE;
+    while (m_maxBlockSize * 2 <= std::min<uint32_t>(size, 32768)) {
+        m_maxBlockSize *= 2;
+    }
+}
+
+/**
+ * @brief Sets the maximum number of sectors a client may have in flight, default 8.
+ */
+void NimBLEOtaCore::setMaxWindow(uint8_t sectors) {
+    m_maxWindow = std::max<uint8_t>(1, sectors);
+}
+
+/**
+ * @brief Sets the decompressor used when the client sends a compressed image, nullptr to reject compressed images.
+ */
+void NimBLEOtaCore::setDecompressor(NimBLEOtaDecompressor* pDecompressor) {
+    if (m_inProgress) {
+        NIMBLE_LOGE(LOG_TAG, "Cannot change the decompressor during an update");
+        return;
+    }
+
+    m_pDecompressor = pDecompressor;
+}
+
+/**
+ * @brief Sets the patcher used when the client sends a delta update, nullptr to reject delta updates.
+ */
+void NimBLEOtaCore::setPatcher(NimBLEOtaPatcher* pPatcher) {
+    if (m_inProgress) {
+        NIMBLE_LOGE(LOG_TAG, "Cannot change the patcher during an update");
+        return;
+    }
+
+    m_pPatcher = pPatcher;
+}
+
+/**
+ * @brief Enables the receive pipeline, sectors are verified and written to flash by the scheduler's workers.
+ * @param [in] pScheduler The scheduler that runs the stages, nullptr to run them inline in the BLE host task.
+ * @param [in] buffers The number of sector buffers, the client is asked to resend a sector when none are free.
+ * @return True if set, false if an update is in progress or the scheduler failed to start.
+ */
+bool NimBLEOtaCore::setPipeline(NimBLEOtaScheduler* pScheduler, uint8_t buffers) {
+    if (m_inProgress) {
+        NIMBLE_LOGE(LOG_TAG, "Cannot change the pipeline during an update");
+        return false;
+    }
+
+    if (pScheduler && !pScheduler->begin(this)) {
+        NIMBLE_LOGE(LOG_TAG, "Failed to start the pipeline workers");
+        return false;
+    }
+
+    m_pScheduler = pScheduler;
+    m_bufCount   = std::max<uint8_t>(1, std::min<uint8_t>(buffers, NIMBLE_OTA_MAX_BUFFERS));
+    return true;
+}
+
+/**
+ * @brief Sets the memory used for the sector buffers, the sync sector map and the signature instead of the heap.
+ * @param [in] buffers The buffers, they must remain valid while the core exists. Buffers left null are allocated.
+ * @return True if set, false if an update is in progress.
+ */
+bool NimBLEOtaCore::setBuffers(const NimBLEOtaBuffers& buffers) {
+    if (m_inProgress) {
+        NIMBLE_LOGE(LOG_TAG, "Cannot change the buffers during an update");
+        return false;
+    }
+
+    freeSignature(); // a pending signature may be in the old buffer
+    m_buffers = buffers;
+    return true;
+}
+
+/**
+ * @brief Allocates the sector buffers, each holds a block of blockSize bytes and the crc.
+ */
+bool NimBLEOtaCore::allocBuffers(uint32_t blockSize) {
+    size_t poolLen = m_bufCount * (blockSize + 2) * sizeof(uint8_t);
+    if (m_buffers.pPool) {
+        m_pPool = poolLen <= m_buffers.poolLen ? m_buffers.pPool : nullptr;
+    } else {
+        m_pPool = static_cast<uint8_t*>(malloc(poolLen));
+    }
+
+    if (m_pPool == nullptr) {
+        return false;
+    }
+
+    m_blockSize = blockSize;
+    m_freeQueue.clear();
+    m_verifyQueue.clear();
+    m_flashQueue.clear();
+    for (uint8_t i = 0; i < m_bufCount; i++) {
+        m_sectors[i].pData = m_pPool + i * (blockSize + 2);
+        m_freeQueue.push(&m_sectors[i]);
+    }
+
+    return true;
+}
+
+void NimBLEOtaCore::freeBuffers() {
+    // Wait for the workers to return the buffers they are holding.
+    m_aborting = true;
+    while (m_outstanding != 0 && m_pScheduler) {
+        m_pScheduler->yield();
+    }
+
+    if (m_pPool != m_buffers.pPool) {
+        free(m_pPool);
+    }
+
+    m_pPool      = nullptr;
+    m_pCurSector = nullptr;
+    m_aborting   = false;
+}
+
+void NimBLEOtaCore::freeSectorMap() {
+    if (m_pNeeded != m_buffers.pSectorMap) {
+        free(m_pNeeded);
+    }
+    m_pNeeded = nullptr;
+}
+
+void NimBLEOtaCore::freeSignature() {
+    if (m_pSignature != m_buffers.pSignature) {
+        free(m_pSignature);
+    }
+    m_pSignature   = nullptr;
+    m_signatureLen = 0;
+}
+
+void NimBLEOtaCore::abortUpdate() {
+    bool complete = m_complete; // the target was ended, it has nothing to abort
+    if (m_inProgress) {
+        m_lastStats.local() = getStats(); // keep the figures of the last update
+        m_lastStats.publish();
+        m_hostStats.reset();
+    }
+
+    freeBuffers();
+    if (m_compressed) {
+        m_pDecompressor->abort();
+    }
+
+    if (m_delta) {
+        m_pPatcher->abort();
+    }
+
+    if (m_sync && !complete) {
+        m_pSync->abort();
+    }
+
+    freeSectorMap();
+    freeSignature();
+    m_recvLen          = 0;
+    m_writtenLen       = 0;
+    m_outputLen        = 0;
+    m_reportedLen      = 0;
+    m_reportedImageLen = 0;
+    m_flashErr         = otaOk;
+    m_complete         = false;
+    m_hostEpoch        = m_epoch;
+    m_sector           = 0;
+    m_fileLen          = 0;
+    m_imageLen         = 0;
+    m_unacked          = 0;
+    m_rewinding        = false;
+    m_selective        = false;
+    m_resumable        = false;
+    m_sync             = false;
+    m_imageCrc         = 0;
+    m_checkpointLen    = 0;
+    m_chunkSize        = 0;
+    m_compressed       = false;
+    m_delta            = false;
+    m_inProgress       = false;
+    resetSector();
+    if (!complete) {
+        m_pTarget->abort();
+    }
+    m_pTarget = m_pFlash;
+}
+
+/**
+ * @brief Adds a sample to the histogram.
+ */
+void NimBLEOtaHistogram::add(uint32_t us) {
+    uint8_t bin = 0;
+    while (bin < 7 && us >= (1000u << (2 * bin))) {
+        bin++;
+    }
+
+    bins[bin]++;
+    count++;
+    totalUs += us;
+    maxUs    = std::max(maxUs, us);
+}
+
+/**
+ * @brief The performance counters of the current update, or the last one when none is in progress.
+ * @details Safe to call from any task. Each pipeline stage publishes its own counters, the receive counters
+ * once per packet, ack or sector, so the stages may be up to a sector apart while an update is running.
+ */
+NimBLEOtaStats NimBLEOtaCore::getStats() const {
+    HostStats host = m_hostStats.read();
+    if (host.startUs == 0) {
+        return m_lastStats.read();
+    }
+
+    VerifyStats    verify = m_verifyStats.read();
+    FlashStats     flash  = m_flashStats.read();
+    NimBLEOtaStats stats{};
+    stats.elapsedMs       = (nowUs() - host.startUs) / 1000;
+    stats.bytesWritten    = flash.bytesWritten;
+    stats.bytesReceived   = host.bytesReceived;
+    stats.packets         = host.packets;
+    stats.sectors         = flash.sectors;
+    stats.retransmits     = host.retransmits;
+    stats.crcErrors       = verify.crcErrors;
+    stats.indexErrors     = host.indexErrors;
+    stats.lengthErrors    = host.lengthErrors;
+    stats.busyErrors      = host.busyErrors;
+    stats.missingRequests = host.missingRequests;
+    stats.mtu             = host.mtu;
+    stats.sectorTime      = host.sectorTime;
+#if NIMBLE_OTA_CRC_INCREMENTAL
+    stats.crcTime = host.crcTime;
+#else
+    stats.crcTime = verify.crcTime;
+#endif
+    stats.flashTime = flash.flashTime;
+
+    stats.bytesPerSec      = stats.elapsedMs ? static_cast<uint64_t>(stats.bytesWritten) * 1000 / stats.elapsedMs : 0;
+    stats.packetsPerSector = stats.sectors ? std::min<uint32_t>(stats.packets / stats.sectors, 0xffff) : 0;
+    return stats;
+}
+
+/**
+ * @brief Packs the statistics into the little endian format sent on the progress characteristic.
+ * @details Byte 0 is the format version (1), byte 1 bit 0 is set while an update is in progress,
+ * bytes 2-5 bytes written, 6-9 bytes per second, 10-13 elapsed ms, 14-17 packets, 18-19 sectors,
+ * 20-21 retransmits, 22-23 crc errors, 24-25 index errors, 26-27 length errors, 28-29 missing packet requests,
+ * 30-31 MTU, 32-33 average and 34-35 max sector receive time in ms, 36-37 average crc time in us,
+ * 38-39 average and 40-41 max flash write time in ms.
+ * @param [out] buf At least NIMBLE_OTA_STATS_LENGTH bytes.
+ * @return The length of the packed data.
+ */
+size_t NimBLEOtaCore::packStats(const NimBLEOtaStats& stats, bool inProgress, uint8_t* buf) {
+    size_t pos   = 0;
+    auto   put16 = [&](uint32_t v) {
+        v        = std::min<uint32_t>(v, 0xffff);
+        buf[pos++] = v & 0xff;
+        buf[pos++] = (v >> 8) & 0xff;
+    };
+    auto put32 = [&](uint32_t v) {
+        put16(v & 0xffff);
+        put16(v >> 16);
+    };
+
+    buf[pos++] = 1;
+    buf[pos++] = inProgress ? 1 : 0;
+    put32(stats.bytesWritten);
+    put32(stats.bytesPerSec);
+    put32(stats.elapsedMs);
+    put32(stats.packets);
+    put16(stats.sectors);
+    put16(stats.retransmits);
+    put16(stats.crcErrors);
+    put16(stats.indexErrors);
+    put16(stats.lengthErrors);
+    put16(stats.missingRequests);
+    put16(stats.mtu);
+    put16(stats.sectorTime.avgUs() / 1000);
+    put16(stats.sectorTime.maxUs / 1000);
+    put16(stats.crcTime.avgUs());
+    put16(stats.flashTime.avgUs() / 1000);
+    put16(stats.flashTime.maxUs / 1000);
+    return pos;
+}
+
+/**
+ * @brief Copies the trace events kept, oldest first, see NimBLEOtaTrace.
+ * @param [in] offset The number of events to skip, to read the trace in parts.
+ * @return The number of events copied, always 0 unless built with NIMBLE_OTA_TRACE.
+ */
+size_t NimBLEOtaCore::getTrace(NimBLEOtaTraceRecord* pRecords, size_t count, size_t offset) const {
+#if NIMBLE_OTA_TRACE
+    return m_trace.read(pRecords, count, offset);
+#else
+    return 0;
+#endif
+}
+
+void NimBLEOtaCore::clearTrace() {
+#if NIMBLE_OTA_TRACE
+    m_trace.clear();
+#endif
+}
+
+/**
+ * @brief Monotonic time in microseconds.
+ */
+uint64_t NimBLEOtaCore::nowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool NimBLEOtaCore::startAbortTimer(uint32_t seconds) {
+    return m_pTimer->start(seconds * 1000);
+}
+
+void NimBLEOtaCore::stopAbortTimer() {
+    m_pTimer->stop();
+}
+
+void NimBLEOtaCore::onAbortTimerExpired() {
+    NIMBLE_LOGW(LOG_TAG, "Abort timer expired: aborting update!");
+    OTA_TRACE(Error, m_sector, Disconnected, otaFail);
+    abortUpdate();
+}
+
+uint16_t NimBLEOtaCore::getCrc16(const uint8_t* buf, size_t len) {
+    return NimBLEOtaCrc::compute(buf, len);
+}
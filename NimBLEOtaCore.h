@@ -0,0 +1,498 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#ifndef NIMBLE_OTA_CORE_H_
+#define NIMBLE_OTA_CORE_H_
+
+#include "NimBLEOtaPipeline.h"
+#include "NimBLEOtaTrace.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/** Largest block size a client may request by default, 4096 to 32768. */
+#ifndef NIMBLE_OTA_MAX_BLOCK_SIZE
+# define NIMBLE_OTA_MAX_BLOCK_SIZE 32768
+#endif
+
+// The offsets within a sector are 16 bit
+static_assert(NIMBLE_OTA_MAX_BLOCK_SIZE >= 4096 && NIMBLE_OTA_MAX_BLOCK_SIZE <= 32768 &&
+                  (NIMBLE_OTA_MAX_BLOCK_SIZE & (NIMBLE_OTA_MAX_BLOCK_SIZE - 1)) == 0,
+              "NIMBLE_OTA_MAX_BLOCK_SIZE must be a power of 2 from 4096 to 32768");
+
+/** Packets per sector tracked for selective retransmission, a full block at the minimum MTU (17 bytes per packet). */
+#ifndef NIMBLE_OTA_MAX_SECTOR_PACKETS
+# define NIMBLE_OTA_MAX_SECTOR_PACKETS ((NIMBLE_OTA_MAX_BLOCK_SIZE + 2 + 16) / 17)
+#endif
+
+/** Bytes written to flash between checkpoints of a resumable update. */
+#ifndef NIMBLE_OTA_CHECKPOINT_INTERVAL
+# define NIMBLE_OTA_CHECKPOINT_INTERVAL 65536
+#endif
+
+/** Number of sink types, type 0 is the app partition, see NimBLEOtaCore::setSink. */
+#ifndef NIMBLE_OTA_MAX_SINKS
+# define NIMBLE_OTA_MAX_SINKS 8
+#endif
+
+/** Longest sink name, i.e. partition label or file path, a client can send in the target command. */
+#ifndef NIMBLE_OTA_MAX_SINK_NAME
+# define NIMBLE_OTA_MAX_SINK_NAME 64
+#endif
+
+/** Longest image signature a client can send, i.e. 72 bytes for ECDSA P-256 or 384 for RSA-3072. */
+#ifndef NIMBLE_OTA_MAX_SIGNATURE
+# define NIMBLE_OTA_MAX_SIGNATURE 512
+#endif
+
+/** Length of the statistics sent on the progress characteristic, see NimBLEOtaCore::packStats. */
+#define NIMBLE_OTA_STATS_LENGTH 42
+
+/**
+ * @brief Destination of the received firmware image, i.e. the esp_ota_* API on device.
+ * @details All methods return 0 on success or a platform error code (esp_err_t on device),
+ * the image size passed to begin is 0 if it is not known up front.
+ */
+class NimBLEOtaFlash {
+  public:
+    virtual ~NimBLEOtaFlash() = default;
+    virtual int  begin(uint32_t imageSize)                 = 0;
+    virtual int  write(const uint8_t* data, size_t length) = 0;
+    virtual int  end()                                     = 0;
+    virtual void abort()                                   = 0;
+
+    /**
+     * @brief Reopens an image partly written by an earlier update, the next write continues at offset.
+     * @param [in] crc The crc of the first offset bytes of the image, checked against the flash contents.
+     * @return 0 on success, an error code if not supported or the data does not match.
+     */
+    virtual int resume(uint32_t offset, uint16_t crc) { return -1; }
+};
+
+/**
+ * @brief Destination of an update other than the app partition, e.g. a data partition, a file or a co-processor.
+ * @details Selected by the client with the target command, open is called with the name it sent
+ * (a partition label, a file path ...) and the image is rejected in the start command if it exceeds the capacity.
+ * A write may block to apply flow control, the client is told to resend sectors while the buffers are full.
+ */
+class NimBLEOtaSink : public NimBLEOtaFlash {
+  public:
+    virtual int      open(const char* name) = 0;
+    virtual uint32_t capacity() const       = 0; // bytes available to the image opened
+};
+
+/**
+ * @brief Hashes the image as it is written and checks its signature before it is committed.
+ * @details The SHA-256 is of the image written to the flash or sink, after decompression or patching.
+ */
+class NimBLEOtaVerifier {
+  public:
+    virtual ~NimBLEOtaVerifier()                                                 = default;
+    virtual int  begin()                                                         = 0;
+    virtual int  update(const uint8_t* data, size_t length)                      = 0;
+    virtual int  finish(uint8_t* digest)                                         = 0; // 32 bytes
+    virtual bool verify(const uint8_t* digest, const uint8_t* sig, size_t length) = 0;
+};
+
+/**
+ * @brief Update partition for a sync update, which reuses the blocks of the new image the device already has.
+ * @details The client sends a hash of each block, blocks already in the update partition are kept and those
+ * at the same offset in the running image are copied, only the others are sent. begin does not erase the
+ * partition, each block is erased as it is written.
+ */
+class NimBLEOtaSectorSync : public NimBLEOtaFlash {
+  public:
+    virtual bool reuse(uint32_t offset, uint32_t length, const uint8_t* hash) = 0; // hash is 8 bytes of the SHA-256
+    virtual int  seek(uint32_t offset)                                        = 0; // the next write is at offset
+};
+
+/**
+ * @brief The progress of a resumable update, saved while it is written.
+ */
+struct NimBLEOtaCheckpointData {
+    uint8_t  imageId[6]; // start of the image SHA-256 sent in the start command
+    uint32_t fileLen;
+    uint32_t offset; // bytes written to flash
+    uint16_t crc;    // crc of the bytes written
+};
+
+/**
+ * @brief Persistent storage for the update checkpoint, i.e. NVS on device, so an update can continue after a reset.
+ */
+class NimBLEOtaCheckpoint {
+  public:
+    virtual ~NimBLEOtaCheckpoint()                         = default;
+    virtual bool load(NimBLEOtaCheckpointData* pData)      = 0;
+    virtual bool save(const NimBLEOtaCheckpointData& data) = 0;
+    virtual void clear()                                   = 0;
+};
+
+/**
+ * @brief Durations of one operation during an update.
+ * @details bins[n] counts the samples shorter than 1 << (2 * n) ms, i.e. 1, 4, 16 ... 4096 ms, the last bin the longer ones.
+ */
+struct NimBLEOtaHistogram {
+    uint32_t count;
+    uint32_t maxUs;
+    uint64_t totalUs;
+    uint16_t bins[8];
+
+    void     add(uint32_t us);
+    uint32_t avgUs() const { return count ? totalUs / count : 0; }
+};
+
+/**
+ * @brief Performance counters of the current update, or the last one when none is in progress.
+ */
+struct NimBLEOtaStats {
+    uint32_t           elapsedMs;        // since the start command
+    uint32_t           bytesWritten;     // firmware data verified and written, excluding resumed data
+    uint32_t           bytesReceived;    // firmware packet data received, including retransmits
+    uint32_t           bytesPerSec;      // bytesWritten over elapsedMs
+    uint32_t           packets;
+    uint32_t           sectors;          // sectors verified
+    uint16_t           retransmits;      // sectors received again after an error
+    uint16_t           crcErrors;
+    uint16_t           indexErrors;
+    uint16_t           lengthErrors;
+    uint16_t           busyErrors;       // no sector buffer free
+    uint16_t           missingRequests;  // selective retransmission requests
+    uint16_t           mtu;              // MTU of the link the packets arrive on, ATT or L2CAP
+    uint16_t           packetsPerSector; // average
+    NimBLEOtaHistogram sectorTime;       // first to last packet of a sector
+    NimBLEOtaHistogram crcTime;          // crc of a sector
+    NimBLEOtaHistogram flashTime;        // flash write of a sector, including decompression and patching
+};
+
+/**
+ * @brief Memory for the update provided by the application, so nothing is allocated from the heap when an update starts.
+ * @details A buffer left null is allocated when needed. The sector pool holds the sector buffers and their crc,
+ * the block size is reduced until they fit.
+ */
+struct NimBLEOtaBuffers {
+    uint8_t* pPool;
+    size_t   poolLen;
+    uint8_t* pSectorMap;   // one bit per sector of a sync update
+    size_t   sectorMapLen;
+    uint8_t* pSignature;   // NIMBLE_OTA_MAX_SIGNATURE bytes
+};
+
+/**
+ * @brief Sends the command and firmware acks back to the client.
+ * @details Firmware acks are sent as notifications when the client negotiated it, otherwise indications.
+ */
+class NimBLEOtaTransport {
+  public:
+    virtual ~NimBLEOtaTransport()                                                     = default;
+    virtual void     sendCommandAck(const uint8_t* data, size_t length)               = 0;
+    virtual void     sendFirmwareAck(const uint8_t* data, size_t length, bool notify) = 0;
+    virtual uint16_t dataChannel() const { return 0; } // PSM of an L2CAP channel for the firmware packets, 0 if none
+    virtual uint16_t mtu() const { return 0; } // MTU the firmware packets arrive with, 0 if unknown
+};
+
+/**
+ * @brief One shot timer used to abort a stalled update,
+ * the owner calls NimBLEOtaCore::onAbortTimerExpired when it fires.
+ */
+class NimBLEOtaTimer {
+  public:
+    virtual ~NimBLEOtaTimer()       = default;
+    virtual bool start(uint32_t ms) = 0;
+    virtual void stop()             = 0;
+};
+
+/**
+ * @brief Streaming decompressor for compressed images, the output is written to the flash backend as it is produced.
+ * @details Called by the flash stage with the verified sectors in order, all methods return 0 on success or an error code.
+ * Memory is only held between begin and end or abort.
+ */
+class NimBLEOtaDecompressor {
+  public:
+    virtual ~NimBLEOtaDecompressor()                           = default;
+    virtual int      begin(NimBLEOtaFlash* pOut)               = 0;
+    virtual int      write(const uint8_t* data, size_t length) = 0;
+    virtual int      end()                                     = 0; // fails if the compressed stream is incomplete
+    virtual void     abort()                                   = 0;
+    virtual uint32_t written() const                           = 0; // decompressed bytes written to the flash
+};
+
+/**
+ * @brief Rebuilds the new image from a delta patch and the running image.
+ * @details The patch is written to it like a flash backend, after decompression if compressed,
+ * and the new image is written to the flash backend it was created with.
+ */
+class NimBLEOtaPatcher : public NimBLEOtaFlash {
+  public:
+    virtual bool     checkBase(const uint8_t* hash, size_t length) = 0; // compares the start of the base image hash
+    virtual uint32_t written() const                               = 0; // bytes of the new image written
+    virtual uint32_t imageSize() const                             = 0; // length of the new image, 0 until known
+    virtual void     setOutput(NimBLEOtaFlash* pOut)               = 0; // where the new image is written
+};
+
+/**
+ * @brief The client of an update, the first to send a command, known by its identity address until the update ends.
+ * @details The connection handle follows the client when it reconnects to resume, the link requests and the
+ * L2CAP data channel use it. Address is NimBLEAddress on device, it needs isNull() and ==.
+ */
+template <typename Address>
+class NimBLEOtaClientSession {
+  public:
+    static constexpr uint16_t noConnHandle = 0xffff; // BLE_HS_CONN_HANDLE_NONE
+
+    /**
+     * @brief Binds the first client, or takes the connection handle of the bound client.
+     * @return False if another client is bound.
+     */
+    bool bind(const Address& address, uint16_t connHandle) {
+        if (m_address.isNull()) {
+            m_address = address;
+        } else if (!(address == m_address)) {
+            return false;
+        }
+
+        m_connHandle = connHandle;
+        return true;
+    }
+
+    bool isClient(const Address& address) const { return !m_address.isNull() && address == m_address; }
+    void clear() {
+        m_address    = Address{};
+        m_connHandle = noConnHandle;
+    }
+    const Address& address() const { return m_address; }
+    uint16_t       connHandle() const { return m_connHandle; }
+
+  private:
+    Address  m_address{};
+    uint16_t m_connHandle{noConnHandle};
+};
+
+/**
+ * @brief The OTA protocol state machine, independent of the BLE stack and flash driver.
+ * @details Parses the command and firmware packets, verifies each sector and hands the data to the flash backend.
+ * Compiles on the host so the receive path can be benchmarked without a device.
+ */
+class NimBLEOtaCore {
+  public:
+    enum SinkType : uint8_t {
+        AppSink,       // the next app partition, the default
+        PartitionSink, // a data partition selected by its label
+        FileSink,      // a file in a mounted filesystem
+        StreamSink,    // an external device, i.e. a co-processor
+    };
+
+    enum Reason {
+        StartCmd,
+        StopCmd,
+        Disconnected,
+        Reconnected,
+        FlashError,
+        LengthError,
+        Resumed,
+        VerifyError,
+    };
+
+    NimBLEOtaCore(NimBLEOtaFlash* pFlash, NimBLEOtaTransport* pTransport, NimBLEOtaTimer* pTimer)
+        : m_pFlash(pFlash), m_pTarget(pFlash), m_pTransport(pTransport), m_pTimer(pTimer) {}
+    virtual ~NimBLEOtaCore() = default;
+
+    virtual void    abortUpdate();
+    bool            startAbortTimer(uint32_t seconds);
+    void            stopAbortTimer();
+    void            onAbortTimerExpired();
+    bool            isInProgress() const { return m_inProgress; };
+    void            handleCommand(const uint8_t* data, size_t length);
+    void            handleFirmware(const uint8_t* data, size_t length);
+    void            setMaxWindow(uint8_t sectors);
+    void            setMaxBlockSize(uint32_t size);
+    void            setDecompressor(NimBLEOtaDecompressor* pDecompressor);
+    void            setPatcher(NimBLEOtaPatcher* pPatcher);
+    void            setCheckpoint(NimBLEOtaCheckpoint* pCheckpoint);
+    void            setSectorSync(NimBLEOtaSectorSync* pSync);
+    bool            setSink(uint8_t type, NimBLEOtaSink* pSink);
+    bool            selectSink(uint8_t type, const char* name);
+    uint8_t         getSinkType() const { return m_sinkType; }
+    void            setVerifier(NimBLEOtaVerifier* pVerifier, bool requireSignature);
+    bool            getImageDigest(uint8_t* digest) const;
+    void            discardPending();
+    void            setCheckpointInterval(uint32_t bytes);
+    bool            setPipeline(NimBLEOtaScheduler* pScheduler, uint8_t buffers);
+    bool            setBuffers(const NimBLEOtaBuffers& buffers);
+    void            runVerifyStage();
+    void            runFlashStage();
+    void            runHostStage();
+    NimBLEOtaStats  getStats() const;
+    size_t          getTrace(NimBLEOtaTraceRecord* pRecords, size_t count, size_t offset = 0) const;
+    void            clearTrace();
+    static size_t   packStats(const NimBLEOtaStats& stats, bool inProgress, uint8_t* buf);
+    static uint16_t getCrc16(const uint8_t* buf, size_t len);
+
+  protected:
+    virtual void onOtaStart(uint32_t firmwareSize, Reason reason) {}
+    virtual void onOtaProgress(uint32_t current, uint32_t total) {}
+    virtual void onOtaImageProgress(uint32_t written, uint32_t imageSize) {}
+    virtual void onOtaStop(Reason reason) {}
+    virtual void onOtaComplete() {}
+    virtual void onOtaError(int err, Reason reason) {}
+
+  private:
+    using SectorQueue = NimBLEOtaSpscQueue<NimBLEOtaSector*, NIMBLE_OTA_MAX_BUFFERS>;
+
+    /**
+     * @brief Passes the image to the flash or sink, hashing it on the way,
+     * the image is verified before the output is ended.
+     */
+    class NimBLEOtaVerifyStage : public NimBLEOtaFlash {
+      public:
+        NimBLEOtaVerifyStage(NimBLEOtaCore* pCore) : m_pCore(pCore) {}
+        int  begin(uint32_t imageSize) override;
+        int  write(const uint8_t* data, size_t length) override;
+        int  end() override;
+        void abort() override { m_pOut->abort(); }
+
+        NimBLEOtaFlash* m_pOut{nullptr};
+
+      private:
+        NimBLEOtaCore* m_pCore;
+    };
+
+    void     sendFirmwareAck(uint16_t recvSector, uint16_t status, uint16_t sector, const uint8_t* pInfo = nullptr);
+    void     sendMissingAck(uint16_t recvSector);
+    bool     storePacket(uint8_t seq, const uint8_t* data, size_t length, uint32_t sectorLen);
+    uint16_t packetIndex(uint8_t seq) const;
+    void     setTransferMode(uint8_t flags, uint8_t window, uint8_t* cmdAck);
+    bool     allocBuffers(uint32_t blockSize);
+    void     freeBuffers();
+    void     freeSectorMap();
+    void     freeSignature();
+    void     syncRewind();
+    int      beginImage(uint8_t flags, uint32_t imageLen);
+    uint32_t resumeImage(const uint8_t* imageId, uint32_t fileLen);
+    bool     syncSectors(const uint8_t* data, size_t length, uint8_t* cmdAck);
+    void     runSyncJob();
+    void     sendCommandAck(uint8_t* cmdAck);
+    void     targetCommand(const uint8_t* data, size_t length, uint8_t* cmdAck);
+    void     signatureCommand(const uint8_t* data, size_t length, uint8_t* cmdAck);
+    uint16_t nextSector(uint16_t sector) const;
+    void     saveCheckpoint();
+    int      writeImage(const uint8_t* data, size_t length);
+    int      endImage();
+    void     resetSector();
+    uint16_t sectorCrc(const NimBLEOtaSector* pSector);
+
+    static uint64_t nowUs();
+
+    NimBLEOtaFlash*        m_pFlash{nullptr};
+    NimBLEOtaFlash*        m_pTarget{nullptr}; // the flash or the sink selected for the update
+    NimBLEOtaSink*         m_sinks[NIMBLE_OTA_MAX_SINKS]{};
+    NimBLEOtaSink*         m_pSelected{nullptr}; // sink for the next start command
+    uint8_t                m_selectedType{AppSink};
+    uint8_t                m_sinkType{AppSink};
+    NimBLEOtaVerifier*     m_pVerifier{nullptr};
+    NimBLEOtaVerifyStage   m_verifyStage{this};
+    uint8_t*               m_pSignature{nullptr}; // sent by the client for the next update
+    uint16_t               m_signatureLen{};
+    uint8_t                m_digest[32]{};
+    bool                   m_hasDigest{false};
+    bool                   m_requireSignature{false};
+    std::atomic<bool>      m_verifyFailed{false};
+    NimBLEOtaTransport*    m_pTransport{nullptr};
+    NimBLEOtaTimer*        m_pTimer{nullptr};
+    NimBLEOtaScheduler*    m_pScheduler{nullptr};
+    NimBLEOtaDecompressor* m_pDecompressor{nullptr};
+    NimBLEOtaPatcher*      m_pPatcher{nullptr};
+    NimBLEOtaCheckpoint*   m_pCheckpoint{nullptr};
+    NimBLEOtaSectorSync*   m_pSync{nullptr};
+    uint8_t*               m_pNeeded{nullptr}; // sectors the client has to send in a sync update
+    // Each stage publishes its own counters, getStats() merges them.
+    struct HostStats {
+        uint64_t           startUs; // start of the update, 0 when none is in progress
+        uint32_t           packets;
+        uint32_t           bytesReceived;
+        uint16_t           retransmits;
+        uint16_t           indexErrors;
+        uint16_t           lengthErrors;
+        uint16_t           busyErrors;
+        uint16_t           missingRequests;
+        uint16_t           mtu;
+        NimBLEOtaHistogram sectorTime;
+        NimBLEOtaHistogram crcTime; // when NIMBLE_OTA_CRC_INCREMENTAL
+    };
+    struct VerifyStats {
+        uint16_t           crcErrors;
+        NimBLEOtaHistogram crcTime; // unless NIMBLE_OTA_CRC_INCREMENTAL
+    };
+    struct FlashStats {
+        uint32_t           bytesWritten;
+        uint32_t           sectors;
+        NimBLEOtaHistogram flashTime;
+    };
+    NimBLEOtaSnapshot<HostStats>      m_hostStats{};
+    NimBLEOtaSnapshot<VerifyStats>    m_verifyStats{};
+    NimBLEOtaSnapshot<FlashStats>     m_flashStats{};
+    NimBLEOtaSnapshot<NimBLEOtaStats> m_lastStats{}; // of the last update, written by the host
+#if NIMBLE_OTA_TRACE
+    NimBLEOtaTrace         m_trace{};
+#endif
+    uint64_t               m_sectorStart{};   // us, first packet of the current sector
+    uint32_t               m_sectorCrcUs{};   // crc time of the current sector when calculated incrementally
+    uint16_t               m_nextNewSector{}; // sectors below it are retransmits
+    uint32_t               m_checkpointInterval{NIMBLE_OTA_CHECKPOINT_INTERVAL};
+    uint32_t               m_checkpointLen{};
+    uint16_t               m_imageCrc{};
+    uint8_t                m_imageId[6]{};
+    uint32_t               m_fileLen{};
+    uint32_t               m_blockSize{4096};
+    uint32_t               m_maxBlockSize{NIMBLE_OTA_MAX_BLOCK_SIZE};
+    uint32_t               m_imageLen{};
+    uint32_t               m_reportedLen{};
+    uint32_t               m_reportedImageLen{};
+    std::atomic<uint32_t>  m_recvLen{0};
+    std::atomic<uint32_t>  m_writtenLen{0};
+    std::atomic<uint32_t>  m_outputLen{0};
+    std::atomic<int>       m_flashErr{0};
+    std::atomic<bool>      m_complete{false};
+    std::atomic<bool>      m_aborting{false};
+    std::atomic<uint8_t>   m_outstanding{0};
+    std::atomic<uint8_t>   m_epoch{0};
+    std::atomic<uint16_t>  m_rewindSector{0};
+    std::atomic<bool>      m_syncBusy{false};   // a sync command is being handled by the flash stage
+    NimBLEOtaSector*       m_pSyncJob{nullptr}; // its hashes, in a free sector buffer
+    NimBLEOtaSector        m_sectors[NIMBLE_OTA_MAX_BUFFERS]{};
+    NimBLEOtaSector*       m_pCurSector{nullptr};
+    uint8_t*               m_pPool{nullptr};
+    NimBLEOtaBuffers       m_buffers{}; // provided by the application, used instead of the heap
+    SectorQueue            m_freeQueue{};
+    SectorQueue            m_verifyQueue{};
+    SectorQueue            m_flashQueue{};
+    uint8_t                m_bufCount{1};
+    uint8_t                m_hostEpoch{};
+    uint16_t               m_sector{};
+    uint16_t               m_offset{};
+    uint16_t               m_crcOffset{};
+    uint16_t               m_calcCrc{};
+    uint16_t               m_chunkSize{};
+    uint16_t               m_nextPacket{};
+    uint16_t               m_lastPacket{0xffff};
+    uint16_t               m_packetCount{};
+    uint16_t               m_seqRef{};
+    uint32_t               m_packetMap[(NIMBLE_OTA_MAX_SECTOR_PACKETS + 31) / 32]{};
+    uint8_t                m_packet{};
+    uint8_t                m_window{1};
+    uint8_t                m_maxWindow{8};
+    uint8_t                m_ackInterval{1};
+    uint8_t                m_unacked{};
+    bool                   m_notifyAck{false};
+    bool                   m_rewinding{false};
+    bool                   m_selective{false};
+    bool                   m_nacked{false};
+    bool                   m_compressed{false};
+    bool                   m_delta{false};
+    bool                   m_resumable{false};
+    bool                   m_sync{false};
+    bool                   m_inProgress{false};
+};
+
+#endif // NIMBLE_OTA_CORE_H_
@@ -0,0 +1,53 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#ifndef NIMBLE_OTA_CRC_H_
+#define NIMBLE_OTA_CRC_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#define NIMBLE_OTA_CRC_BITWISE 0
+#define NIMBLE_OTA_CRC_TABLE   1
+#define NIMBLE_OTA_CRC_SLICING 2
+#define NIMBLE_OTA_CRC_ROM     3
+
+/**
+ * Selects the implementation used by NimBLEOtaCrc::update, the ROM routine on device
+ * and slicing by 8 (4KB of tables built on first use) on the host.
+ */
+#ifndef NIMBLE_OTA_CRC_BACKEND
+# if defined(ESP_PLATFORM)
+#  define NIMBLE_OTA_CRC_BACKEND NIMBLE_OTA_CRC_ROM
+# else
+#  define NIMBLE_OTA_CRC_BACKEND NIMBLE_OTA_CRC_SLICING
+# endif
+#endif
+
+/**
+ * When enabled the sector crc is calculated as the packets are received so the verify stage only compares it,
+ * otherwise the whole sector is checked by the verify stage.
+ */
+#ifndef NIMBLE_OTA_CRC_INCREMENTAL
+# define NIMBLE_OTA_CRC_INCREMENTAL 1
+#endif
+
+/**
+ * @brief CRC16/XMODEM (poly 0x1021, init 0) used for the sectors and the command and ack packets.
+ * @details The update functions take the crc of the data so far and return the crc including buf,
+ * start with 0 for a new calculation.
+ */
+class NimBLEOtaCrc {
+  public:
+    static uint16_t compute(const uint8_t* buf, size_t len) { return update(0, buf, len); }
+    static uint16_t update(uint16_t crc, const uint8_t* buf, size_t len);
+    static uint16_t updateBitwise(uint16_t crc, const uint8_t* buf, size_t len);
+    static uint16_t updateTable(uint16_t crc, const uint8_t* buf, size_t len);
+    static uint16_t updateSlicing(uint16_t crc, const uint8_t* buf, size_t len);
+#if defined(ESP_PLATFORM)
+    static uint16_t updateRom(uint16_t crc, const uint8_t* buf, size_t len);
+#endif
+};
+
+#endif // NIMBLE_OTA_CRC_H_
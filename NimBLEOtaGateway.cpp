@@ -0,0 +1,338 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#include "NimBLEOtaGateway.h"
+
+#if NIMBLE_OTA_GATEWAY
+
+# include "NimBLELog.h"
+
+# include <esp_timer.h>
+# include <mbedtls/sha256.h>
+# include <mbedtls/version.h>
+# if MBEDTLS_VERSION_NUMBER < 0x03000000
+#  define NIMBLE_OTA_SHA256(fn) fn##_ret
+# else
+#  define NIMBLE_OTA_SHA256(fn) fn
+# endif
+
+static constexpr uint16_t otaServiceUuid = 0x8018;
+static constexpr uint16_t recvFwUuid     = 0x8020;
+static constexpr uint16_t commandUuid    = 0x8022;
+static const char*        LOG_TAG        = "NimBLEOtaGateway";
+static const char*        CB_LOG_TAG     = "NimBLEOtaGatewayCallbacks";
+
+static uint32_t nowMs() {
+    return static_cast<uint32_t>(esp_timer_get_time() / 1000);
+}
+
+int NimBLEOtaPartitionImage::read(uint32_t offset, uint8_t* data, size_t length) {
+    if (offset + length > m_size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return esp_partition_read(m_pPartition, offset, data, length);
+}
+
+/**
+ * @brief SHA-256 of the image, the targets use the start of it to resume an interrupted update.
+ */
+bool NimBLEOtaPartitionImage::getHash(uint8_t* hash) {
+    uint8_t                buf[512];
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    bool ok = NIMBLE_OTA_SHA256(mbedtls_sha256_starts)(&ctx, 0) == 0;
+    for (uint32_t pos = 0; ok && pos < m_size; pos += sizeof(buf)) {
+        size_t len = std::min<size_t>(sizeof(buf), m_size - pos);
+        ok         = esp_partition_read(m_pPartition, pos, buf, len) == ESP_OK &&
+             NIMBLE_OTA_SHA256(mbedtls_sha256_update)(&ctx, buf, len) == 0;
+    }
+
+    ok = ok && NIMBLE_OTA_SHA256(mbedtls_sha256_finish)(&ctx, hash) == 0;
+    mbedtls_sha256_free(&ctx);
+    return ok;
+}
+
+/**
+ * @brief Adds a device to update, before or while the gateway runs.
+ */
+bool NimBLEOtaGateway::addTarget(const NimBLEAddress& address) {
+    for (const auto& target : m_targets) {
+        if (target.address == address) {
+            return false;
+        }
+    }
+
+    m_targets.push_back(Target{address, Pending, 0, 0});
+    return true;
+}
+
+/**
+ * @brief Allocates the connections and the sector cache, the updates run in poll().
+ * @param [in] connections Targets updated at the same time, up to NIMBLE_OTA_GATEWAY_MAX_CONNECTIONS
+ * and the connections NimBLE is configured for.
+ * @param [in] window Sectors in flight per target.
+ * @param [in] blockSize Block size requested, 4096 to 32768 rounded down to a power of two, the targets may lower it.
+ */
+bool NimBLEOtaGateway::begin(NimBLEOtaGatewayCallbacks* pCallbacks, uint8_t connections, uint8_t window, uint32_t blockSize) {
+    end();
+    connections = std::min<uint8_t>(std::max<uint8_t>(connections, 1), NIMBLE_OTA_GATEWAY_MAX_CONNECTIONS);
+
+    // One slot per connection sending a sector and as many again for the targets that fall behind.
+    if (!m_cache.begin(blockSize, connections * 2)) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < connections; i++) {
+        m_pLinks[i] = new NimBLEOtaGatewayLink(&m_cache);
+    }
+
+    static NimBLEOtaGatewayCallbacks defaultCallbacks;
+    m_pCallbacks = pCallbacks ? pCallbacks : &defaultCallbacks;
+    m_linkCount  = connections;
+    m_window     = window;
+    m_blockSize  = blockSize;
+    NIMBLE_LOGI(LOG_TAG,
+                "%u targets, %u connections, image: %u bytes",
+                static_cast<unsigned>(m_targets.size()),
+                connections,
+                static_cast<unsigned>(m_cache.imageSize()));
+    return true;
+}
+
+/**
+ * @brief Disconnects from the targets and frees the connections and the sector cache.
+ */
+void NimBLEOtaGateway::end() {
+    for (uint8_t i = 0; i < m_linkCount; i++) {
+        delete m_pLinks[i];
+        m_pLinks[i] = nullptr;
+    }
+
+    m_linkCount = 0;
+    m_cache.end();
+}
+
+/**
+ * @brief Runs the updates, call repeatedly from one task.
+ * @return True while targets remain to be updated.
+ */
+bool NimBLEOtaGateway::poll() {
+    uint32_t now    = nowMs();
+    bool     active = false;
+    for (uint8_t i = 0; i < m_linkCount; i++) {
+        runLink(m_pLinks[i], now);
+        active = active || m_pLinks[i]->m_state != NimBLEOtaGatewayLink::Free;
+    }
+
+    for (const auto& target : m_targets) {
+        active = active || target.status == Pending;
+    }
+    return active && m_linkCount;
+}
+
+void NimBLEOtaGateway::runLink(NimBLEOtaGatewayLink* pLink, uint32_t nowMs) {
+    switch (pLink->m_state.load()) {
+        case NimBLEOtaGatewayLink::Free: {
+            // The controller makes one connection at a time.
+            for (uint8_t i = 0; i < m_linkCount; i++) {
+                if (m_pLinks[i]->m_state == NimBLEOtaGatewayLink::Connecting) {
+                    return;
+                }
+            }
+
+            for (size_t i = 0; i < m_targets.size(); i++) {
+                if (m_targets[i].status == Pending) {
+                    m_targets[i].status = Updating;
+                    m_targets[i].attempts++;
+                    pLink->m_target = i;
+                    if (!pLink->connect(m_targets[i].address)) {
+                        finishTarget(pLink, false);
+                    }
+                    return;
+                }
+            }
+            return;
+        }
+
+        case NimBLEOtaGatewayLink::Connecting:
+            return;
+
+        case NimBLEOtaGatewayLink::Connected:
+            if (!pLink->open() || !pLink->m_core.start(m_window, m_blockSize, nowMs)) {
+                pLink->close();
+                return;
+            }
+            pLink->m_state = NimBLEOtaGatewayLink::Open;
+            return;
+
+        case NimBLEOtaGatewayLink::Open: {
+            Ack ack;
+            while (pLink->m_acks.pop(ack)) {
+                if (ack.command) {
+                    pLink->m_core.handleCommandAck(ack.data, sizeof(ack.data), nowMs);
+                } else {
+                    pLink->m_core.handleFirmwareAck(ack.data, sizeof(ack.data), nowMs);
+                }
+            }
+
+            pLink->m_core.poll(nowMs);
+            Target& target = m_targets[pLink->m_target];
+            if (pLink->m_core.getAcked() != target.acked) {
+                target.acked = pLink->m_core.getAcked();
+                m_pCallbacks->onProgress(this, target.address, target.acked, m_cache.imageSize());
+            }
+
+            if (pLink->m_core.getState() == NimBLEOtaClientCore::Complete) {
+                finishTarget(pLink, true);
+                pLink->close();
+            } else if (pLink->m_core.getState() == NimBLEOtaClientCore::Failed) {
+                pLink->close();
+            }
+            return;
+        }
+
+        case NimBLEOtaGatewayLink::Closed:
+            pLink->m_core.abort();
+            if (m_targets[pLink->m_target].status == Updating) {
+                finishTarget(pLink, false);
+            }
+            pLink->m_state = NimBLEOtaGatewayLink::Free;
+            return;
+    }
+}
+
+/**
+ * @brief Reports a target done, a failed one is tried again until it used all its attempts.
+ */
+void NimBLEOtaGateway::finishTarget(NimBLEOtaGatewayLink* pLink, bool success) {
+    Target& target = m_targets[pLink->m_target];
+    if (!success && target.attempts < NIMBLE_OTA_GATEWAY_ATTEMPTS) {
+        NIMBLE_LOGW(LOG_TAG, "%s - attempt %u failed", target.address.toString().c_str(), target.attempts);
+        target.status = Pending;
+        return;
+    }
+
+    target.status = success ? Done : Failed;
+    m_pCallbacks->onDone(this, target.address, success);
+}
+
+NimBLEOtaGateway::NimBLEOtaGatewayLink::~NimBLEOtaGatewayLink() {
+    m_core.abort();
+    if (m_pClient != nullptr) {
+        m_pClient->setClientCallbacks(nullptr, false);
+        NimBLEDevice::deleteClient(m_pClient);
+    }
+}
+
+/**
+ * @brief Starts connecting to a target, onConnect or onConnectFail follow on the BLE host task.
+ */
+bool NimBLEOtaGateway::NimBLEOtaGatewayLink::connect(const NimBLEAddress& address) {
+    if (m_pClient == nullptr) {
+        m_pClient = NimBLEDevice::createClient();
+        if (m_pClient == nullptr) {
+            NIMBLE_LOGE(LOG_TAG, "no client available, check CONFIG_BT_NIMBLE_MAX_CONNECTIONS");
+            return false;
+        }
+
+        m_pClient->setClientCallbacks(this, false);
+        m_pClient->setConnectionParams(6, 12, 0, 400); // 7.5 to 15ms interval, 4s supervision timeout
+    }
+
+    Ack ack;
+    while (m_acks.pop(ack)) {
+    }
+
+    m_state = Connecting;
+    if (!m_pClient->connect(address, true, true)) {
+        m_state = Free;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Finds the OTA characteristics of the target and subscribes to the acks.
+ */
+bool NimBLEOtaGateway::NimBLEOtaGatewayLink::open() {
+    NimBLERemoteService* pService = m_pClient->getService(NimBLEUUID(otaServiceUuid));
+    if (pService == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "%s - no OTA service", m_pClient->getPeerAddress().toString().c_str());
+        return false;
+    }
+
+    m_pCommandChr = pService->getCharacteristic(NimBLEUUID(commandUuid));
+    m_pRecvFwChr  = pService->getCharacteristic(NimBLEUUID(recvFwUuid));
+    if (m_pCommandChr == nullptr || m_pRecvFwChr == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "%s - OTA characteristics not found", m_pClient->getPeerAddress().toString().c_str());
+        return false;
+    }
+
+    m_pClient->setDataLen(251);
+    return m_pCommandChr->subscribe(
+               false,
+               [this](NimBLERemoteCharacteristic* pChr, uint8_t* data, size_t length, bool isNotify) {
+                   queueAck(data, length, true);
+               }) &&
+           m_pRecvFwChr->subscribe(true, [this](NimBLERemoteCharacteristic* pChr, uint8_t* data, size_t length, bool isNotify) {
+               queueAck(data, length, false);
+           });
+}
+
+void NimBLEOtaGateway::NimBLEOtaGatewayLink::close() {
+    m_core.abort();
+    if (m_pClient != nullptr && m_pClient->isConnected()) {
+        m_pClient->disconnect(); // onDisconnect moves the link to closed
+        return;
+    }
+    m_state = Closed;
+}
+
+void NimBLEOtaGateway::NimBLEOtaGatewayLink::queueAck(const uint8_t* data, size_t length, bool command) {
+    Ack ack{};
+    memcpy(ack.data, data, std::min(length, sizeof(ack.data)));
+    ack.command = command;
+    if (!m_acks.push(ack)) {
+        NIMBLE_LOGW(LOG_TAG, "ack queue full, ack dropped"); // the ack timeout recovers
+    }
+}
+
+bool NimBLEOtaGateway::NimBLEOtaGatewayLink::sendCommand(const uint8_t* data, size_t length) {
+    return m_pCommandChr->writeValue(data, length, true);
+}
+
+bool NimBLEOtaGateway::NimBLEOtaGatewayLink::sendFirmware(const uint8_t* data, size_t length) {
+    // Fails while the stack has no buffer for it, the client core sends the packet again on the next poll.
+    return m_pRecvFwChr->writeValue(data, length, false);
+}
+
+uint16_t NimBLEOtaGateway::NimBLEOtaGatewayLink::mtu() const {
+    return m_pClient->getMTU();
+}
+
+void NimBLEOtaGateway::NimBLEOtaGatewayLink::onConnect(NimBLEClient* pClient) {
+    m_state = Connected;
+}
+
+void NimBLEOtaGateway::NimBLEOtaGatewayLink::onConnectFail(NimBLEClient* pClient, int reason) {
+    NIMBLE_LOGW(LOG_TAG, "%s - connect failed, reason: %d", pClient->getPeerAddress().toString().c_str(), reason);
+    m_state = Closed;
+}
+
+void NimBLEOtaGateway::NimBLEOtaGatewayLink::onDisconnect(NimBLEClient* pClient, int reason) {
+    m_state = Closed;
+}
+
+void NimBLEOtaGatewayCallbacks::onProgress(NimBLEOtaGateway*    pGateway,
+                                           const NimBLEAddress& address,
+                                           uint32_t             acked,
+                                           uint32_t             total) {
+    NIMBLE_LOGD(CB_LOG_TAG, "%s - %" PRIu32 " of %" PRIu32 " bytes", address.toString().c_str(), acked, total);
+}
+
+void NimBLEOtaGatewayCallbacks::onDone(NimBLEOtaGateway* pGateway, const NimBLEAddress& address, bool success) {
+    NIMBLE_LOGI(CB_LOG_TAG, "%s - update %s", address.toString().c_str(), success ? "complete" : "failed");
+}
+
+#endif // NIMBLE_OTA_GATEWAY
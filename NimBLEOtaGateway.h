@@ -0,0 +1,155 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#ifndef NIMBLE_OTA_GATEWAY_H_
+#define NIMBLE_OTA_GATEWAY_H_
+
+#include <esp_partition.h>
+#include <NimBLEDevice.h>
+#include "NimBLEOtaClient.h"
+#include "NimBLEOtaPipeline.h"
+
+#include <atomic>
+#include <vector>
+
+// The gateway connects to the targets as a central, the role must be enabled in the NimBLE config
+#ifndef NIMBLE_OTA_GATEWAY
+# if defined(CONFIG_BT_NIMBLE_ROLE_CENTRAL)
+#  define NIMBLE_OTA_GATEWAY 1
+# else
+#  define NIMBLE_OTA_GATEWAY 0
+# endif
+#endif
+
+/** Targets updated at the same time, each uses a connection, see CONFIG_BT_NIMBLE_MAX_CONNECTIONS. */
+#ifndef NIMBLE_OTA_GATEWAY_MAX_CONNECTIONS
+# define NIMBLE_OTA_GATEWAY_MAX_CONNECTIONS 8
+#endif
+
+/** Connections made to a target before it is reported as failed, each resumes where the last one stopped. */
+#ifndef NIMBLE_OTA_GATEWAY_ATTEMPTS
+# define NIMBLE_OTA_GATEWAY_ATTEMPTS 3
+#endif
+
+#if NIMBLE_OTA_GATEWAY
+
+/**
+ * @brief An image stored in a partition of the gateway, i.e. downloaded to a data partition or the next app partition.
+ */
+class NimBLEOtaPartitionImage : public NimBLEOtaBaseImage {
+  public:
+    NimBLEOtaPartitionImage(const esp_partition_t* pPartition, uint32_t size) : m_pPartition(pPartition), m_size(size) {}
+
+    int      read(uint32_t offset, uint8_t* data, size_t length) override;
+    uint32_t size() const override { return m_size; }
+    bool     getHash(uint8_t* hash) override;
+
+  private:
+    const esp_partition_t* m_pPartition;
+    uint32_t               m_size;
+};
+
+class NimBLEOtaGatewayCallbacks;
+
+/**
+ * @brief Store and forward gateway, pushes one image to many NimBLEOta devices over concurrent connections.
+ * @details Connects to the targets as a central and sends the image with a NimBLEOtaClientCore each,
+ * the sectors are read from the image once and shared by the targets sending them at the same time.
+ * A target that disconnects or stops responding is connected again and resumes the image if it supports it.
+ * poll() runs the updates and must be called from one task, i.e. the Arduino loop, the acks are queued by the BLE host task.
+ */
+class NimBLEOtaGateway {
+  public:
+    enum Status : uint8_t {
+        Pending,
+        Updating,
+        Done,
+        Failed,
+    };
+
+    NimBLEOtaGateway(NimBLEOtaBaseImage* pImage, uint32_t imageSize) : m_cache(pImage, imageSize) {}
+    ~NimBLEOtaGateway() { end(); }
+
+    bool     addTarget(const NimBLEAddress& address);
+    bool     begin(NimBLEOtaGatewayCallbacks* pCallbacks = nullptr,
+                   uint8_t                    connections = 3,
+                   uint8_t                    window      = 4,
+                   uint32_t                   blockSize   = 4096);
+    bool     poll();
+    void     end();
+    Status   getStatus(size_t index) const { return m_targets[index].status; }
+    size_t   getTargetCount() const { return m_targets.size(); }
+    uint32_t getSectorReads() const { return m_cache.reads(); }
+
+  private:
+    struct Target {
+        NimBLEAddress address;
+        Status        status;
+        uint8_t       attempts;
+        uint32_t      acked; // bytes verified by the target, last reported
+    };
+
+    /** @brief Ack received by the BLE host task, handled by poll. */
+    struct Ack {
+        uint8_t data[20];
+        bool    command;
+    };
+
+    /** @brief A connection to a target, writes the packets and queues the acks. */
+    class NimBLEOtaGatewayLink : public NimBLEOtaClientLink, public NimBLEClientCallbacks {
+      public:
+        enum LinkState : uint8_t {
+            Free,
+            Connecting, // async connect started
+            Connected,  // not discovered yet
+            Open,       // update running
+            Closed,     // disconnected or failed to connect, the target is not released yet
+        };
+
+        explicit NimBLEOtaGatewayLink(NimBLEOtaSectorCache* pCache) : m_core(pCache, this) {}
+        ~NimBLEOtaGatewayLink() override;
+        bool     connect(const NimBLEAddress& address);
+        bool     open();
+        void     close();
+        bool     sendCommand(const uint8_t* data, size_t length) override;
+        bool     sendFirmware(const uint8_t* data, size_t length) override;
+        uint16_t mtu() const override;
+        void     onConnect(NimBLEClient* pClient) override;
+        void     onConnectFail(NimBLEClient* pClient, int reason) override;
+        void     onDisconnect(NimBLEClient* pClient, int reason) override;
+        void     queueAck(const uint8_t* data, size_t length, bool command);
+
+        NimBLEOtaClientCore            m_core;
+        NimBLEOtaSpscQueue<Ack, 8>     m_acks;
+        NimBLEClient*                  m_pClient{nullptr};
+        NimBLERemoteCharacteristic*    m_pCommandChr{nullptr};
+        NimBLERemoteCharacteristic*    m_pRecvFwChr{nullptr};
+        std::atomic<uint8_t>           m_state{Free};
+        size_t                         m_target{0};
+    };
+
+    void runLink(NimBLEOtaGatewayLink* pLink, uint32_t nowMs);
+    void finishTarget(NimBLEOtaGatewayLink* pLink, bool success);
+
+    NimBLEOtaSectorCache       m_cache;
+    std::vector<Target>        m_targets;
+    NimBLEOtaGatewayLink*      m_pLinks[NIMBLE_OTA_GATEWAY_MAX_CONNECTIONS]{};
+    uint8_t                    m_linkCount{0};
+    uint8_t                    m_window{4};
+    uint32_t                   m_blockSize{4096};
+    NimBLEOtaGatewayCallbacks* m_pCallbacks{nullptr};
+};
+
+/**
+ * @brief Callbacks of the gateway, called from the task calling NimBLEOtaGateway::poll.
+ */
+class NimBLEOtaGatewayCallbacks {
+  public:
+    virtual ~NimBLEOtaGatewayCallbacks() = default;
+    virtual void onProgress(NimBLEOtaGateway* pGateway, const NimBLEAddress& address, uint32_t acked, uint32_t total);
+    virtual void onDone(NimBLEOtaGateway* pGateway, const NimBLEAddress& address, bool success);
+};
+
+#endif // NIMBLE_OTA_GATEWAY
+#endif // NIMBLE_OTA_GATEWAY_H_
@@ -0,0 +1,131 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#include "NimBLEOtaInflate.h"
+
+#if NIMBLE_OTA_HAS_INFLATE
+
+# include "NimBLEOtaLog.h"
+# include <esp_err.h>
+# include <cstdlib>
+
+static_assert((NIMBLE_OTA_INFLATE_DICT_SIZE & (NIMBLE_OTA_INFLATE_DICT_SIZE - 1)) == 0,
+              "NIMBLE_OTA_INFLATE_DICT_SIZE must be a power of 2");
+
+static const char* LOG_TAG = "NimBLEOtaInflate";
+
+int NimBLEOtaInflate::begin(NimBLEOtaFlash* pOut) {
+    abort();
+    m_pInflator = m_pStaticInflator ? m_pStaticInflator
+                                    : static_cast<tinfl_decompressor*>(malloc(sizeof(tinfl_decompressor)));
+    m_pDict     = m_pStaticDict ? m_pStaticDict : static_cast<uint8_t*>(malloc(NIMBLE_OTA_INFLATE_DICT_SIZE));
+    if (m_pInflator == nullptr || m_pDict == nullptr) {
+        NIMBLE_LOGE(LOG_TAG, "%s -  malloc fail", __func__);
+        abort();
+        return ESP_ERR_NO_MEM;
+    }
+
+    tinfl_init(m_pInflator);
+    m_pOut       = pOut;
+    m_dictOffset = 0;
+    m_written    = 0;
+    m_done       = false;
+    return ESP_OK;
+}
+
+int NimBLEOtaInflate::write(const uint8_t* data, size_t length) {
+    return inflate(data, length, true);
+}
+
+int NimBLEOtaInflate::end() {
+    int err = m_done ? ESP_OK : inflate(nullptr, 0, false);
+    if (err == ESP_OK && !m_done) {
+        NIMBLE_LOGE(LOG_TAG, "compressed image is incomplete");
+        err = ESP_FAIL;
+    }
+
+    abort(); // only frees the buffers, the written length is kept
+    return err;
+}
+
+void NimBLEOtaInflate::abort() {
+    if (m_pInflator != m_pStaticInflator) {
+        free(m_pInflator);
+    }
+
+    if (m_pDict != m_pStaticDict) {
+        free(m_pDict);
+    }
+
+    m_pInflator = nullptr;
+    m_pDict     = nullptr;
+    m_pOut      = nullptr;
+}
+
+/**
+ * @brief Sets the memory for the inflater state and the dictionary instead of allocating it for each update.
+ * @param [in] pDict NIMBLE_OTA_INFLATE_DICT_SIZE bytes, null to allocate it.
+ */
+void NimBLEOtaInflate::setBuffers(tinfl_decompressor* pInflator, uint8_t* pDict) {
+    abort();
+    m_pStaticInflator = pInflator;
+    m_pStaticDict     = pDict;
+}
+
+/**
+ * @brief Inflates the data into the dictionary and writes the output to flash each time the dictionary wraps
+ * or the input is used up.
+ * @param [in] more False when there is no more input, to check the end of the stream.
+ */
+int NimBLEOtaInflate::inflate(const uint8_t* data, size_t length, bool more) {
+    if (m_pInflator == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (m_done) {
+        NIMBLE_LOGE(LOG_TAG, "data after the end of the compressed image");
+        return ESP_FAIL;
+    }
+
+    const mz_uint32 flags =
+        TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32 | (more ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+    for (;;) {
+        size_t       inLen  = length;
+        size_t       outLen = NIMBLE_OTA_INFLATE_DICT_SIZE - m_dictOffset;
+        tinfl_status status = tinfl_decompress(m_pInflator, data, &inLen, m_pDict, m_pDict + m_dictOffset, &outLen, flags);
+        data += inLen;
+        length -= inLen;
+
+        if (outLen) {
+            int err = m_pOut->write(m_pDict + m_dictOffset, outLen);
+            if (err != ESP_OK) {
+                return err;
+            }
+
+            m_written    += outLen;
+            m_dictOffset  = (m_dictOffset + outLen) & (NIMBLE_OTA_INFLATE_DICT_SIZE - 1);
+        }
+
+        if (status < TINFL_STATUS_DONE) {
+            NIMBLE_LOGE(LOG_TAG, "inflate failed, status: %d", static_cast<int>(status));
+            return ESP_FAIL;
+        }
+
+        if (status == TINFL_STATUS_DONE) {
+            m_done = true;
+            if (length) {
+                NIMBLE_LOGE(LOG_TAG, "data after the end of the compressed image");
+                return ESP_FAIL;
+            }
+            return ESP_OK;
+        }
+
+        if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+            return ESP_OK;
+        }
+        // TINFL_STATUS_HAS_MORE_OUTPUT, the dictionary has wrapped
+    }
+}
+
+#endif // NIMBLE_OTA_HAS_INFLATE
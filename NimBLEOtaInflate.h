@@ -0,0 +1,66 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#ifndef NIMBLE_OTA_INFLATE_H_
+#define NIMBLE_OTA_INFLATE_H_
+
+#include "NimBLEOtaCore.h"
+
+// Define NIMBLE_OTA_HAS_INFLATE as 0 to build without compressed update support
+#if defined(ESP_PLATFORM) && !defined(NIMBLE_OTA_HAS_INFLATE)
+# if __has_include(<rom/miniz.h>)
+#  include <rom/miniz.h>
+#  define NIMBLE_OTA_HAS_INFLATE 1
+# elif __has_include(<esp32/rom/miniz.h>)
+#  include <esp32/rom/miniz.h>
+#  define NIMBLE_OTA_HAS_INFLATE 1
+# elif __has_include(<miniz.h>)
+#  include <miniz.h>
+#  define NIMBLE_OTA_HAS_INFLATE 1
+# endif
+#endif
+
+#ifndef NIMBLE_OTA_HAS_INFLATE
+# define NIMBLE_OTA_HAS_INFLATE 0
+#endif
+
+/**
+ * Size of the inflate dictionary, a power of 2 no smaller than the window the image was compressed with.
+ * The default supports any zlib stream, 4096 is enough for images compressed with a 12 bit window.
+ */
+#ifndef NIMBLE_OTA_INFLATE_DICT_SIZE
+# define NIMBLE_OTA_INFLATE_DICT_SIZE 32768
+#endif
+
+#if NIMBLE_OTA_HAS_INFLATE
+
+/**
+ * @brief Decompresses zlib compressed images with the tinfl inflater in the ESP32 ROM.
+ * @details The inflater state and dictionary are allocated for the duration of a compressed update only,
+ * unless the application provides them with setBuffers.
+ */
+class NimBLEOtaInflate : public NimBLEOtaDecompressor {
+  public:
+    int      begin(NimBLEOtaFlash* pOut) override;
+    int      write(const uint8_t* data, size_t length) override;
+    int      end() override;
+    void     abort() override;
+    uint32_t written() const override { return m_written; }
+    void     setBuffers(tinfl_decompressor* pInflator, uint8_t* pDict);
+
+  private:
+    int inflate(const uint8_t* data, size_t length, bool more);
+
+    NimBLEOtaFlash*     m_pOut{nullptr};
+    tinfl_decompressor* m_pInflator{nullptr};
+    uint8_t*            m_pDict{nullptr};
+    tinfl_decompressor* m_pStaticInflator{nullptr};
+    uint8_t*            m_pStaticDict{nullptr}; // NIMBLE_OTA_INFLATE_DICT_SIZE bytes
+    size_t              m_dictOffset{};
+    uint32_t            m_written{};
+    bool                m_done{false};
+};
+
+#endif // NIMBLE_OTA_HAS_INFLATE
+#endif // NIMBLE_OTA_INFLATE_H_
@@ -0,0 +1,29 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#ifndef NIMBLE_OTA_LOG_H_
+#define NIMBLE_OTA_LOG_H_
+
+#if defined(ESP_PLATFORM)
+# include "NimBLELog.h"
+#else
+/*
+ * Host builds (benchmarks, emulator) have no NimBLE logger, the calls are compiled out
+ * but the format strings are still checked by the compiler.
+ */
+# include <cinttypes>
+# include <cstdio>
+
+__attribute__((format(printf, 2, 3))) static inline void nimbleOtaHostLog(const char* tag, const char* format, ...) {
+    (void)tag;
+    (void)format;
+}
+
+# define NIMBLE_LOGE(tag, format, ...) nimbleOtaHostLog(tag, format, ##__VA_ARGS__)
+# define NIMBLE_LOGW(tag, format, ...) nimbleOtaHostLog(tag, format, ##__VA_ARGS__)
+# define NIMBLE_LOGI(tag, format, ...) nimbleOtaHostLog(tag, format, ##__VA_ARGS__)
+# define NIMBLE_LOGD(tag, format, ...) nimbleOtaHostLog(tag, format, ##__VA_ARGS__)
+#endif
+
+#endif // NIMBLE_OTA_LOG_H_
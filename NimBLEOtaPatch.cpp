@@ -0,0 +1,189 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#include "NimBLEOtaPatch.h"
+#include "NimBLEOtaLog.h"
+
+#include <algorithm>
+#include <cstring>
+
+static constexpr uint8_t patchMagic[4] = {'N', 'B', 'D', 'F'};
+static constexpr int     otaOk         = 0;
+static constexpr int     otaFail       = -1; // ESP_FAIL
+static const char*       LOG_TAG       = "NimBLEOtaPatch";
+
+static uint32_t getLe32(const uint8_t* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+int NimBLEOtaDeltaPatcher::begin(uint32_t patchSize) {
+    m_state    = Header;
+    m_hdrLen   = 0;
+    m_newSize  = 0;
+    m_newPos   = 0;
+    m_oldPos   = 0;
+    m_diffLen  = 0;
+    m_extraLen = 0;
+    m_seek     = 0;
+    return otaOk;
+}
+
+/**
+ * @brief Checks the hash the patch was made against matches the base image.
+ * @param [in] hash The start of the SHA-256 of the base image.
+ * @param [in] length The number of hash bytes to compare, up to 32.
+ */
+bool NimBLEOtaDeltaPatcher::checkBase(const uint8_t* hash, size_t length) {
+    uint8_t baseHash[32];
+    if (!m_pBase->getHash(baseHash)) {
+        NIMBLE_LOGE(LOG_TAG, "Failed to get the base image hash");
+        return false;
+    }
+
+    return memcmp(baseHash, hash, std::min<size_t>(length, sizeof(baseHash))) == 0;
+}
+
+int NimBLEOtaDeltaPatcher::write(const uint8_t* data, size_t length) {
+    while (length) {
+        size_t used = 0;
+        int    err  = otaOk;
+        switch (m_state) {
+            case Header:
+            case Control: {
+                size_t need = (m_state == Header ? 8 : 12) - m_hdrLen;
+                used        = std::min(need, length);
+                memcpy(m_hdr + m_hdrLen, data, used);
+                m_hdrLen += used;
+                if (used == need) {
+                    m_hdrLen = 0;
+                    err      = m_state == Header ? parseHeader() : parseControl();
+                }
+                break;
+            }
+
+            case Diff:
+                used = std::min<size_t>(std::min<size_t>(m_diffLen, length), sizeof(m_buf));
+                err  = applyDiff(data, used);
+                break;
+
+            case Extra:
+                used = std::min<size_t>(m_extraLen, length);
+                err  = m_pOut->write(data, used);
+                if (err == otaOk) {
+                    m_newPos   += used;
+                    m_extraLen -= used;
+                }
+                break;
+
+            case Done:
+                return fail("data after the end of the patch");
+
+            case Failed:
+                return otaFail;
+        }
+
+        if (err != otaOk) {
+            m_state = Failed;
+            return err;
+        }
+
+        // Move on once the diff and extra data of the record are complete, the seek is applied after the extra data.
+        if ((m_state == Diff && m_diffLen == 0) || (m_state == Extra && m_extraLen == 0)) {
+            if (m_state == Diff && m_extraLen) {
+                m_state = Extra;
+            } else {
+                m_oldPos += m_seek;
+                m_state   = m_newPos == m_newSize ? Done : Control;
+            }
+        }
+
+        data   += used;
+        length -= used;
+    }
+
+    return otaOk;
+}
+
+int NimBLEOtaDeltaPatcher::end() {
+    if (m_state != Done) {
+        return fail("patch is incomplete");
+    }
+
+    return otaOk;
+}
+
+void NimBLEOtaDeltaPatcher::abort() {
+    m_state = Failed;
+}
+
+int NimBLEOtaDeltaPatcher::fail(const char* reason) {
+    NIMBLE_LOGE(LOG_TAG, "Patch error: %s, new image offset: %u", reason, static_cast<unsigned>(m_newPos));
+    m_state = Failed;
+    return otaFail;
+}
+
+int NimBLEOtaDeltaPatcher::parseHeader() {
+    if (memcmp(m_hdr, patchMagic, sizeof(patchMagic)) != 0) {
+        return fail("invalid header");
+    }
+
+    m_newSize = getLe32(m_hdr + 4);
+    m_state   = m_newSize ? Control : Done;
+    NIMBLE_LOGI(LOG_TAG, "Patching to a %u byte image", static_cast<unsigned>(m_newSize));
+    return otaOk;
+}
+
+int NimBLEOtaDeltaPatcher::parseControl() {
+    m_diffLen      = getLe32(m_hdr);
+    m_extraLen     = getLe32(m_hdr + 4);
+    m_seek         = static_cast<int32_t>(getLe32(m_hdr + 8));
+    uint32_t bsize = m_pBase->size();
+
+    if (m_diffLen > m_newSize - m_newPos || m_extraLen > m_newSize - m_newPos - m_diffLen) {
+        return fail("record exceeds the new image length");
+    }
+
+    if (m_diffLen > bsize - m_oldPos) {
+        return fail("record exceeds the base image");
+    }
+
+    int64_t oldPos = static_cast<int64_t>(m_oldPos) + m_diffLen + m_seek;
+    if (oldPos < 0 || oldPos > bsize) {
+        return fail("seek outside the base image");
+    }
+
+    if (m_diffLen) {
+        m_state = Diff;
+    } else if (m_extraLen) {
+        m_state = Extra;
+    } else {
+        m_oldPos = static_cast<uint32_t>(oldPos);
+        m_state  = m_newPos == m_newSize ? Done : Control;
+    }
+
+    return otaOk;
+}
+
+/**
+ * @brief Adds the diff bytes to the base image and writes the result, length is at most the buffer size.
+ */
+int NimBLEOtaDeltaPatcher::applyDiff(const uint8_t* data, size_t length) {
+    int err = m_pBase->read(m_oldPos, m_buf, length);
+    if (err != otaOk) {
+        NIMBLE_LOGE(LOG_TAG, "base image read failed! err=0x%x", err);
+        return err;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        m_buf[i] += data[i];
+    }
+
+    err = m_pOut->write(m_buf, length);
+    if (err == otaOk) {
+        m_oldPos  += length;
+        m_newPos  += length;
+        m_diffLen -= length;
+    }
+    return err;
+}
@@ -0,0 +1,74 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#ifndef NIMBLE_OTA_PATCH_H_
+#define NIMBLE_OTA_PATCH_H_
+
+#include "NimBLEOtaCore.h"
+
+#ifndef NIMBLE_OTA_PATCH_BUF_SIZE
+# define NIMBLE_OTA_PATCH_BUF_SIZE 256
+#endif
+
+/**
+ * @brief Read access to the image a delta patch was made against, i.e. the running app partition on device.
+ */
+class NimBLEOtaBaseImage {
+  public:
+    virtual ~NimBLEOtaBaseImage()                                        = default;
+    virtual int      read(uint32_t offset, uint8_t* data, size_t length) = 0;
+    virtual uint32_t size() const                                        = 0;
+    virtual bool     getHash(uint8_t* hash)                              = 0; // SHA-256 of the image, 32 bytes
+};
+
+/**
+ * @brief Applies a delta patch to the base image while the patch is streamed in.
+ * @details The patch is bsdiff's control, diff and extra data interleaved so it can be applied in one pass:
+ * a header of "NBDF" and the new image length, followed by records of the diff length, extra length and base seek
+ * (u32, u32, i32 little endian), diff length bytes added to the base image and extra length bytes copied as is.
+ * Only NIMBLE_OTA_PATCH_BUF_SIZE bytes of RAM are used for the base image reads.
+ */
+class NimBLEOtaDeltaPatcher : public NimBLEOtaPatcher {
+  public:
+    NimBLEOtaDeltaPatcher(NimBLEOtaBaseImage* pBase, NimBLEOtaFlash* pOut) : m_pBase(pBase), m_pOut(pOut) {}
+
+    int      begin(uint32_t patchSize) override;
+    int      write(const uint8_t* data, size_t length) override;
+    int      end() override;
+    void     abort() override;
+    bool     checkBase(const uint8_t* hash, size_t length) override;
+    uint32_t written() const override { return m_newPos; }
+    uint32_t imageSize() const override { return m_newSize; }
+    void     setOutput(NimBLEOtaFlash* pOut) override { m_pOut = pOut; }
+
+  private:
+    enum State {
+        Header,
+        Control,
+        Diff,
+        Extra,
+        Done,
+        Failed,
+    };
+
+    int fail(const char* reason);
+    int parseHeader();
+    int parseControl();
+    int applyDiff(const uint8_t* data, size_t length);
+
+    NimBLEOtaBaseImage* m_pBase{nullptr};
+    NimBLEOtaFlash*     m_pOut{nullptr};
+    State               m_state{Header};
+    uint8_t             m_hdr[12]{};
+    uint8_t             m_hdrLen{};
+    uint8_t             m_buf[NIMBLE_OTA_PATCH_BUF_SIZE];
+    uint32_t            m_newSize{};
+    uint32_t            m_newPos{};
+    uint32_t            m_oldPos{};
+    uint32_t            m_diffLen{};
+    uint32_t            m_extraLen{};
+    int32_t             m_seek{};
+};
+
+#endif // NIMBLE_OTA_PATCH_H_
@@ -0,0 +1,151 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#ifndef NIMBLE_OTA_PIPELINE_H_
+#define NIMBLE_OTA_PIPELINE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifndef NIMBLE_OTA_MAX_BUFFERS
+# define NIMBLE_OTA_MAX_BUFFERS 8
+#endif
+
+class NimBLEOtaCore;
+
+/**
+ * @brief A received sector waiting to be verified and written to flash.
+ */
+struct NimBLEOtaSector {
+    uint8_t* pData;
+    uint16_t length;    // data length, without the crc
+    uint16_t crc;       // crc sent by the client
+    uint16_t calcCrc;   // crc of the received data, when NIMBLE_OTA_CRC_INCREMENTAL
+    uint16_t index;     // sector number in the image
+    uint16_t recvIndex; // sector number as sent by the client, 0xffff for the last sector
+    uint8_t  epoch;     // rewind count when received, stale sectors are dropped
+    bool     last;      // last sector of the image
+    bool     drop;      // discarded, only returned to the free queue
+};
+
+/**
+ * @brief Lock free single producer, single consumer queue of N items.
+ */
+template <typename T, size_t N>
+class NimBLEOtaSpscQueue {
+  public:
+    bool push(const T& item) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t next = (head + 1) % (N + 1);
+        if (next == m_tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        m_items[head] = item;
+        m_head.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        item = m_items[tail];
+        m_tail.store((tail + 1) % (N + 1), std::memory_order_release);
+        return true;
+    }
+
+    /** @brief Only safe when neither the producer or consumer are active. */
+    void clear() {
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    T                   m_items[N + 1]{};
+    std::atomic<size_t> m_head{0};
+    std::atomic<size_t> m_tail{0};
+};
+
+/**
+ * @brief Counters kept by one task and read by any other, i.e. the statistics of a pipeline stage.
+ * @details The writer updates its own copy and publishes it to one of two slots, alternately, a reader copies the slot
+ * last published and retries if another publish completed meanwhile. A reader never waits for a writer it preempted,
+ * it only retries when the writer made progress. The slots are relaxed atomic words so no access is a data race.
+ * T must be trivially copyable.
+ */
+template <typename T>
+class NimBLEOtaSnapshot {
+  public:
+    /** @brief The writer's copy, published with publish(). */
+    T& local() { return m_local; }
+
+    void publish() {
+        uint32_t seq  = m_seq.load(std::memory_order_relaxed);
+        uint32_t slot = (seq + 1) & 1; // not the slot readers copy until the sequence is incremented
+        uint32_t words[wordCount]{};
+        memcpy(words, &m_local, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < wordCount; i++) {
+            m_slots[slot][i].store(words[i], std::memory_order_relaxed);
+        }
+        m_seq.store(seq + 1, std::memory_order_release);
+    }
+
+    T read() const {
+        uint32_t words[wordCount];
+        uint32_t seq;
+        do {
+            seq = m_seq.load(std::memory_order_acquire);
+            for (size_t i = 0; i < wordCount; i++) {
+                words[i] = m_slots[seq & 1][i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while (seq != m_seq.load(std::memory_order_relaxed));
+
+        T data;
+        memcpy(&data, words, sizeof(T));
+        return data;
+    }
+
+    /** @brief Clears the counters, by the writer or while it is idle. */
+    void reset() {
+        m_local = T{};
+        publish();
+    }
+
+  private:
+    static constexpr size_t wordCount = (sizeof(T) + 3) / 4;
+
+    T                     m_local{};
+    std::atomic<uint32_t> m_seq{0};
+    std::atomic<uint32_t> m_slots[2][wordCount]{};
+};
+
+/**
+ * @brief Runs the verify and flash stages of the receive pipeline in worker tasks.
+ * @details The firmware packets are received and assembled into sectors on the BLE host task, the
+ * scheduler runs NimBLEOtaCore::runVerifyStage and NimBLEOtaCore::runFlashStage in their own tasks when woken
+ * and NimBLEOtaCore::runHostStage back in the context of the BLE host task.
+ * Without a scheduler all stages run inline in the BLE host task.
+ */
+class NimBLEOtaScheduler {
+  public:
+    enum Stage {
+        Verify,
+        Flash,
+        Host,
+    };
+
+    virtual ~NimBLEOtaScheduler()            = default;
+    virtual bool begin(NimBLEOtaCore* pCore) = 0;
+    virtual void wake(Stage stage)           = 0;
+    virtual void yield()                     = 0;
+};
+
+#endif // NIMBLE_OTA_PIPELINE_H_
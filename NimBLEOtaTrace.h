@@ -0,0 +1,79 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+#ifndef NIMBLE_OTA_TRACE_H_
+#define NIMBLE_OTA_TRACE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/** Records the events of the receive path in a ring buffer, read with NimBLEOtaCore::getTrace. */
+#ifndef NIMBLE_OTA_TRACE
+# define NIMBLE_OTA_TRACE 0
+#endif
+
+/** Number of events kept, a power of 2, 12 bytes each. */
+#ifndef NIMBLE_OTA_TRACE_SIZE
+# define NIMBLE_OTA_TRACE_SIZE 512
+#endif
+
+static_assert((NIMBLE_OTA_TRACE_SIZE & (NIMBLE_OTA_TRACE_SIZE - 1)) == 0, "NIMBLE_OTA_TRACE_SIZE must be a power of 2");
+
+/**
+ * @brief A trace event, the meaning of arg and value depends on the event, see NimBLEOtaTrace::Event.
+ * @details 12 bytes, little endian on all supported targets, decoded by scripts/nimbleota_trace.py.
+ */
+struct NimBLEOtaTraceRecord {
+    uint32_t timeUs; // low 32 bits of the time in us
+    uint8_t  event;
+    uint8_t  arg;
+    uint16_t sector;
+    uint32_t value;
+};
+
+/**
+ * @brief Lock free ring buffer of trace events, written by the BLE host task and the pipeline workers.
+ * @details The oldest events are overwritten, a record being written while the trace is read may be torn.
+ */
+class NimBLEOtaTrace {
+  public:
+    enum Event : uint8_t {
+        Packet = 1, // firmware packet, sector as sent, arg the sequence, value the data length
+        Sector,     // sector received and queued for the verify stage, arg 1 if last, value the length
+        Crc,        // sector verified, arg 1 if the crc matched, value the crc sent
+        FlashBegin, // sector write started
+        FlashEnd,   // sector written, arg 1 on error, value the error
+        Ack,        // firmware ack, sector as sent, arg the status, value the sector the client continues from
+        Command,    // sector the command id, arg 1 if accepted, value the length
+        Error,      // update failed, sector the next expected, arg the NimBLEOtaCore::Reason, value the error
+    };
+
+    void record(Event event, uint16_t sector, uint8_t arg, uint32_t value, uint32_t timeUs) {
+        uint32_t index                           = m_head.fetch_add(1, std::memory_order_relaxed);
+        m_records[index % NIMBLE_OTA_TRACE_SIZE] = NimBLEOtaTraceRecord{timeUs, event, arg, sector, value};
+    }
+
+    /**
+     * @brief Copies up to count events in order, starting offset events after the oldest one kept.
+     * @return The number of events copied.
+     */
+    size_t read(NimBLEOtaTraceRecord* pRecords, size_t count, size_t offset) const {
+        uint32_t head  = m_head.load(std::memory_order_acquire);
+        uint32_t first = head > NIMBLE_OTA_TRACE_SIZE ? head - NIMBLE_OTA_TRACE_SIZE : 0;
+        size_t   n     = 0;
+        for (uint32_t i = first + offset; i < head && n < count; i++) {
+            pRecords[n++] = m_records[i % NIMBLE_OTA_TRACE_SIZE];
+        }
+        return n;
+    }
+
+    void clear() { m_head.store(0, std::memory_order_relaxed); }
+
+  private:
+    NimBLEOtaTraceRecord  m_records[NIMBLE_OTA_TRACE_SIZE]{};
+    std::atomic<uint32_t> m_head{0};
+};
+
+#endif // NIMBLE_OTA_TRACE_H_
@@ -6,6 +6,17 @@
 NimBLEOta bleOta;
 NimBLEDis bleDis;
 
+// Served from flash when read, the firmware revision is the version of the running app.
+static const uint8_t        pnpId[] = {0x01, 0x02, 0x00, 0x03, 0x00, 0x04, 0x00};
+static const NimBLEDisEntry disTable[] = {
+    NimBLEDisEntry::text(NimBLEDis::ManufacturerName, "NimBLE-DIS"),
+    NimBLEDisEntry::text(NimBLEDis::ModelNumber, "NimBLE-DIS"),
+    NimBLEDisEntry::app(NimBLEDis::FirmwareRevision, NimBLEDisEntry::AppVersion),
+    NimBLEDisEntry::text(NimBLEDis::HardwareRevision, "1.0.0"),
+    NimBLEDisEntry::app(NimBLEDis::SoftwareRevision, NimBLEDisEntry::IdfVersion),
+    NimBLEDisEntry::bytes(NimBLEDis::PnpId, pnpId, sizeof(pnpId)),
+};
+
 class NimBleOtaServerCallbacks : public NimBLEServerCallbacks {
     void onConnect(NimBLEServer* pServer, NimBLEConnInfo& connInfo) override { Serial.println("Client connected"); }
 
@@ -72,17 +83,26 @@ void setup() {
     NimBLEServer* pServer = NimBLEDevice::createServer();
     pServer->setCallbacks(&bleOtaServerCallbacks);
 
+    // Heap taken by the service, build with NIMBLE_DIS_EXAMPLE_SETTERS=1 (env:esp32-dis-setters) to compare the setters.
+    uint32_t freeHeap = ESP.getFreeHeap();
+#if NIMBLE_DIS_EXAMPLE_SETTERS
     bleDis.init();
     bleDis.setManufacturerName("NimBLE-DIS");
     bleDis.setModelNumber("NimBLE-DIS");
     bleDis.setFirmwareRevision("1.0.0");
     bleDis.setHardwareRevision("1.0.0");
-    bleDis.setSoftwareRevision("1.0.0");
-    bleDis.setSystemId("1.0.0");
-    bleDis.setPnp(0x01, 0x02, 0x03, 0x04);
-
+    bleDis.setSoftwareRevision(esp_get_idf_version());
+    bleDis.setPnp(0x01, 0x0002, 0x0003, 0x0004);
     bleDis.start();
-    bleOta.start(&otaCallbacks);
+#else
+    bleDis.init(disTable);
+#endif
+    Serial.printf("Device Information Service: %u bytes of heap\n", static_cast<unsigned>(freeHeap - ESP.getFreeHeap()));
+
+    static const NimBLEOtaLinkParams linkParams; // request a faster link while an update runs
+    bleOta.enableAsyncCallbacks(); // Serial output in the callbacks does not delay the update
+    bleOta.setProgressInterval(1);
+    bleOta.start(&otaCallbacks, false, &linkParams);
 
     NimBLEAdvertising* pAdvertising = NimBLEDevice::getAdvertising();
     pAdvertising->addServiceUUID(bleOta.getServiceUUID());
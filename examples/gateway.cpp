@@ -0,0 +1,41 @@
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+#include <NimBLEOtaGateway.h>
+#include <esp_ota_ops.h>
+
+// The image to push, i.e. downloaded to the next app partition, and the devices to update.
+static const uint32_t imageSize = 1048576;
+static const char*    targets[] = {"aa:bb:cc:dd:ee:01", "aa:bb:cc:dd:ee:02", "aa:bb:cc:dd:ee:03"};
+
+NimBLEOtaPartitionImage image(esp_ota_get_next_update_partition(nullptr), imageSize);
+NimBLEOtaGateway        gateway(&image, imageSize);
+
+class GatewayCallbacks : public NimBLEOtaGatewayCallbacks {
+    void onProgress(NimBLEOtaGateway* pGateway, const NimBLEAddress& address, uint32_t acked, uint32_t total) override {
+        Serial.printf("%s: %u%%\n", address.toString().c_str(), static_cast<unsigned>(acked * 100ULL / total));
+    }
+
+    void onDone(NimBLEOtaGateway* pGateway, const NimBLEAddress& address, bool success) override {
+        Serial.printf("%s: %s\n", address.toString().c_str(), success ? "updated" : "failed");
+    }
+} gatewayCallbacks;
+
+void setup() {
+    Serial.begin(115200);
+    NimBLEDevice::init("NimBLE OTA gateway");
+    NimBLEDevice::setMTU(517);
+    for (auto target : targets) {
+        gateway.addTarget(NimBLEAddress(target, BLE_ADDR_PUBLIC));
+    }
+
+    gateway.begin(&gatewayCallbacks, 3, 4, 4096);
+}
+
+void loop() {
+    if (!gateway.poll()) {
+        Serial.printf("All done, %u sectors read\n", static_cast<unsigned>(gateway.getSectorReads()));
+        gateway.end();
+        vTaskDelay(portMAX_DELAY);
+    }
+    delay(1);
+}
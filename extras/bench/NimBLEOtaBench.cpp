@@ -0,0 +1,661 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+/*
+ * Host micro-benchmark of the NimBLEOta receive path.
+ * Drives NimBLEOtaCore with synthetic firmware images through in-memory
+ * flash/transport/timer stand-ins and reports the per-packet, per-sector and CRC cost
+ * along with the number of heap allocations made during an update.
+ * Built with NIMBLE_OTA_TRACE, `--trace FILE` writes the trace of one update for scripts/nimbleota_trace.py.
+ */
+
+#include "NimBLEOtaCore.h"
+#include "NimBLEOtaCrc.h"
+#include "NimBLEOtaPatch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t num, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void  __libc_free(void* ptr);
+
+static bool     g_countAllocs = false;
+static uint32_t g_allocCount  = 0;
+static size_t   g_allocBytes  = 0;
+static FILE*    g_traceFile   = nullptr;
+
+extern "C" void* malloc(size_t size) {
+    if (g_countAllocs) {
+        g_allocCount++;
+        g_allocBytes += size;
+    }
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t num, size_t size) {
+    if (g_countAllocs) {
+        g_allocCount++;
+        g_allocBytes += num * size;
+    }
+    return __libc_calloc(num, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+    if (g_countAllocs) {
+        g_allocCount++;
+        g_allocBytes += size;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr) {
+    __libc_free(ptr);
+}
+
+using BenchClock = std::chrono::steady_clock;
+
+static uint64_t elapsedNs(BenchClock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - start).count();
+}
+
+/** @brief Flash stand-in that stores the image in a buffer reserved up front. */
+class RamFlash : public NimBLEOtaFlash {
+  public:
+    explicit RamFlash(size_t capacity) : m_image(capacity) {}
+    int begin(uint32_t imageSize) override {
+        m_len = 0;
+        return imageSize <= m_image.size() ? 0 : -1;
+    }
+    int write(const uint8_t* data, size_t length) override {
+        if (m_len + length > m_image.size()) {
+            return -1;
+        }
+        memcpy(m_image.data() + m_len, data, length);
+        m_len += length;
+        return 0;
+    }
+    int  end() override { return 0; }
+    void abort() override {}
+
+    std::vector<uint8_t> m_image;
+    size_t               m_len{0};
+};
+
+/** @brief Transport stand-in that queues the acks for the client, acks may come from the pipeline workers. */
+class LoopbackTransport : public NimBLEOtaTransport {
+  public:
+    struct FwAck {
+        uint16_t status;
+        uint16_t sector;
+    };
+
+    void sendCommandAck(const uint8_t* data, size_t length) override { memcpy(m_cmdAck, data, length); }
+    void sendFirmwareAck(const uint8_t* data, size_t length, bool notify) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fwAcks[m_head++ % 64] = {static_cast<uint16_t>(data[2] | (data[3] << 8)),
+                                   static_cast<uint16_t>(data[4] | (data[5] << 8))};
+    }
+    bool popFwAck(FwAck& ack) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_tail == m_head) {
+            return false;
+        }
+        ack = m_fwAcks[m_tail++ % 64];
+        return true;
+    }
+
+    uint8_t    m_cmdAck[20]{};
+    std::mutex m_mutex;
+    FwAck      m_fwAcks[64]{};
+    uint32_t   m_head{0};
+    uint32_t   m_tail{0};
+};
+
+/** @brief Runs the verify and flash stages in std::threads, the host stage is polled by the client loop. */
+class ThreadScheduler : public NimBLEOtaScheduler {
+  public:
+    ~ThreadScheduler() override {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_run = false;
+        }
+        m_cv.notify_all();
+        for (auto& t : m_threads) {
+            t.join();
+        }
+    }
+    bool begin(NimBLEOtaCore* pCore) override {
+        m_pCore = pCore;
+        m_threads.emplace_back([this] { worker(Verify); });
+        m_threads.emplace_back([this] { worker(Flash); });
+        return true;
+    }
+    void wake(Stage stage) override {
+        if (stage == Host) {
+            m_hostPending = true;
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending[stage] = true;
+        }
+        m_cv.notify_all();
+    }
+    void yield() override { std::this_thread::yield(); }
+    void pollHost() {
+        if (m_hostPending.exchange(false)) {
+            m_pCore->runHostStage();
+        }
+    }
+
+  private:
+    void worker(Stage stage) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_cv.wait(lock, [&] { return m_pending[stage] || !m_run; });
+            if (!m_run) {
+                return;
+            }
+            m_pending[stage] = false;
+            lock.unlock();
+            stage == Verify ? m_pCore->runVerifyStage() : m_pCore->runFlashStage();
+            lock.lock();
+        }
+    }
+
+    NimBLEOtaCore*           m_pCore{nullptr};
+    std::vector<std::thread> m_threads;
+    std::mutex               m_mutex;
+    std::condition_variable  m_cv;
+    bool                     m_pending[2]{};
+    bool                     m_run{true};
+    std::atomic<bool>        m_hostPending{false};
+};
+
+/** @brief Decompressor stand-in using zlib, NimBLEOtaInflate uses the ROM inflater on device. */
+class ZlibInflate : public NimBLEOtaDecompressor {
+  public:
+    int begin(NimBLEOtaFlash* pOut) override {
+        m_pOut    = pOut;
+        m_written = 0;
+        m_done    = false;
+        m_stream  = z_stream{};
+        return inflateInit(&m_stream) == Z_OK ? 0 : -1;
+    }
+    int write(const uint8_t* data, size_t length) override {
+        m_stream.next_in  = const_cast<Bytef*>(data);
+        m_stream.avail_in = length;
+        while (m_stream.avail_in && !m_done) {
+            m_stream.next_out  = m_out;
+            m_stream.avail_out = sizeof(m_out);
+            int ret            = inflate(&m_stream, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                return -1;
+            }
+
+            size_t outLen = sizeof(m_out) - m_stream.avail_out;
+            if (outLen && m_pOut->write(m_out, outLen) != 0) {
+                return -1;
+            }
+            m_written += outLen;
+            m_done     = ret == Z_STREAM_END;
+        }
+        return m_stream.avail_in ? -1 : 0;
+    }
+    int end() override {
+        abort();
+        return m_done ? 0 : -1;
+    }
+    void     abort() override { inflateEnd(&m_stream); }
+    uint32_t written() const override { return m_written; }
+
+  private:
+    NimBLEOtaFlash* m_pOut{nullptr};
+    z_stream        m_stream{};
+    uint8_t         m_out[4096];
+    uint32_t        m_written{};
+    bool            m_done{false};
+};
+
+/** @brief Base image stand-in for delta updates, the hash is the first 32 bytes of the image. */
+class VectorBase : public NimBLEOtaBaseImage {
+  public:
+    explicit VectorBase(const std::vector<uint8_t>& image) : m_image(image) {}
+    int read(uint32_t offset, uint8_t* data, size_t length) override {
+        if (offset + length > m_image.size()) {
+            return -1;
+        }
+        memcpy(data, m_image.data() + offset, length);
+        return 0;
+    }
+    uint32_t size() const override { return m_image.size(); }
+    bool     getHash(uint8_t* hash) override {
+        memcpy(hash, m_image.data(), 32);
+        return true;
+    }
+
+    const std::vector<uint8_t>& m_image;
+};
+
+class ManualTimer : public NimBLEOtaTimer {
+  public:
+    bool start(uint32_t ms) override { return true; }
+    void stop() override {}
+};
+
+class BenchOta : public NimBLEOtaCore {
+  public:
+    BenchOta(NimBLEOtaFlash* pFlash, NimBLEOtaTransport* pTransport, NimBLEOtaTimer* pTimer)
+        : NimBLEOtaCore(pFlash, pTransport, pTimer) {}
+    bool m_complete{false};
+
+  protected:
+    void onOtaComplete() override { m_complete = true; }
+};
+
+struct BenchMode {
+    const char* name;
+    uint8_t     window;
+    uint8_t     buffers;   // 0 runs the stages inline
+    uint32_t    blockSize; // requested sector size, 4096 << n
+};
+
+struct BenchResult {
+    uint32_t packets;
+    uint32_t sectors;
+    uint64_t packetNs;
+    uint64_t sectorNs;
+    uint64_t totalNs;
+    uint32_t allocCount;
+    size_t   allocBytes;
+    bool     ok;
+};
+
+using SectorPackets = std::vector<std::vector<uint8_t>>;
+
+/** @brief Splits the image into firmware packets per sector the same way scripts/nimbleota.py does. */
+static std::vector<SectorPackets> buildPackets(const std::vector<uint8_t>& image, uint16_t mtu, uint32_t blockSize) {
+    std::vector<SectorPackets> packets;
+    size_t                     maxBytes = std::min<size_t>(512, mtu - 3) - 3;
+    size_t                     sectors  = (image.size() + blockSize - 1) / blockSize;
+
+    for (size_t s = 0; s < sectors; s++) {
+        packets.emplace_back();
+        size_t               len = std::min<size_t>(blockSize, image.size() - s * blockSize);
+        std::vector<uint8_t> sector(image.begin() + s * blockSize, image.begin() + s * blockSize + len);
+        uint16_t             crc = NimBLEOtaCore::getCrc16(sector.data(), sector.size());
+        sector.push_back(crc & 0xff);
+        sector.push_back(crc >> 8);
+
+        uint16_t secIdx = sector.size() == blockSize + 2 ? s : 0xffff;
+        uint8_t  seq    = 0;
+        for (size_t off = 0; off < sector.size(); off += maxBytes) {
+            size_t               chunk = std::min(maxBytes, sector.size() - off);
+            std::vector<uint8_t> pkt{static_cast<uint8_t>(secIdx & 0xff),
+                                     static_cast<uint8_t>(secIdx >> 8),
+                                     static_cast<uint8_t>(off + chunk == sector.size() ? 0xff : seq)};
+            pkt.insert(pkt.end(), sector.begin() + off, sector.begin() + off + chunk);
+            packets.back().push_back(std::move(pkt));
+            seq = seq == 0xfe ? 1 : seq + 1;
+        }
+    }
+
+    return packets;
+}
+
+/** @brief What the client sends, the image itself or a compressed image or delta patch. */
+struct BenchPayload {
+    const char*          name;
+    std::vector<uint8_t> data;
+    uint32_t             imageLen; // length after decompression
+    uint8_t              flags;    // start command flags, 0x02 compressed, 0x04 delta
+};
+
+static void buildStartCmd(uint8_t* cmd, const BenchPayload& payload, const BenchMode& mode, const uint8_t* baseHash) {
+    uint32_t fileLen   = payload.data.size();
+    uint8_t  blockBits = 0;
+    while ((4096u << blockBits) < mode.blockSize) {
+        blockBits++;
+    }
+
+    memset(cmd, 0, 20);
+    cmd[0]       = 0x01;
+    cmd[6]       = (mode.window > 1 ? 0x01 : 0x00) | payload.flags | (blockBits << 3);
+    cmd[7]       = mode.window;
+    cmd[2]       = fileLen & 0xff;
+    cmd[3]       = (fileLen >> 8) & 0xff;
+    cmd[4]       = (fileLen >> 16) & 0xff;
+    cmd[5]       = (fileLen >> 24) & 0xff;
+    cmd[8]       = payload.imageLen & 0xff;
+    cmd[9]       = (payload.imageLen >> 8) & 0xff;
+    cmd[10]      = (payload.imageLen >> 16) & 0xff;
+    cmd[11]      = (payload.imageLen >> 24) & 0xff;
+    memcpy(cmd + 12, baseHash, 6);
+    uint16_t crc = NimBLEOtaCore::getCrc16(cmd, 18);
+    cmd[18]      = crc & 0xff;
+    cmd[19]      = crc >> 8;
+}
+
+/**
+ * @brief Runs one update with a client that keeps up to `window` sectors in flight,
+ * rewinding on error acks like scripts/nimbleota.py.
+ * @param [in] image The image expected in flash once the update is complete.
+ * @param [in] deltaBase The image a delta patch was made against.
+ */
+static BenchResult runUpdate(const std::vector<uint8_t>&       image,
+                             const BenchPayload&               payload,
+                             const std::vector<SectorPackets>& packets,
+                             const BenchMode&                  mode,
+                             const std::vector<uint8_t>&       deltaBase = {}) {
+    RamFlash              flash(image.size());
+    LoopbackTransport     transport;
+    ManualTimer           timer;
+    BenchOta              ota(&flash, &transport, &timer);
+    ThreadScheduler       scheduler;
+    ZlibInflate           inflater;
+    VectorBase            baseImage(deltaBase);
+    NimBLEOtaDeltaPatcher patcher(&baseImage, &flash);
+    BenchResult           res{};
+    uint8_t               cmd[20];
+
+    if (mode.buffers) {
+        ota.setPipeline(&scheduler, mode.buffers);
+    }
+
+    ota.setDecompressor(&inflater);
+    ota.setPatcher(&patcher);
+    buildStartCmd(cmd, payload, mode, deltaBase.size() >= 32 ? deltaBase.data() : image.data());
+    g_allocCount  = 0;
+    g_allocBytes  = 0;
+    g_countAllocs = true;
+
+    auto total = BenchClock::now();
+    ota.handleCommand(cmd, sizeof(cmd));
+    uint8_t  window = std::max<uint8_t>(1, transport.m_cmdAck[7]);
+    uint32_t base   = 0;
+    uint32_t next   = 0;
+    while (!ota.m_complete) {
+        while (next < packets.size() && next - base < window) {
+            for (const auto& pkt : packets[next]) {
+                auto start = BenchClock::now();
+                ota.handleFirmware(pkt.data(), pkt.size());
+                if (pkt[2] == 0xff) {
+                    res.sectorNs += elapsedNs(start);
+                    res.sectors++;
+                } else {
+                    res.packetNs += elapsedNs(start);
+                    res.packets++;
+                }
+            }
+            next++;
+            scheduler.pollHost();
+        }
+
+        LoopbackTransport::FwAck ack;
+        auto                     wait = BenchClock::now();
+        while (!transport.popFwAck(ack)) {
+            scheduler.pollHost();
+            if (ota.m_complete || !mode.buffers || elapsedNs(wait) > 1000000000ULL) {
+                ack.status = 0xffff; // timeout
+                break;
+            }
+            std::this_thread::yield();
+        }
+
+        if (ota.m_complete) {
+            break;
+        }
+
+        if (ack.status == 0) {
+            base = std::max<uint32_t>(base, ack.sector + 1);
+        } else if (ack.status == 0xffff) {
+            next = base;
+        } else {
+            if (ack.status == 0x0004) { // no free sector buffer, give the flash worker time to catch up
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+            base = next = ack.sector;
+        }
+    }
+    res.totalNs = elapsedNs(total);
+
+    g_countAllocs  = false;
+    res.allocCount = g_allocCount;
+    res.allocBytes = g_allocBytes;
+    res.ok         = ota.m_complete && flash.m_len == image.size() &&
+             memcmp(flash.m_image.data(), image.data(), image.size()) == 0;
+
+    if (g_traceFile) {
+        NimBLEOtaTraceRecord records[64];
+        size_t               count;
+        for (size_t offset = 0; (count = ota.getTrace(records, 64, offset)) > 0; offset += count) {
+            fwrite(records, sizeof(records[0]), count, g_traceFile);
+        }
+    }
+    return res;
+}
+
+/** @brief A compressible image, words from a small vocabulary with some random bytes like machine code. */
+static std::vector<uint8_t> buildFirmwareImage(size_t size, std::mt19937& rng) {
+    std::vector<uint32_t> words(1024);
+    for (auto& w : words) {
+        w = rng();
+    }
+
+    std::vector<uint8_t> image(size);
+    for (size_t i = 0; i < size; i += 4) {
+        uint32_t w = rng() % 8 == 0 ? rng() : words[rng() % words.size()];
+        memcpy(image.data() + i, &w, std::min<size_t>(4, size - i));
+    }
+    return image;
+}
+
+static std::vector<uint8_t> deflate(const std::vector<uint8_t>& data) {
+    uLongf               len = compressBound(data.size());
+    std::vector<uint8_t> out(len);
+    compress2(out.data(), &len, data.data(), data.size(), Z_BEST_COMPRESSION);
+    out.resize(len);
+    return out;
+}
+
+/** @brief A delta patch with a single record diffing the images at the same offset, see NimBLEOtaPatch.h. */
+static std::vector<uint8_t> buildDeltaPatch(const std::vector<uint8_t>& base, const std::vector<uint8_t>& image) {
+    uint32_t             common = std::min(base.size(), image.size());
+    uint32_t             extra  = image.size() - common;
+    uint32_t             hdr[4] = {static_cast<uint32_t>(image.size()), common, extra, 0};
+    std::vector<uint8_t> patch{'N', 'B', 'D', 'F'};
+    patch.insert(patch.end(), reinterpret_cast<uint8_t*>(hdr), reinterpret_cast<uint8_t*>(hdr) + sizeof(hdr));
+    for (uint32_t i = 0; i < common; i++) {
+        patch.push_back(image[i] - base[i]);
+    }
+    patch.insert(patch.end(), image.begin() + common, image.end());
+    return patch;
+}
+
+using CrcFn = uint16_t (*)(uint16_t crc, const uint8_t* buf, size_t len);
+
+struct CrcImpl {
+    const char* name;
+    CrcFn       fn;
+};
+
+static double crcNsPerSector(CrcFn fn, const std::vector<uint8_t>& image, int iterations) {
+    volatile uint16_t sink  = 0;
+    auto              start = BenchClock::now();
+    for (int i = 0; i < iterations; i++) {
+        sink = sink + fn(0, image.data() + (i % 16) * 4096, 4096);
+    }
+    return static_cast<double>(elapsedNs(start)) / iterations;
+}
+
+/** @brief Checks the implementation against the reference, whole and fed in packet sized pieces. */
+static bool crcMatches(CrcFn fn, const std::vector<uint8_t>& buf) {
+    static const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    if (fn(0, check, sizeof(check)) != 0x31c3) {
+        return false;
+    }
+
+    for (size_t len : {size_t{0}, size_t{1}, size_t{7}, size_t{9}, size_t{4096}}) {
+        uint16_t ref = NimBLEOtaCrc::updateBitwise(0, buf.data(), len);
+        uint16_t crc = 0;
+        for (size_t pos = 0; pos < len; pos += 509) {
+            crc = fn(crc, buf.data() + pos, std::min<size_t>(509, len - pos));
+        }
+
+        if (fn(0, buf.data(), len) != ref || crc != ref) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int repeat = argc > 1 ? atoi(argv[1]) : 5;
+    if (repeat < 1) {
+        repeat = 1;
+    }
+
+    const uint32_t sizes[] = {64 * 1024, 1024 * 1024, 2 * 1024 * 1024 - 123};
+    const uint16_t  mtus[]  = {23, 247, 517};
+    const BenchMode modes[] = {{"inline", 1, 0, 4096},
+                               {"window8", 8, 0, 4096},
+                               {"pipe4", 4, 4, 4096},
+                               {"block16k", 2, 0, 16384},
+                               {"block32k", 2, 4, 32768}};
+    std::mt19937    rng(0x8018);
+    bool            allOk = true;
+
+    if (argc > 2 && strcmp(argv[1], "--trace") == 0) {
+        // One pipelined update of a 1MB image at a 247 byte MTU.
+        std::vector<uint8_t> image(1024 * 1024);
+        for (auto& b : image) {
+            b = rng() & 0xff;
+        }
+
+        g_traceFile = fopen(argv[2], "wb");
+        if (g_traceFile == nullptr) {
+            perror(argv[2]);
+            return 1;
+        }
+
+        BenchResult res = runUpdate(image, {"raw", image, static_cast<uint32_t>(image.size()), 0},
+                                    buildPackets(image, 247, modes[2].blockSize), modes[2]);
+        fclose(g_traceFile);
+        printf("trace of a %s update written to %s\n", modes[2].name, argv[2]);
+        return res.ok ? 0 : 1;
+    }
+
+    printf("NimBLEOta host benchmark (best of %d runs)\n\n", repeat);
+    printf("%10s %5s %8s %8s %8s %12s %12s %10s %8s %10s\n",
+           "image", "mtu", "mode", "packets", "sectors", "ns/packet", "us/sector", "MB/s", "allocs", "alloc B");
+
+    for (uint32_t size : sizes) {
+        std::vector<uint8_t> image(size);
+        for (auto& b : image) {
+            b = rng() & 0xff;
+        }
+
+        BenchPayload payload{"raw", image, size, 0};
+        for (uint16_t mtu : mtus) {
+            for (const auto& mode : modes) {
+                auto        packets = buildPackets(image, mtu, mode.blockSize);
+                BenchResult best{};
+                for (int r = 0; r < repeat; r++) {
+                    BenchResult res = runUpdate(image, payload, packets, mode);
+                    allOk &= res.ok;
+                    if (r == 0 || res.totalNs < best.totalNs) {
+                        best = res;
+                    }
+                }
+
+                printf("%10u %5u %8s %8u %8u %12.1f %12.2f %10.1f %8u %10zu%s\n",
+                       size,
+                       mtu,
+                       mode.name,
+                       best.packets + best.sectors,
+                       best.sectors,
+                       best.packets ? static_cast<double>(best.packetNs) / best.packets : 0.0,
+                       static_cast<double>(best.sectorNs) / best.sectors / 1000.0,
+                       size / (best.totalNs / 1e9) / (1024.0 * 1024.0),
+                       best.allocCount,
+                       best.allocBytes,
+                       best.ok ? "" : "  FAILED");
+            }
+        }
+    }
+
+    // A new release of a firmware image with a few changes, sent whole, compressed and as a compressed delta patch.
+    std::vector<uint8_t> baseImage = buildFirmwareImage(1536 * 1024, rng);
+    std::vector<uint8_t> fwImage   = baseImage;
+    for (size_t i = 0; i < fwImage.size(); i += 64 * 1024) {
+        for (size_t j = 0; j < 16; j++) {
+            fwImage[i + j] ^= rng() & 0xff;
+        }
+    }
+
+    std::vector<uint8_t> patch      = buildDeltaPatch(baseImage, fwImage);
+    const BenchPayload   payloads[] = {{"raw", fwImage, static_cast<uint32_t>(fwImage.size()), 0},
+                                       {"deflate", deflate(fwImage), static_cast<uint32_t>(fwImage.size()), 0x02},
+                                       {"delta", deflate(patch), static_cast<uint32_t>(patch.size()), 0x06}};
+    printf("\n%10s %5s %8s %8s %8s %12s %12s %10s\n",
+           "image", "mtu", "mode", "sent", "packets", "ns/packet", "us/sector", "MB/s");
+    for (uint16_t mtu : {uint16_t{247}, uint16_t{517}}) {
+        for (const auto& payload : payloads) {
+            auto        packets = buildPackets(payload.data, mtu, modes[1].blockSize);
+            BenchResult best{};
+            for (int r = 0; r < repeat; r++) {
+                BenchResult res = runUpdate(fwImage, payload, packets, modes[1], baseImage);
+                allOk &= res.ok;
+                if (r == 0 || res.totalNs < best.totalNs) {
+                    best = res;
+                }
+            }
+
+            printf("%10zu %5u %8s %8zu %8u %12.1f %12.2f %10.1f%s\n",
+                   fwImage.size(),
+                   mtu,
+                   payload.name,
+                   payload.data.size(),
+                   best.packets + best.sectors,
+                   best.packets ? static_cast<double>(best.packetNs) / best.packets : 0.0,
+                   static_cast<double>(best.sectorNs) / best.sectors / 1000.0,
+                   fwImage.size() / (best.totalNs / 1e9) / (1024.0 * 1024.0),
+                   best.ok ? "" : "  FAILED");
+        }
+    }
+
+    std::vector<uint8_t> crcBuf(16 * 4096);
+    for (auto& b : crcBuf) {
+        b = rng() & 0xff;
+    }
+
+    const CrcImpl crcImpls[] = {{"bitwise", NimBLEOtaCrc::updateBitwise},
+                                {"table", NimBLEOtaCrc::updateTable},
+                                {"slicing8", NimBLEOtaCrc::updateSlicing},
+                                {"default", NimBLEOtaCrc::update}};
+    printf("\n%10s %12s %10s\n", "crc16", "us/sector", "MB/s");
+    for (const auto& impl : crcImpls) {
+        bool   ok    = crcMatches(impl.fn, crcBuf);
+        double crcNs = crcNsPerSector(impl.fn, crcBuf, 2000);
+        allOk &= ok;
+        printf("%10s %12.2f %10.1f%s\n",
+               impl.name,
+               crcNs / 1000.0,
+               4096 / (crcNs / 1e9) / (1024.0 * 1024.0),
+               ok ? "" : "  MISMATCH");
+    }
+    return allOk ? 0 : 1;
+}
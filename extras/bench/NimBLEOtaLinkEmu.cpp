@@ -0,0 +1,882 @@
+// Copyright 2025 Ryan Powell and NimBLEOta contributors
+// Sponsored by Theengs https://www.theengs.io
+// MIT License
+
+/*
+ * Deterministic BLE link emulator for NimBLEOta.
+ * Runs NimBLEOtaCore against a client following the upload loop of scripts/nimbleota.py over a
+ * link simulated in virtual time: ATT MTU, link layer data length, connection interval, packets per
+ * connection event, bursty packet loss and the time the client takes to act on an ack, with the
+ * device flash writes taking time on the flash worker. Reports goodput, retransmitted bytes and time
+ * to complete for a matrix of image sizes, link profiles and client strategies. Nothing depends on
+ * the wall clock, the same seed gives the same numbers on any machine.
+ * With --client the client is NimBLEOtaClientCore, the device side client of NimBLEOtaGateway, and a set
+ * of checks covers its loss, busy, missing packet, resume, reconnect and timeout paths.
+ */
+
+#include "NimBLEOtaClient.h"
+#include "NimBLEOtaCore.h"
+#include "NimBLEOtaCrc.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+struct LinkProfile {
+    const char* name;
+    uint16_t    mtu;          // ATT MTU
+    uint16_t    dataLen;      // link layer payload, 27 or 251
+    uint32_t    intervalUs;   // connection interval
+    uint8_t     pdusPerEvent; // link layer packets the central sends per connection event
+    double      lossRate;     // share of firmware packets dropped by the host stacks
+    double      burstLen;     // average length of a loss burst, in packets
+    uint32_t    ackLatencyUs; // from the connection event carrying an ack to the client acting on it
+};
+
+struct ClientStrategy {
+    const char* name;
+    uint8_t     window;
+    bool        selective;
+    uint32_t    blockSize;
+    bool        core; // NimBLEOtaClientCore instead of the loop of scripts/nimbleota.py
+};
+
+struct EmuResult {
+    uint64_t timeUs;      // start command to the last ack
+    uint64_t airBytes;    // firmware packet bytes the client sent, lost ones included
+    uint64_t resentBytes; // airBytes beyond the sectors and their crc sent once
+    uint32_t lost;        // firmware packets dropped on the link
+    uint32_t retries;     // error acks and ack timeouts seen by the client
+    uint32_t busy;        // busy acks
+    uint32_t missing;     // acks asking for the missing packets of a sector
+    uint32_t resumed;     // resume offset in the start command ack
+    uint16_t resumeConn;  // connection handle of the client when the device resumed after a reconnect
+    bool     ok;
+    bool     failed;      // NimBLEOtaClientCore gave up
+};
+
+static const uint32_t FLASH_US_PER_4K  = 12000;   // 4KB flash write with the erase ahead amortised
+static const uint8_t  DEVICE_BUFFERS   = 4;       // sector buffers of the device pipeline
+static const size_t   CLIENT_TX_QUEUE  = 16;      // writes without response the client stack buffers
+static const uint64_t ACK_TIMEOUT_US   = 5000000; // ACK_TIMEOUT of scripts/nimbleota.py per 4KB
+static const uint64_t BUSY_BACKOFF_US  = 100000;  // BUSY_BACKOFF of scripts/nimbleota.py
+static const uint64_t EMU_LIMIT_US     = 3600ULL * 1000000;
+static const uint16_t L2CAP_ATT_HEADER = 7;       // L2CAP header and ATT write command header
+
+class LinkEmu;
+
+/** @brief Flash stand-in that charges the write time to the flash worker. */
+class EmuFlash : public NimBLEOtaFlash {
+  public:
+    explicit EmuFlash(uint64_t& costUs) : m_costUs(costUs) {}
+    /** @brief Holds the first offset bytes of an interrupted update, for resume. */
+    void preload(const std::vector<uint8_t>& image, uint32_t offset) {
+        m_image.assign(image.size(), 0);
+        memcpy(m_image.data(), image.data(), offset);
+        m_len = offset;
+    }
+    int begin(uint32_t imageSize) override {
+        m_image.assign(imageSize, 0);
+        m_len = 0;
+        return 0;
+    }
+    int write(const uint8_t* data, size_t length) override {
+        if (m_len + length > m_image.size()) {
+            return -1;
+        }
+        memcpy(m_image.data() + m_len, data, length);
+        m_len    += length;
+        m_costUs += m_usPer4K * length / 4096;
+        return 0;
+    }
+    int  end() override { return 0; }
+    void abort() override {}
+    int  resume(uint32_t offset, uint16_t crc) override {
+        if (offset > m_len || NimBLEOtaCrc::compute(m_image.data(), offset) != crc) {
+            return -1;
+        }
+        m_len = offset;
+        return 0;
+    }
+
+    std::vector<uint8_t> m_image;
+    size_t               m_len{0};
+    uint32_t             m_usPer4K{FLASH_US_PER_4K};
+
+  private:
+    uint64_t& m_costUs;
+};
+
+/** @brief Transport stand-in that hands the acks to the emulated link. */
+class EmuTransport : public NimBLEOtaTransport {
+  public:
+    explicit EmuTransport(LinkEmu* pEmu) : m_pEmu(pEmu) {}
+    void sendCommandAck(const uint8_t* data, size_t length) override;
+    void sendFirmwareAck(const uint8_t* data, size_t length, bool notify) override;
+
+  private:
+    LinkEmu* m_pEmu;
+};
+
+/** @brief Runs the pipeline stages as events in virtual time, the flash worker is busy while it writes. */
+class EmuScheduler : public NimBLEOtaScheduler {
+  public:
+    explicit EmuScheduler(LinkEmu* pEmu) : m_pEmu(pEmu) {}
+    bool begin(NimBLEOtaCore* pCore) override {
+        m_pCore = pCore;
+        return true;
+    }
+    void wake(Stage stage) override;
+    void yield() override {}
+
+  private:
+    LinkEmu*       m_pEmu;
+    NimBLEOtaCore* m_pCore{nullptr};
+    bool           m_flashPending{false};
+};
+
+/** @brief Identity address of the emulated client, 0 is none. */
+struct EmuAddress {
+    uint8_t id;
+    bool    isNull() const { return id == 0; }
+    bool    operator==(const EmuAddress& other) const { return id == other.id; }
+};
+
+class EmuOta : public NimBLEOtaCore {
+  public:
+    EmuOta(NimBLEOtaFlash* pFlash, NimBLEOtaTransport* pTransport, NimBLEOtaTimer* pTimer)
+        : NimBLEOtaCore(pFlash, pTransport, pTimer) {}
+    NimBLEOtaClientSession<EmuAddress> m_session; // as bound by the command writes of NimBLEOta
+    bool                               m_complete{false};
+    uint16_t                           m_resumeConn{0};
+
+  protected:
+    void onOtaComplete() override { m_complete = true; }
+    void onOtaStart(uint32_t firmwareSize, Reason reason) override {
+        if (reason == Reconnected) {
+            m_resumeConn = m_session.connHandle(); // where NimBLEOta requests the link parameters
+        }
+    }
+};
+
+class EmuTimer : public NimBLEOtaTimer {
+  public:
+    bool start(uint32_t ms) override { return true; }
+    void stop() override {}
+};
+
+/** @brief Checkpoint storage, in RAM, of an update interrupted before the emulation. */
+class EmuCheckpoint : public NimBLEOtaCheckpoint {
+  public:
+    bool load(NimBLEOtaCheckpointData* pData) override {
+        *pData = m_data;
+        return m_valid;
+    }
+    bool save(const NimBLEOtaCheckpointData& data) override {
+        m_data  = data;
+        m_valid = true;
+        return true;
+    }
+    void clear() override { m_valid = false; }
+
+  private:
+    NimBLEOtaCheckpointData m_data{};
+    bool                    m_valid{false};
+};
+
+/** @brief The image sent by NimBLEOtaClientCore, its id is the first bytes as sent by the script path. */
+class EmuImage : public NimBLEOtaBaseImage {
+  public:
+    explicit EmuImage(const std::vector<uint8_t>& image) : m_image(image) {}
+    int read(uint32_t offset, uint8_t* data, size_t length) override {
+        if (offset + length > m_readErrorAt) {
+            return -1;
+        }
+
+        memcpy(data, m_image.data() + offset, length);
+        return 0;
+    }
+    uint32_t size() const override { return m_image.size(); }
+    bool     getHash(uint8_t* hash) override {
+        memcpy(hash, m_image.data(), 32);
+        return true;
+    }
+
+    uint32_t m_readErrorAt{UINT32_MAX}; // reads past it fail
+
+  private:
+    const std::vector<uint8_t>& m_image;
+};
+
+/** @brief Client link of NimBLEOtaClientCore, its writes go to the emulated client stack. */
+class EmuClientLink : public NimBLEOtaClientLink {
+  public:
+    explicit EmuClientLink(LinkEmu* pEmu) : m_pEmu(pEmu) {}
+    bool     sendCommand(const uint8_t* data, size_t length) override;
+    bool     sendFirmware(const uint8_t* data, size_t length) override;
+    uint16_t mtu() const override;
+
+  private:
+    LinkEmu* m_pEmu;
+};
+
+/**
+ * @brief Event loop of one update: the link, the device and the client.
+ * @details Events run in time order, events at the same time in the order they were added.
+ * The flash stage drains every sector queued when it runs, their buffers are released when the
+ * stage starts rather than after each write, the acks it sends are timed after the writes.
+ */
+class LinkEmu {
+  public:
+    LinkEmu(const LinkProfile& link, const ClientStrategy& client, const std::vector<uint8_t>& image, uint32_t seed)
+        : m_link(link),
+          m_client(client),
+          m_image(image),
+          m_rng(seed),
+          m_flash(m_flashCostUs),
+          m_transport(this),
+          m_scheduler(this),
+          m_ota(&m_flash, &m_transport, &m_timer),
+          m_emuImage(image),
+          m_cache(&m_emuImage, image.size()),
+          m_clientLink(this),
+          m_core(&m_cache, &m_clientLink) {
+        m_ota.setPipeline(&m_scheduler, DEVICE_BUFFERS);
+    }
+
+    EmuResult run();
+    void      setFlashCost(uint32_t usPer4K) { m_flash.m_usPer4K = usPer4K; }
+    void      setResume(uint32_t offset);
+    void      setCutoff(uint64_t timeUs) { m_cutoffUs = timeUs; }
+    void      setOutage(uint64_t startUs, uint64_t endUs);
+    void      setReadError(uint32_t offset) { m_emuImage.m_readErrorAt = offset; }
+    bool      clientWrite(const uint8_t* data, size_t length, bool command);
+    uint16_t  mtu() const { return m_link.mtu; }
+    void     at(uint64_t timeUs, std::function<void()> fn) { m_events.emplace(std::make_pair(timeUs, m_seq++), std::move(fn)); }
+    void     deviceAck(const uint8_t* data, bool command);
+    uint64_t now() const { return m_now; }
+    uint64_t flashCost() const { return m_flashCostUs; }
+    void     resetFlashCost() { m_flashCostUs = 0; }
+
+    uint64_t m_flashBusyUntil{0};
+
+  private:
+    using EventQueue = std::map<std::pair<uint64_t, uint64_t>, std::function<void()>>; // time, order added
+
+    struct Packet {
+        std::vector<uint8_t> data;
+        bool                 command;
+    };
+
+    struct Ack {
+        uint64_t timeUs; // when the device sent it
+        uint8_t  data[20];
+        bool     command;
+    };
+
+    void     connectionEvent();
+    bool     dropped();
+    void     sendSector(uint32_t pos, const std::set<size_t>* pPackets);
+    void     clientStep();
+    void     clientAck(const Ack& ack);
+    void     clientTimeout(uint32_t token);
+    void     corePoll() { m_core.poll(m_now / 1000); }
+    void     reconnect();
+    uint32_t sectorCount() const { return (m_image.size() + m_blockSize - 1) / m_blockSize; }
+
+    const LinkProfile&          m_link;
+    const ClientStrategy&       m_client;
+    const std::vector<uint8_t>& m_image;
+    std::mt19937                m_rng;
+    EventQueue                  m_events;
+    uint64_t                    m_seq{0};
+    uint64_t                    m_now{0};
+    uint64_t                    m_flashCostUs{0};
+    EmuFlash                    m_flash;
+    EmuTransport                m_transport;
+    EmuScheduler                m_scheduler;
+    EmuTimer                    m_timer;
+    EmuOta                      m_ota;
+
+    // link
+    std::deque<Packet> m_txQueue;         // client writes waiting for a connection event
+    std::deque<Ack>    m_deviceTx;        // device acks waiting for a connection event
+    uint32_t           m_pduProgress{0};  // link layer packets of the head of m_txQueue already sent
+    bool               m_badState{false}; // loss burst in progress
+    bool               m_notify{false};   // notifications, otherwise one indication per connection event
+
+    // client, the state of upload_firmware() in scripts/nimbleota.py
+    std::deque<Packet> m_pending; // packets waiting for room in m_txQueue
+    std::deque<Ack>    m_acks;    // acks received, not handled yet
+    uint32_t           m_blockSize{4096};
+    uint32_t           m_window{1};
+    uint32_t           m_base{0};
+    uint32_t           m_next{0};
+    uint32_t           m_token{0}; // invalidates the armed ack timeout
+    bool               m_timerArmed{false};
+    bool               m_started{false};
+    bool               m_backoff{false};
+    bool               m_done{false};
+    EmuResult          m_res{};
+
+    // client, NimBLEOtaClientCore
+    EmuImage             m_emuImage;
+    NimBLEOtaSectorCache m_cache;
+    EmuClientLink        m_clientLink;
+    NimBLEOtaClientCore  m_core;
+    EmuCheckpoint        m_checkpoint;
+    uint64_t             m_cutoffUs{0};    // the device goes out of range, nothing crosses the link after it
+    uint64_t             m_reconnectUs{0}; // until the client reconnects, 0 for never
+    uint16_t             m_connHandle{1};
+};
+
+bool EmuClientLink::sendCommand(const uint8_t* data, size_t length) {
+    return m_pEmu->clientWrite(data, length, true);
+}
+
+bool EmuClientLink::sendFirmware(const uint8_t* data, size_t length) {
+    return m_pEmu->clientWrite(data, length, false);
+}
+
+uint16_t EmuClientLink::mtu() const {
+    return m_pEmu->mtu();
+}
+
+void EmuTransport::sendCommandAck(const uint8_t* data, size_t length) {
+    m_pEmu->deviceAck(data, true);
+}
+
+void EmuTransport::sendFirmwareAck(const uint8_t* data, size_t length, bool notify) {
+    m_pEmu->deviceAck(data, false);
+}
+
+void EmuScheduler::wake(Stage stage) {
+    if (stage == Verify) {
+        m_pEmu->at(m_pEmu->now(), [this] { m_pCore->runVerifyStage(); });
+    } else if (stage == Host) {
+        m_pEmu->at(m_pEmu->now(), [this] { m_pCore->runHostStage(); });
+    } else if (!m_flashPending) {
+        m_flashPending = true;
+        m_pEmu->at(std::max(m_pEmu->now(), m_pEmu->m_flashBusyUntil), [this] {
+            m_flashPending = false;
+            m_pEmu->resetFlashCost();
+            m_pCore->runFlashStage();
+            m_pEmu->m_flashBusyUntil = m_pEmu->now() + m_pEmu->flashCost();
+            m_pEmu->resetFlashCost();
+        });
+    }
+}
+
+/** @brief Queues an ack for the next connection event, sent once the writes before it are done. */
+void LinkEmu::deviceAck(const uint8_t* data, bool command) {
+    Ack ack{m_now + m_flashCostUs, {}, command};
+    memcpy(ack.data, data, sizeof(ack.data));
+    m_deviceTx.push_back(ack);
+}
+
+/** @brief Hands a write to the client stack, firmware writes fail while its buffers are full. */
+bool LinkEmu::clientWrite(const uint8_t* data, size_t length, bool command) {
+    if (!command && m_txQueue.size() >= CLIENT_TX_QUEUE) {
+        return false;
+    }
+    m_txQueue.push_back({std::vector<uint8_t>(data, data + length), command});
+    return true;
+}
+
+/** @brief Starts the device with the checkpoint and flash of an update interrupted at offset. */
+void LinkEmu::setResume(uint32_t offset) {
+    NimBLEOtaCheckpointData checkpoint{};
+    memcpy(checkpoint.imageId, m_image.data(), sizeof(checkpoint.imageId));
+    checkpoint.fileLen = m_image.size();
+    checkpoint.offset  = offset;
+    checkpoint.crc     = NimBLEOtaCrc::compute(m_image.data(), offset);
+    m_checkpoint.save(checkpoint);
+    m_flash.preload(m_image, offset);
+    m_ota.setCheckpoint(&m_checkpoint);
+}
+
+/** @brief The link is down from startUs, the client reconnects at endUs on a new connection handle. */
+void LinkEmu::setOutage(uint64_t startUs, uint64_t endUs) {
+    m_cutoffUs    = startUs;
+    m_reconnectUs = endUs;
+    at(endUs, [this] { reconnect(); });
+}
+
+/** @brief Reconnects the client and sends the start command again, the device resumes the update in progress. */
+void LinkEmu::reconnect() {
+    m_connHandle++;
+    m_deviceTx.clear();
+    m_txQueue.clear();
+    m_pduProgress = 0;
+    m_started     = false;
+    m_core.start(m_client.window, m_client.blockSize, m_now / 1000);
+}
+
+/** @brief Gilbert-Elliott loss, bursts of burstLen packets on average at the configured loss rate. */
+bool LinkEmu::dropped() {
+    if (m_link.lossRate <= 0) {
+        return false;
+    }
+
+    std::uniform_real_distribution<double> dist(0, 1);
+    double                                 toGood = 1.0 / m_link.burstLen;
+    double                                 toBad  = m_link.lossRate * toGood / (1.0 - m_link.lossRate);
+    m_badState                                    = dist(m_rng) < (m_badState ? 1.0 - toGood : toBad);
+    return m_badState;
+}
+
+void LinkEmu::connectionEvent() {
+    if (m_cutoffUs && m_now >= m_cutoffUs && (!m_reconnectUs || m_now < m_reconnectUs)) {
+        m_deviceTx.clear();
+        m_txQueue.clear();
+        m_pduProgress = 0;
+    }
+
+    // Device to client, the acks sent before this event, indications need a confirmation each.
+    while (!m_deviceTx.empty() && m_deviceTx.front().timeUs <= m_now) {
+        Ack ack = m_deviceTx.front();
+        m_deviceTx.pop_front();
+        at(m_now + m_link.ackLatencyUs, [this, ack] { clientAck(ack); });
+        if (!m_notify && !ack.command) {
+            break;
+        }
+    }
+
+    // Client to device, as many link layer packets as fit in the event.
+    uint32_t budget = m_link.pdusPerEvent;
+    while (budget && !m_txQueue.empty()) {
+        Packet&  pkt  = m_txQueue.front();
+        uint32_t pdus = (pkt.data.size() + L2CAP_ATT_HEADER + m_link.dataLen - 1) / m_link.dataLen;
+        if (pdus - m_pduProgress > budget) {
+            m_pduProgress += budget;
+            break;
+        }
+
+        budget        -= pdus - m_pduProgress;
+        m_pduProgress  = 0;
+        if (pkt.command) {
+            // Writes with response are acknowledged by the link layer and never dropped.
+            if (m_ota.m_session.bind(EmuAddress{1}, m_connHandle)) {
+                m_ota.handleCommand(pkt.data.data(), pkt.data.size());
+            }
+        } else {
+            m_res.airBytes += pkt.data.size() - 3;
+            if (dropped()) {
+                m_res.lost++;
+            } else {
+                m_ota.handleFirmware(pkt.data.data(), pkt.data.size());
+            }
+        }
+        m_txQueue.pop_front();
+    }
+
+    // The client stack takes the writes waiting for room.
+    if (!m_pending.empty()) {
+        while (!m_pending.empty() && m_txQueue.size() < CLIENT_TX_QUEUE) {
+            m_txQueue.push_back(std::move(m_pending.front()));
+            m_pending.pop_front();
+        }
+        if (m_pending.empty()) {
+            at(m_now, [this] { clientStep(); });
+        }
+    }
+
+    // NimBLEOtaClientCore is polled once per connection event, from the task of the gateway.
+    if (m_client.core) {
+        corePoll();
+    }
+
+    if (!m_done) {
+        at(m_now + m_link.intervalUs, [this] { connectionEvent(); });
+    }
+}
+
+/** @brief Queues the packets of a sector the same way upload_sector() in scripts/nimbleota.py does. */
+void LinkEmu::sendSector(uint32_t pos, const std::set<size_t>* pPackets) {
+    size_t               maxBytes = std::min<size_t>(512, m_link.mtu - 3) - 3;
+    size_t               len      = std::min<size_t>(m_blockSize, m_image.size() - pos * m_blockSize);
+    std::vector<uint8_t> sector(m_image.begin() + pos * m_blockSize, m_image.begin() + pos * m_blockSize + len);
+    uint16_t             crc = NimBLEOtaCore::getCrc16(sector.data(), sector.size());
+    sector.push_back(crc & 0xff);
+    sector.push_back(crc >> 8);
+
+    uint16_t secIdx = sector.size() == m_blockSize + 2 ? pos : 0xffff;
+    size_t   chunks = (sector.size() + maxBytes - 1) / maxBytes;
+    for (size_t i = 0; i < chunks; i++) {
+        if (pPackets && !pPackets->count(i) && i != chunks - 1) {
+            continue;
+        }
+
+        size_t               off   = i * maxBytes;
+        size_t               chunk = std::min(maxBytes, sector.size() - off);
+        uint8_t              seq   = i == chunks - 1 ? 0xff : (i ? (i - 1) % 254 + 1 : 0);
+        std::vector<uint8_t> pkt{static_cast<uint8_t>(secIdx & 0xff), static_cast<uint8_t>(secIdx >> 8), seq};
+        pkt.insert(pkt.end(), sector.begin() + off, sector.begin() + off + chunk);
+        m_pending.push_back({std::move(pkt), false});
+    }
+}
+
+/**
+ * @brief Fills the window and waits for an ack, called whenever the client may proceed.
+ * @details Like the script, the acks are only read once the writes of the window are queued.
+ */
+void LinkEmu::clientStep() {
+    if (!m_started || m_done || m_backoff || !m_pending.empty()) {
+        return;
+    }
+
+    while (m_acks.empty()) {
+        if (m_base >= sectorCount()) {
+            return;
+        }
+
+        if (m_next < sectorCount() && m_next - m_base < m_window) {
+            while (m_next < sectorCount() && m_next - m_base < m_window) {
+                sendSector(m_next++, nullptr);
+            }
+            return; // the connection events move the packets and call back
+        }
+
+        if (!m_timerArmed) {
+            m_timerArmed     = true;
+            uint32_t token   = ++m_token;
+            uint64_t timeout = ACK_TIMEOUT_US * m_blockSize / 4096;
+            at(m_now + timeout, [this, token] { clientTimeout(token); });
+        }
+        return;
+    }
+
+    Ack ack = m_acks.front();
+    m_acks.pop_front();
+    m_timerArmed = false;
+    m_token++;
+
+    uint16_t status  = ack.data[2] | (ack.data[3] << 8);
+    uint16_t rspSect = ack.data[4] | (ack.data[5] << 8);
+    uint32_t rspPos  = std::min<uint32_t>(rspSect, sectorCount());
+    if (status == 0) {
+        // acks are cumulative, rspSect is the last sector written
+        m_base = std::max(m_base, rspPos + 1);
+        at(m_now, [this] { clientStep(); });
+        return;
+    }
+
+    m_res.retries++;
+    if (status == 4) {
+        // busy, back off before resending
+        m_backoff = true;
+        at(m_now + BUSY_BACKOFF_US, [this, rspPos] {
+            m_backoff = false;
+            m_base    = m_next = rspPos;
+            clientStep();
+        });
+        return;
+    }
+
+    if (status == 5 && rspPos < sectorCount()) {
+        std::set<size_t> missing;
+        uint16_t         first = ack.data[6] | (ack.data[7] << 8);
+        missing.insert(first);
+        for (size_t i = 0; i < 80; i++) {
+            if (ack.data[8 + i / 8] & (1 << (i % 8))) {
+                missing.insert(first + 1 + i);
+            }
+        }
+        sendSector(rspPos, &missing);
+        // the sectors in flight after it were dropped by the device
+        m_base = rspPos;
+        m_next = rspPos + 1;
+        return;
+    }
+
+    // crc, length, index and sector errors resend from the sector the device expects
+    m_base = m_next = rspPos;
+    at(m_now, [this] { clientStep(); });
+}
+
+void LinkEmu::clientAck(const Ack& ack) {
+    if (!ack.command) {
+        uint16_t status  = ack.data[2] | (ack.data[3] << 8);
+        m_res.busy      += status == 4;
+        m_res.missing   += status == 5;
+    }
+
+    if (m_client.core) {
+        if (ack.command) {
+            m_core.handleCommandAck(ack.data, sizeof(ack.data), m_now / 1000);
+            m_started   = m_core.getState() == NimBLEOtaClientCore::Sending;
+            m_notify    = ack.data[6] & 0x01;
+            m_blockSize = 4096u << ((ack.data[6] >> 3) & 0x07);
+        } else {
+            m_core.handleFirmwareAck(ack.data, sizeof(ack.data), m_now / 1000);
+        }
+        corePoll();
+        return;
+    }
+
+    if (ack.command) {
+        if (m_started) {
+            return;
+        }
+
+        if (ack.data[4] != 0 || ack.data[5] != 0) {
+            m_done = true; // rejected
+            return;
+        }
+
+        m_started   = true;
+        m_notify    = ack.data[6] & 0x01;
+        m_window    = std::max<uint8_t>(1, ack.data[7]);
+        m_blockSize = 4096u << ((ack.data[6] >> 3) & 0x07);
+        clientStep();
+        return;
+    }
+
+    m_acks.push_back(ack);
+    clientStep();
+}
+
+void LinkEmu::clientTimeout(uint32_t token) {
+    if (token != m_token || m_done) {
+        return;
+    }
+
+    m_timerArmed = false;
+    m_res.retries++;
+    m_next = m_base;
+    clientStep();
+}
+
+EmuResult LinkEmu::run() {
+    uint8_t  cmd[20]{};
+    uint32_t len       = m_image.size();
+    uint8_t  blockBits = 0;
+    while ((4096u << blockBits) < m_client.blockSize) {
+        blockBits++;
+    }
+
+    cmd[0] = 0x01;
+    cmd[2] = len & 0xff;
+    cmd[3] = (len >> 8) & 0xff;
+    cmd[4] = (len >> 16) & 0xff;
+    cmd[5] = (len >> 24) & 0xff;
+    cmd[6] = (m_client.window > 1 ? 0x01 : 0x00) | (m_client.selective ? 0x40 : 0x00) | (blockBits << 3);
+    cmd[7] = m_client.window;
+    for (size_t i = 0; i < 6; i++) {
+        cmd[12 + i] = m_image[i];
+    }
+    uint16_t crc = NimBLEOtaCore::getCrc16(cmd, 18);
+    cmd[18]      = crc & 0xff;
+    cmd[19]      = crc >> 8;
+
+    if (!m_client.core) {
+        m_txQueue.push_back({std::vector<uint8_t>(cmd, cmd + sizeof(cmd)), true});
+    } else if (!m_cache.begin(m_client.blockSize, 2) || !m_core.start(m_client.window, m_client.blockSize, 0)) {
+        return m_res;
+    }
+
+    at(0, [this] { connectionEvent(); });
+    while (!m_done && !m_events.empty() && m_now < EMU_LIMIT_US) {
+        auto it = m_events.begin();
+        m_now   = it->first.first;
+        auto fn = std::move(it->second);
+        m_events.erase(it);
+        fn();
+
+        bool sent = m_client.core ? m_core.getState() == NimBLEOtaClientCore::Complete : m_started && m_base >= sectorCount();
+        if (sent && m_ota.m_complete) {
+            m_done       = true;
+            m_res.ok     = m_flash.m_image == m_image;
+            m_res.timeUs = m_now;
+        } else if (m_client.core && m_core.getState() == NimBLEOtaClientCore::Failed) {
+            m_done       = true;
+            m_res.failed = true;
+            m_res.timeUs = m_now;
+        }
+    }
+
+    if (m_client.core) {
+        m_res.retries = m_core.getRetries();
+        m_res.resumed = m_core.getResumeOffset();
+    }
+    m_res.resumeConn = m_ota.m_resumeConn;
+
+    if (m_res.ok) {
+        uint32_t sectors  = sectorCount() - m_res.resumed / m_blockSize;
+        uint64_t once     = m_image.size() - m_res.resumed + 2ULL * sectors;
+        m_res.resentBytes = m_res.airBytes - once;
+    }
+    return m_res;
+}
+
+static const LinkProfile PROFILES[] = {
+    {"ideal 2M", 517, 251, 7500, 6, 0, 1, 1000},
+    {"android", 247, 251, 15000, 4, 0, 1, 5000},
+    {"ios", 185, 251, 15000, 3, 0, 1, 5000},
+    {"legacy 4.0", 23, 27, 30000, 4, 0, 1, 10000},
+    {"android 1% burst", 247, 251, 15000, 4, 0.01, 4, 5000},
+    {"android 5%", 247, 251, 15000, 4, 0.05, 1, 5000},
+};
+
+static const ClientStrategy STRATEGIES[] = {
+    {"stop-and-wait", 1, true, 4096, false},
+    {"window 4", 4, true, 4096, false},
+    {"window 4 no-sel", 4, false, 4096, false},
+    {"window 8", 8, true, 4096, false},
+    {"window 2 16KB", 2, true, 16384, false},
+    {"client core w4", 4, true, 4096, true},
+};
+
+/** @brief A path of NimBLEOtaClientCore and the result showing it was taken and handled. */
+struct ClientCheck {
+    const char* name;
+    LinkProfile link;
+    uint8_t     window;
+    uint32_t    blockSize;
+    uint32_t    flashUsPer4K;
+    uint32_t    resumeAt;    // checkpoint of an interrupted update, 0 for none
+    uint64_t    cutoffUs;    // the device goes out of range, 0 for never
+    uint64_t    reconnectUs; // the client reconnects after the cutoff, 0 for never
+    uint32_t    readErrorAt; // the image cannot be read past it, 0 for never
+    bool        (*pass)(const EmuResult& res, size_t size);
+};
+
+// The lossy link loses 1% so that the final packet of a sector is not lost three times in a row,
+// the client would give the target up, NimBLEOtaGateway then reconnects and resumes.
+static const LinkProfile ANDROID_1 = {"android 1%", 247, 251, 15000, 4, 0.01, 1, 5000};
+
+static const ClientCheck CLIENT_CHECKS[] = {
+    {"loss", ANDROID_1, 4, 4096, FLASH_US_PER_4K, 0, 0, 0, 0,
+     [](const EmuResult& res, size_t size) { return res.ok && res.lost > 0 && res.retries > 0; }},
+    {"missing packets", ANDROID_1, 1, 4096, FLASH_US_PER_4K, 0, 0, 0, 0,
+     [](const EmuResult& res, size_t size) { return res.ok && res.missing > 0; }},
+    {"busy back-off", PROFILES[0], 8, 4096, 4 * FLASH_US_PER_4K, 0, 0, 0, 0,
+     [](const EmuResult& res, size_t size) { return res.ok && res.busy > 0; }},
+    {"resume", PROFILES[1], 4, 4096, FLASH_US_PER_4K, 128 * 1024, 0, 0, 0,
+     [](const EmuResult& res, size_t size) {
+         return res.ok && res.resumed == 128 * 1024 && res.airBytes < size - res.resumed + size / 16;
+     }},
+    {"reconnect", PROFILES[1], 4, 4096, FLASH_US_PER_4K, 0, 1000000, 3000000, 0,
+     [](const EmuResult& res, size_t size) { return res.ok && res.resumeConn == 2; }},
+    {"timeout", PROFILES[1], 4, 4096, FLASH_US_PER_4K, 0, 2000000, 0, 0,
+     [](const EmuResult& res, size_t size) {
+         return !res.ok && res.failed && res.timeUs >= 2000000 + 3 * ACK_TIMEOUT_US;
+     }},
+    // The cache slots are 5000 bytes, the client asks for 4096 rather than 8192 and never gets a larger sector.
+    {"block size", PROFILES[1], 4, 5000, FLASH_US_PER_4K, 0, 0, 0, 0,
+     [](const EmuResult& res, size_t size) { return res.ok; }},
+    // Fails when the sector cannot be read, rather than waiting for a slot until the ack timeout.
+    {"read error", PROFILES[1], 4, 4096, FLASH_US_PER_4K, 0, 0, 0, 64 * 1024,
+     [](const EmuResult& res, size_t size) { return !res.ok && res.failed && res.timeUs < ACK_TIMEOUT_US; }},
+};
+
+/** @brief Runs the NimBLEOtaClientCore checks, returns false if one failed. */
+static bool runClientChecks(uint32_t seed) {
+    std::vector<uint8_t> image(256 * 1024);
+    std::mt19937         rng(seed);
+    bool                 ok = true;
+    for (auto& b : image) {
+        b = rng() & 0xff;
+    }
+
+    printf("NimBLEOtaClientCore checks, seed %u, 256 KB image\n\n", seed);
+    printf("%-16s %-17s %8s %8s %6s %8s %8s %9s %5s %8s\n",
+           "check", "link", "time s", "lost", "busy", "missing", "retries", "resumed", "conn", "result");
+    for (const auto& check : CLIENT_CHECKS) {
+        ClientStrategy client{"client core", check.window, true, check.blockSize, true};
+        LinkEmu        emu(check.link, client, image, seed);
+        emu.setFlashCost(check.flashUsPer4K);
+        if (check.resumeAt) {
+            emu.setResume(check.resumeAt);
+        }
+        if (check.readErrorAt) {
+            emu.setReadError(check.readErrorAt);
+        }
+        if (check.reconnectUs) {
+            emu.setOutage(check.cutoffUs, check.reconnectUs);
+        } else {
+            emu.setCutoff(check.cutoffUs);
+        }
+
+        EmuResult res  = emu.run();
+        bool      pass = check.pass(res, image.size());
+        ok             = ok && pass;
+        printf("%-16s %-17s %8.2f %8u %6u %8u %8u %9u %5u %8s\n",
+               check.name,
+               check.link.name,
+               res.timeUs / 1e6,
+               res.lost,
+               res.busy,
+               res.missing,
+               res.retries,
+               res.resumed,
+               res.resumeConn,
+               pass ? "ok" : "FAILED");
+    }
+
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    uint32_t seed   = 1;
+    bool     client = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--client") == 0) {
+            client = true;
+        } else {
+            seed = strtoul(argv[i], nullptr, 0);
+        }
+    }
+
+    if (client) {
+        return runClientChecks(seed) ? 0 : 1;
+    }
+
+    size_t sizes[] = {256 * 1024, 1024 * 1024};
+    bool   ok      = true;
+
+    printf("NimBLEOta link emulator, seed %u, flash %u us per 4KB, %u device buffers\n\n",
+           seed,
+           FLASH_US_PER_4K,
+           DEVICE_BUFFERS);
+    printf("%-8s %-17s %-16s %10s %10s %10s %8s %8s\n",
+           "image", "link", "client", "time s", "KB/s", "resent KB", "lost", "retries");
+    for (size_t size : sizes) {
+        std::vector<uint8_t> image(size);
+        std::mt19937         rng(seed);
+        for (auto& b : image) {
+            b = rng() & 0xff;
+        }
+
+        for (const auto& link : PROFILES) {
+            for (const auto& client : STRATEGIES) {
+                LinkEmu   emu(link, client, image, seed);
+                EmuResult res = emu.run();
+                ok            = ok && res.ok;
+                if (!res.ok) {
+                    printf("%5zu KB %-17s %-16s %10s\n", size / 1024, link.name, client.name, "FAILED");
+                    continue;
+                }
+                printf("%5zu KB %-17s %-16s %10.2f %10.1f %10.1f %8u %8u\n",
+                       size / 1024,
+                       link.name,
+                       client.name,
+                       res.timeUs / 1e6,
+                       size / 1024.0 / (res.timeUs / 1e6),
+                       res.resentBytes / 1024.0,
+                       res.lost,
+                       res.retries);
+            }
+        }
+        printf("\n");
+    }
+
+    return ok ? 0 : 1;
+}
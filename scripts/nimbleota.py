@@ -4,42 +4,185 @@
 
 import asyncio
 import argparse
+import bz2
+import contextvars
+import hashlib
+import json
+import mmap
 import os
+import socket
+import struct
 import sys
+import time
+import zlib
 from bleak import BleakScanner, uuids, BleakClient
 
 OTA_SERVICE_UUID = uuids.normalize_uuid_16(0x8018)
 OTA_COMMAND_UUID = uuids.normalize_uuid_16(0x8022)
 OTA_FIRMWARE_UUID = uuids.normalize_uuid_16(0x8020)
+OTA_STATS_UUID = uuids.normalize_uuid_16(0x8021)
 START_COMMAND = 0x0001
 STOP_COMMAND = 0x0002
 ACK_COMMAND = 0x0003
+SYNC_COMMAND = 0x0004
+TARGET_COMMAND = 0x0005
+SIGNATURE_COMMAND = 0x0006
 ACK_ACCEPTED = 0x0000
 ACK_REJECTED = 0x0001
 FW_ACK_SUCCESS = 0x0000
 FW_ACK_CRC_ERROR = 0x0001
 FW_ACK_SECTOR_ERROR = 0x0002
 FW_ACK_LEN_ERROR = 0x0003
+FW_ACK_BUSY = 0x0004
+FW_ACK_MISSING = 0x0005
+BUSY_BACKOFF = 0.1
 RSP_CRC_ERROR = 0xFFFF
+START_FLAG_NOTIFY_ACK = 0x01
+START_FLAG_COMPRESSED = 0x02
+START_FLAG_DELTA = 0x04
+START_FLAG_BLOCK_SHIFT = 3  # bits 3-5, block size as 4096 << n
+START_FLAG_SELECTIVE = 0x40
+START_FLAG_SYNC = 0x80
+SYNC_HASH_LEN = 8
+SYNC_MAX_HASHES = 63
+MIN_BLOCK_SIZE = 4096
+DELTA_MAGIC = b'NBDF'
+SINK_TYPES = {'app': 0, 'partition': 1, 'file': 2, 'stream': 3}
+ACK_TIMEOUT = 5.0
+FLEET_REPORT_INTERVAL = 5.0
+RESULT_OK = 'ok'
+RESULT_FAILED = 'failed'  # connection or transfer error, worth retrying
+RESULT_REJECTED = 'rejected'  # the device does not accept this update
+PREFETCH_SECTORS = 2  # sectors prepared ahead of the one being sent
+SOL_BLUETOOTH = 274
+BT_SNDMTU = 12
+BDADDR_LE_PUBLIC = 1
+BDADDR_LE_RANDOM = 2
+L2CAP_CONNECT_TIMEOUT = 5
+
+# set per device in fleet mode, log lines are prefixed with the address and per sector output is dropped
+log_device = contextvars.ContextVar('log_device', default=None)
 
 def parse_args():
     parser = argparse.ArgumentParser(description="OTA Update Script")
     parser.add_argument("file_name", nargs='?', help="The file name for the OTA update")
-    parser.add_argument("mac_address", nargs='?', help="The MAC address of the device to connect to")
+    parser.add_argument("mac_address", nargs='*',
+                        help="The MAC address of the device to connect to, several addresses update them as a fleet")
+    parser.add_argument("--window", type=int, default=1,
+                        help="Number of sectors to send before waiting for an ack, 1 = stop-and-wait (default)")
+    parser.add_argument("--compress", action="store_true",
+                        help="Send the firmware zlib compressed, the device decompresses it while writing")
+    parser.add_argument("--delta", metavar="BASE_FILE",
+                        help="Send a compressed delta patch against BASE_FILE, the firmware the device is running")
+    parser.add_argument("--block-size", type=int, default=MIN_BLOCK_SIZE, choices=[4096, 8192, 16384, 32768],
+                        help="Sector size to request, the device may accept a smaller one (default 4096)")
+    parser.add_argument("--sync", action="store_true",
+                        help="Only send the sectors the device does not already have, uncompressed images only")
+    parser.add_argument("--target", metavar="TYPE[:NAME]",
+                        help="Write the image to a sink other than the app partition, e.g. partition:spiffs, "
+                             "file:/littlefs/model.bin or stream, the device must enable it")
+    parser.add_argument("--sign", metavar="KEY_FILE",
+                        help="Sign the image with the ECDSA or RSA private key in KEY_FILE (PEM), "
+                             "needs the cryptography package")
+    parser.add_argument("--signature", metavar="SIG_FILE",
+                        help="Send the signature in SIG_FILE, of the SHA-256 of the firmware file, e.g. from "
+                             "openssl dgst -sha256 -sign")
+    parser.add_argument("--no-l2cap", action="store_true",
+                        help="Send the firmware with GATT writes even if the device offers an L2CAP channel")
+    parser.add_argument("--fleet-file", metavar="FILE",
+                        help="Update every device in FILE, one MAC address per line")
+    parser.add_argument("--fleet-scan", action="store_true",
+                        help="Update every device found advertising the OTA service")
+    parser.add_argument("--name-filter", metavar="PREFIX",
+                        help="With --fleet-scan only update devices whose name starts with PREFIX")
+    parser.add_argument("--scan-time", type=float, default=5.0, help="Seconds to scan for devices (default 5)")
+    parser.add_argument("--adapter", action="append",
+                        help="Bluetooth adapter to use, e.g. hci1, repeat to spread a fleet over several adapters")
+    parser.add_argument("--concurrency", type=int, default=3,
+                        help="Devices updated at the same time on each adapter in fleet mode (default 3)")
+    parser.add_argument("--retries", type=int, default=2,
+                        help="Times a failed device is retried in fleet mode (default 2)")
+    parser.add_argument("--backoff", type=float, default=5.0,
+                        help="Seconds before the first retry of a device, doubled for each further retry (default 5)")
+    parser.add_argument("--results", metavar="FILE", help="Write the fleet results to FILE as JSON")
+    parser.add_argument("--bench", action="store_true",
+                        help="Print the connect time, time to first byte, goodput and retries of the update")
     return parser.parse_args()
 
+def log(*args, progress=False):
+    device = log_device.get()
+    if device is None:
+        print(*args)
+    elif not progress:
+        print(f"[{device}]", *args)
+
+def make_crc16_table():
+    table = []
+    for byte in range(256):
+        crc16 = byte << 8
+        for _ in range(8):
+            crc16 = ((crc16 << 1) ^ 0x1021 if crc16 & 0x8000 else crc16 << 1) & 0xFFFF
+        table.append(crc16)
+    return table
+
+CRC16_TABLE = make_crc16_table()
+
 def crc16_ccitt(buf):
     crc16 = 0
+    table = CRC16_TABLE
     for byte in buf:
-        crc16 ^= byte << 8
-        for _ in range(8):
-            if crc16 & 0x8000:
-                crc16 = (crc16 << 1) ^ 0x1021
-            else:
-                crc16 = crc16 << 1
-            crc16 &= 0xFFFF  # Ensure crc16 remains a 16-bit value
+        crc16 = ((crc16 << 8) & 0xFFFF) ^ table[(crc16 >> 8) ^ byte]
     return crc16
 
+def open_image(file_name):
+    # maps the file instead of reading it, the sectors are read from the page cache as they are sent
+    with open(file_name, 'rb') as file:
+        return mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ)
+
+def image_hash(image):
+    # The device compares against the SHA-256 of its running image, the digest appended by esptool when present.
+    if len(image) > 32 and hashlib.sha256(image[:-32]).digest() == image[-32:]:
+        return image[-32:]
+    return hashlib.sha256(image).digest()
+
+def bsdiff_offset(buf):
+    value = int.from_bytes(buf[0:8], byteorder='little')
+    return -(value & ~(1 << 63)) if value & (1 << 63) else value
+
+def make_delta_patch(base, firmware):
+    # Patch records of (diff length, extra length, base seek) followed by their diff and extra data, see NimBLEOtaPatch.h
+    patch = bytearray(DELTA_MAGIC + len(firmware).to_bytes(4, byteorder='little'))
+    try:
+        import bsdiff4
+    except ImportError:
+        print("bsdiff4 not installed, only changes at the same offset are patched (pip install bsdiff4)")
+        common = min(len(base), len(firmware))
+        patch += common.to_bytes(4, byteorder='little')
+        patch += (len(firmware) - common).to_bytes(4, byteorder='little')
+        patch += (0).to_bytes(4, byteorder='little')
+        patch += bytes((new - old) & 0xFF for new, old in zip(firmware[:common], base[:common]))
+        patch += firmware[common:]
+        return bytes(patch)
+
+    # Re-interleave the BSDIFF40 control, diff and extra blocks so the device can apply the patch in one pass.
+    bsdiff = bsdiff4.diff(base, firmware)
+    ctrl_len = bsdiff_offset(bsdiff[8:16])
+    diff_len = bsdiff_offset(bsdiff[16:24])
+    ctrl = bz2.decompress(bsdiff[32:32 + ctrl_len])
+    diff = bz2.decompress(bsdiff[32 + ctrl_len:32 + ctrl_len + diff_len])
+    extra = bz2.decompress(bsdiff[32 + ctrl_len + diff_len:])
+    diff_pos = extra_pos = 0
+    for i in range(0, len(ctrl), 24):
+        add = bsdiff_offset(ctrl[i:i + 8])
+        copy = bsdiff_offset(ctrl[i + 8:i + 16])
+        seek = bsdiff_offset(ctrl[i + 16:i + 24])
+        patch += add.to_bytes(4, byteorder='little') + copy.to_bytes(4, byteorder='little')
+        patch += seek.to_bytes(4, byteorder='little', signed=True)
+        patch += diff[diff_pos:diff_pos + add] + extra[extra_pos:extra_pos + copy]
+        diff_pos += add
+        extra_pos += copy
+    return bytes(patch)
+
 async def fw_notification_handler(sender, data, queue):
     if len(data) == 20:
         sector_sent = int.from_bytes(data[0:2], byteorder='little')
@@ -53,7 +196,13 @@ async def fw_notification_handler(sender, data, queue):
         if crc16_ccitt(data[0:18]) != crc:
             status = RSP_CRC_ERROR
 
-        await queue.put((status, cur_sector))
+        # a missing packets ack lists the first missing packet and a bitmap of the missing ones in the next 80
+        missing = []
+        if status == FW_ACK_MISSING:
+            first = int.from_bytes(data[6:8], byteorder='little')
+            missing = [first] + [first + 1 + i for i in range(80) if data[8 + i // 8] & (1 << (i % 8))]
+
+        await queue.put((status, cur_sector, missing))
 
 async def cmd_notification_handler(sender, data, queue):
     if len(data) == 20:
@@ -66,77 +215,491 @@ async def cmd_notification_handler(sender, data, queue):
             print("Command response CRC error")
             rsp = RSP_CRC_ERROR
 
-        await queue.put(rsp)
-
-async def upload_sector(client, sector, sec_idx):
-    max_bytes = min(512, client.mtu_size - 3) - 3 # 3 bytes for the packet header, 3 bytes for the BLE overhead
+        # bytes 6 and 7 are the accepted flags and window, 0 from devices without window support
+        # bytes 8 to 11 are the bytes already written when the device resumes an update after a reset
+        # bytes 6 to 17 of a sync command ack are a bitmap of the sectors the device needs
+        await queue.put((rsp, data[6], data[7], int.from_bytes(data[8:12], byteorder='little'), bytes(data[6:18])))
+
+def parse_stats(data):
+    # the update statistics notified on 0x8021, see NimBLEOtaCore::packStats
+    if len(data) < 42 or data[0] != 1:
+        return None
+    u16 = lambda i: int.from_bytes(data[i:i + 2], byteorder='little')
+    u32 = lambda i: int.from_bytes(data[i:i + 4], byteorder='little')
+    return {'in_progress': bool(data[1] & 1), 'bytes_written': u32(2), 'bytes_per_sec': u32(6),
+            'elapsed_ms': u32(10), 'packets': u32(14), 'sectors': u16(18), 'retransmits': u16(20),
+            'crc_errors': u16(22), 'index_errors': u16(24), 'length_errors': u16(26), 'missing_requests': u16(28),
+            'mtu': u16(30), 'sector_ms_avg': u16(32), 'sector_ms_max': u16(34), 'crc_us_avg': u16(36),
+            'flash_ms_avg': u16(38), 'flash_ms_max': u16(40)}
+
+class ImageSectors:
+    # the sectors of an image followed by their CRC, each is read and its CRC calculated when it is first sent
+    def __init__(self, image, block_size):
+        self.image = image
+        self.block_size = block_size
+        self.crcs = {}
+
+    def __len__(self):
+        return (len(self.image) + self.block_size - 1) // self.block_size
+
+    def __getitem__(self, sec_idx):
+        if not 0 <= sec_idx < len(self):
+            raise IndexError(sec_idx)
+        sector = bytes(self.image[sec_idx * self.block_size:(sec_idx + 1) * self.block_size])
+        if sec_idx not in self.crcs:
+            self.crcs[sec_idx] = crc16_ccitt(sector)
+        return sector + self.crcs[sec_idx].to_bytes(2, byteorder='little')
+
+sector_cache = {}  # shared by the devices of a fleet so each CRC is calculated once
+
+def make_sectors(firmware, block_size):
+    key = (id(firmware), block_size)
+    if key not in sector_cache or sector_cache[key].image is not firmware:
+        sector_cache[key] = ImageSectors(firmware, block_size)
+    return sector_cache[key]
+
+class GattLink:
+    # sends the firmware packets as GATT writes without response
+    name = 'gatt'
+
+    def __init__(self, client):
+        self.client = client
+        self.payload_size = min(512, client.mtu_size - 3) - 3 # 3 bytes for the packet header, 3 bytes for the BLE overhead
+
+    async def send(self, data):
+        await self.client.write_gatt_char(OTA_FIRMWARE_UUID, data, response=False)
+
+    def close(self):
+        pass
+
+class L2capLink:
+    # sends the firmware packets as SDUs on an L2CAP channel, the channel credits pace the writes
+    name = 'l2cap'
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.payload_size = struct.unpack('<H', sock.getsockopt(SOL_BLUETOOTH, BT_SNDMTU, 2))[0] - 3
+
+    async def send(self, data):
+        await asyncio.get_running_loop().sock_sendall(self.sock, data)
+
+    def close(self):
+        self.sock.close()
+
+def connect_l2cap(address, psm):
+    # BlueZ only, the socket module can not set the LE address type so the sockaddr_l2 is passed to connect() directly
+    import ctypes
+    libc = ctypes.CDLL(None, use_errno=True)
+    bdaddr = bytes.fromhex(address.replace(':', ''))[::-1]
+    for address_type in (BDADDR_LE_PUBLIC, BDADDR_LE_RANDOM):
+        sock = socket.socket(socket.AF_BLUETOOTH, socket.SOCK_SEQPACKET, socket.BTPROTO_L2CAP)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDTIMEO, struct.pack('@ll', L2CAP_CONNECT_TIMEOUT, 0))
+        local = struct.pack('<HH6sHBx', socket.AF_BLUETOOTH, 0, bytes(6), 0, BDADDR_LE_PUBLIC)
+        remote = struct.pack('<HH6sHBx', socket.AF_BLUETOOTH, psm, bdaddr, 0, address_type)
+        if (libc.bind(sock.fileno(), local, len(local)) == 0 and
+                libc.connect(sock.fileno(), remote, len(remote)) == 0):
+            sock.setblocking(False)
+            return sock
+        sock.close()
+    raise OSError(ctypes.get_errno(), os.strerror(ctypes.get_errno()))
+
+async def open_link(client, address, psm):
+    # the L2CAP channel the device offered in the start ack, GATT if the host can not open it
+    if psm and hasattr(socket, 'AF_BLUETOOTH') and sys.platform.startswith('linux'):
+        try:
+            sock = await asyncio.get_running_loop().run_in_executor(None, connect_l2cap, address, psm)
+            link = L2capLink(sock)
+            log(f"Using the L2CAP channel, PSM 0x{psm:02x}, MTU {link.payload_size + 3}")
+            return link
+        except (OSError, ValueError) as e:
+            log(f"L2CAP channel failed ({e}), using GATT")
+    return GattLink(client)
+
+async def upload_sector(link, sector, sec_idx, packets=None):
+    max_bytes = link.payload_size
     chunks = [sector[i:i+max_bytes] for i in range(0, len(sector), max_bytes)]
-    for sequence, chunk in enumerate(chunks):
-        if sequence == len(chunks) - 1:
+    for index, chunk in enumerate(chunks):
+        if packets is not None and index not in packets and index != len(chunks) - 1:
+            continue  # only resend the missing packets, followed by the last one
+
+        if index == len(chunks) - 1:
             sequence = 0xFF  # Indicate to peer this is the last chunk of sector
+        else:
+            sequence = (index - 1) % 254 + 1 if index else 0  # wraps from 254 to 1 in large blocks
 
         data = sec_idx.to_bytes(2, byteorder='little')
         data += sequence.to_bytes(1, byteorder='little')
         data += chunk
-        await client.write_gatt_char(OTA_FIRMWARE_UUID, data, response=False)
-
-async def connect_to_device(address, file_size, sectors):
+        await link.send(data)
+
+def parse_target(target):
+    # TYPE[:NAME], TYPE is a sink name or number
+    sink, _, name = target.partition(':')
+    sink = SINK_TYPES[sink] if sink in SINK_TYPES else int(sink)
+    return sink, name.encode()
+
+async def select_target(client, target, queue):
+    # selects the sink the next start command writes to, returns its capacity or None if rejected
+    sink, name = target
+    command = bytearray(TARGET_COMMAND.to_bytes(2, byteorder='little') + bytes([sink]) + name)
+    command += crc16_ccitt(command).to_bytes(2, byteorder='little')
+    while True:
+        await client.write_gatt_char(OTA_COMMAND_UUID, command, response=True)
+        ack, _, _, _, info = await asyncio.wait_for(queue.get(), ACK_TIMEOUT)
+        if ack != RSP_CRC_ERROR:
+            break
+    return int.from_bytes(info[0:4], byteorder='little') if ack == ACK_ACCEPTED else None
+
+def sign_image(key_file, image):
+    # signs the SHA-256 of the image the device writes, ECDSA signatures are DER encoded as the device expects
+    from cryptography.hazmat.primitives import hashes, serialization
+    from cryptography.hazmat.primitives.asymmetric import ec, padding, rsa
+    with open(key_file, 'rb') as file:
+        key = serialization.load_pem_private_key(file.read(), password=None)
+    if isinstance(key, ec.EllipticCurvePrivateKey):
+        return key.sign(image, ec.ECDSA(hashes.SHA256()))
+    if isinstance(key, rsa.RSAPrivateKey):
+        return key.sign(image, padding.PKCS1v15(), hashes.SHA256())
+    raise ValueError("unsupported key type, use an ECDSA or RSA key")
+
+async def send_signature(client, signature, queue):
+    # the device checks the signature against the image it has written before setting it to boot
+    command = bytearray(SIGNATURE_COMMAND.to_bytes(2, byteorder='little') + signature)
+    command += crc16_ccitt(command).to_bytes(2, byteorder='little')
+    while True:
+        await client.write_gatt_char(OTA_COMMAND_UUID, command, response=True)
+        ack, _, _, _, _ = await asyncio.wait_for(queue.get(), ACK_TIMEOUT)
+        if ack != RSP_CRC_ERROR:
+            break
+    return ack == ACK_ACCEPTED
+
+async def sync_sectors(client, firmware, queue, block_size):
+    # sends a hash of each sector, the device keeps or copies the ones it has and returns the ones it needs
+    needed = []
+    sec_count = (len(firmware) + block_size - 1) // block_size
+    per_cmd = max(1, min(SYNC_MAX_HASHES, (client.mtu_size - 3 - 6) // SYNC_HASH_LEN))
+    # the device reads, and may copy, every sector of a command before it acks
+    sync_timeout = ACK_TIMEOUT * max(1, block_size // MIN_BLOCK_SIZE)
+    for first in range(0, sec_count, per_cmd):
+        count = min(per_cmd, sec_count - first)
+        command = bytearray(SYNC_COMMAND.to_bytes(2, byteorder='little') + first.to_bytes(2, byteorder='little'))
+        for sec_idx in range(first, first + count):
+            block = firmware[sec_idx * block_size:(sec_idx + 1) * block_size]
+            command += hashlib.sha256(block).digest()[0:SYNC_HASH_LEN]
+        command += crc16_ccitt(command).to_bytes(2, byteorder='little')
+        while True:
+            await client.write_gatt_char(OTA_COMMAND_UUID, command, response=True)
+            ack, _, _, _, bitmap = await asyncio.wait_for(queue.get(), sync_timeout)
+            if ack == FW_ACK_BUSY:
+                await asyncio.sleep(BUSY_BACKOFF)
+            elif ack != RSP_CRC_ERROR:
+                break
+        if ack != ACK_ACCEPTED:
+            return None
+        needed += [first + i for i in range(count) if bitmap[i // 8] & (1 << (i % 8))]
+    return needed
+
+async def upload_firmware(link, sectors, queue, window, block_size, indexes, progress=None, bench=None):
+    sec_count = len(indexes)
+    positions = {sec_idx: pos for pos, sec_idx in enumerate(indexes)}
+    ack_timeout = ACK_TIMEOUT * block_size // MIN_BLOCK_SIZE
+    base = 0  # oldest sector not acked yet, as a position in indexes
+    next_idx = 0  # next sector to send
+    bench = bench if bench is not None else {}
+    bench['retries'] = 0
+    loop = asyncio.get_running_loop()
+    prepared = {}  # position -> future of the sector, read and CRC'd in a worker thread while the previous ones are sent
+
+    def prepare(pos):
+        for ahead in range(pos, min(pos + PREFETCH_SECTORS + 1, sec_count)):
+            if ahead not in prepared:
+                prepared[ahead] = loop.run_in_executor(None, sectors.__getitem__, indexes[ahead])
+
+    while base < sec_count:
+        while next_idx < sec_count and next_idx - base < window:
+            sec_idx = indexes[next_idx]
+            prepare(next_idx)
+            sector = await prepared.pop(next_idx)
+            prepare(next_idx + 1)
+            log(f"Sector {sec_idx}: {len(sector)} bytes", progress=True)
+            bench.setdefault('first_byte', time.monotonic())
+            await upload_sector(link, sector,
+                                sec_idx if len(sector) == block_size + 2 else 0xFFFF) # send last sector as 0xFFFF
+            next_idx += 1
+
+        try:
+            ack, rsp_sector, missing = await asyncio.wait_for(queue.get(), ack_timeout)
+        except asyncio.TimeoutError:
+            log(f"Ack timeout, resending from sector {indexes[base]}")
+            bench['retries'] += 1
+            next_idx = base
+            continue
+
+        rsp_pos = positions.get(rsp_sector, sec_count)
+
+        if ack == FW_ACK_SUCCESS:
+            # acks are cumulative, rsp_sector is the last sector written
+            base = max(base, rsp_pos + 1)
+            log(round(base / sec_count * 100, 1), '% complete', progress=True)
+            if progress:
+                progress(base / sec_count)
+            continue
+
+        bench['retries'] += 1
+
+        if ack == FW_ACK_CRC_ERROR or ack == FW_ACK_LEN_ERROR:
+            log("Length Error" if ack == FW_ACK_LEN_ERROR else "CRC Error", f"- Retrying from sector {rsp_sector}")
+            base = next_idx = rsp_pos
+
+        elif ack == RSP_CRC_ERROR:
+            log(f"Ack CRC Error - Retrying from sector {indexes[base]}")
+            next_idx = base
+
+        elif ack == FW_ACK_BUSY:
+            log(f"Device busy, resending sector {rsp_sector}")
+            await asyncio.sleep(BUSY_BACKOFF)
+            base = next_idx = rsp_pos
+
+        elif ack == FW_ACK_MISSING and rsp_pos < sec_count:
+            log(f"Resending {len(missing)} missing packets of sector {rsp_sector}")
+            sector = await loop.run_in_executor(None, sectors.__getitem__, rsp_sector)
+            await upload_sector(link, sector, rsp_sector if len(sector) == block_size + 2 else 0xFFFF, set(missing))
+            # the sectors in flight after it were dropped by the device
+            base = rsp_pos
+            next_idx = rsp_pos + 1
+
+        elif ack == FW_ACK_SECTOR_ERROR:
+            log(f"Sector Error, sending sector: {rsp_sector}")
+            base = next_idx = rsp_pos
+
+        else:
+            log("Unknown error")
+            return False
+
+    return True
+
+async def connect_to_device(address, firmware, window, block_size, image_size, flags, base_hash,
+                            adapter=None, progress=None, stats=None, target=None, signature=None, bench=None,
+                            l2cap=True, client_factory=BleakClient):
+    result = RESULT_REJECTED
+    bench = bench if bench is not None else {}
+    bench['start'] = time.monotonic()
     try:
-        async with BleakClient(address) as client:
-            print(f"Connected to {address}")
+        async with client_factory(address, **({'adapter': adapter} if adapter else {})) as client:
+            bench['connected'] = time.monotonic()
+            log(f"Connected to {address}")
             queue = asyncio.Queue()
             await client.start_notify(OTA_COMMAND_UUID, lambda sender,
                                       data: asyncio.create_task(cmd_notification_handler(sender, data, queue)))
-            print("Sending start command")
+            if stats is not None and client.services.get_characteristic(OTA_STATS_UUID):
+                # devices with the statistics characteristic notify them while the update runs
+                await client.start_notify(OTA_STATS_UUID, lambda sender, data: stats.update(parse_stats(data) or {}))
+            if target:
+                capacity = await select_target(client, target, queue)
+                if capacity is None:
+                    log("Target rejected, the device does not support it or can not open it")
+                    await client.disconnect()
+                    return result
+                log(f"Target capacity: {capacity} bytes")
+            if signature and not await send_signature(client, signature, queue):
+                log("Signature rejected, the device has no public key set")
+                await client.disconnect()
+                return result
+            log("Sending start command")
             command = bytearray(20)
             command[0:2] = START_COMMAND.to_bytes(2, byteorder='little')
-            command[2:6] = file_size.to_bytes(4, byteorder='little')
+            command[2:6] = len(firmware).to_bytes(4, byteorder='little')
+            if window > 1:
+                command[6] = START_FLAG_NOTIFY_ACK
+                command[7] = min(window, 255)
+            command[6] |= flags | START_FLAG_SELECTIVE | (((block_size // MIN_BLOCK_SIZE).bit_length() - 1) << START_FLAG_BLOCK_SHIFT)
+            if flags & START_FLAG_COMPRESSED:
+                command[8:12] = image_size.to_bytes(4, byteorder='little')
+            if flags & START_FLAG_DELTA:
+                command[12:18] = base_hash[0:6]
+            elif not flags & START_FLAG_COMPRESSED:
+                # identifies the image so the device can resume it after a reset
+                command[12:18] = hashlib.sha256(firmware).digest()[0:6]
             crc16 = crc16_ccitt(command[0:18])
             command[18:20] = crc16.to_bytes(2, byteorder='little')
             while True:
                 await client.write_gatt_char(OTA_COMMAND_UUID, command)
-                ack = await queue.get()
+                ack, accepted_flags, accepted_window, resume_offset, info = await asyncio.wait_for(queue.get(),
+                                                                                                  ACK_TIMEOUT)
                 if ack != RSP_CRC_ERROR:
                     break
 
-            if ack == ACK_ACCEPTED:
+            if (flags & START_FLAG_COMPRESSED) and not (accepted_flags & START_FLAG_COMPRESSED):
+                log("Device does not support compressed firmware, run without --compress")
+                await client.disconnect()
+            elif (flags & START_FLAG_DELTA) and not (accepted_flags & START_FLAG_DELTA):
+                log("Device does not support delta updates, run without --delta")
+                await client.disconnect()
+            elif (flags & START_FLAG_DELTA) and ack != ACK_ACCEPTED:
+                log("Delta update rejected, the device is not running the base firmware")
+                await client.disconnect()
+            elif (flags & START_FLAG_SYNC) and not (accepted_flags & START_FLAG_SYNC):
+                log("Device does not support sync updates, run without --sync")
+                await client.disconnect()
+            elif ack == ACK_ACCEPTED:
+                window = max(1, accepted_window)
+                # devices without block size support return 0, 4096 bytes
+                block_size = MIN_BLOCK_SIZE << ((accepted_flags >> START_FLAG_BLOCK_SHIFT) & 0x07)
+                sectors = make_sectors(firmware, block_size)
+                log(f"Sector window: {window}, block size: {block_size}")
+                indexes = list(range(resume_offset // block_size, len(sectors)))
+                if resume_offset:
+                    log(f"Resuming at {resume_offset} bytes")
+                if flags & START_FLAG_SYNC:
+                    indexes = await sync_sectors(client, firmware, queue, block_size)
+                    if indexes is None:
+                        log("Sync command rejected")
+                        await client.disconnect()
+                        return result
+                    log(f"Device has {len(sectors) - len(indexes)} of {len(sectors)} sectors")
                 await client.start_notify(OTA_FIRMWARE_UUID, lambda sender,
                                           data: asyncio.create_task(fw_notification_handler(sender, data, queue)))
-                print("Sending firmware...")
-                sec_idx = 0
-                sec_count = len(sectors)
-                while sec_idx < sec_count:
-                    sector = sectors[sec_idx]
-                    print(f"Sector {sec_idx}: {len(sector)} bytes")
-                    await upload_sector(client, sector,
-                                         sec_idx if len(sector) == 4098 else 0xFFFF) # send last sector as 0xFFFF
-                    ack, rsp_sector = await queue.get()
-
-                    if ack == FW_ACK_SUCCESS:
-                        print(round(sec_idx / (sec_count - 1) * 100, 1), '% complete')
-                        if sec_idx == sec_count - 1:
-                            print("OTA update complete")
-                            await client.disconnect()
-                        sec_idx += 1
-                        continue
-
-                    if ack == FW_ACK_CRC_ERROR or ack == FW_ACK_LEN_ERROR or ack == RSP_CRC_ERROR:
-                        print("Length Error" if ack == FW_ACK_LEN_ERROR else "CRC Error", "- Retrying sector")
-
-                    elif ack == FW_ACK_SECTOR_ERROR:
-                        print(f"Sector Error, sending sector: {rsp_sector}")
-                        sec_idx = rsp_sector
-
-                    else:
-                        print("Unknown error")
-                        await client.disconnect()
-                        break
+                # bytes 12 and 13 of the start ack are the PSM of the L2CAP channel the device offers for the firmware
+                psm = int.from_bytes(info[6:8], byteorder='little') if l2cap else 0
+                link = await open_link(client, address, psm) if indexes else GattLink(client)
+                bench['link'] = link.name
+                log("Sending firmware...")
+                result = RESULT_FAILED
+                sent = sum(min(block_size, len(firmware) - i * block_size) for i in indexes)
+                try:
+                    if await upload_firmware(link, sectors, queue, window, block_size, indexes, progress, bench):
+                        log("OTA update complete")
+                        result = RESULT_OK
+                        bench['done'] = time.monotonic()
+                        bench['bytes'] = sent
+                finally:
+                    link.close()
+                if stats:
+                    log(f"Device stats: {stats['bytes_per_sec'] / 1024:.1f} KB/s, MTU {stats['mtu']}, "
+                        f"sector {stats['sector_ms_avg']} ms, flash {stats['flash_ms_avg']} ms, "
+                        f"{stats['retransmits']} retransmits, {stats['crc_errors']} crc errors")
+                await client.disconnect()
             else:
-                print("Start command rejected")
+                log("Start command rejected")
                 await client.disconnect()
 
     except Exception as e:
-        print(f"{e}")
+        log(f"{e}")
+        if result != RESULT_OK:
+            result = RESULT_FAILED
+
+    return result
+
+def bench_summary(bench):
+    # the timing recorded by connect_to_device, None if the transfer did not complete
+    if 'done' not in bench:
+        return None
+    transfer = bench['done'] - bench.get('first_byte', bench['done'])
+    return {'connect_s': round(bench['connected'] - bench['start'], 2),
+            'first_byte_s': round(bench.get('first_byte', bench['done']) - bench['start'], 2),
+            'transfer_s': round(transfer, 2),
+            'goodput': round(bench['bytes'] / transfer) if transfer > 0 else 0,
+            'retries': bench['retries'], 'link': bench.get('link', 'gatt')}
+
+def format_bench(summary):
+    return (f"connect {summary['connect_s']:.2f}s, first byte {summary['first_byte_s']:.2f}s, "
+            f"transfer {summary['transfer_s']:.2f}s, goodput {summary['goodput'] / 1024:.1f} KB/s, "
+            f"{summary['retries']} retries over {summary['link'].upper()}")
+
+async def scan_fleet(scan_time, name_filter, adapters, scanner_factory=BleakScanner):
+    # scans on every adapter at once, a device seen by several adapters is updated once
+    addresses = {}
+
+    def detection_callback(device, advertisement_data):
+        if device.address not in addresses and (not name_filter or (device.name or '').startswith(name_filter)):
+            log(f"Detected device: {device.name} - {device.address}")
+            addresses[device.address] = device.name
+
+    scanners = [scanner_factory(detection_callback, [OTA_SERVICE_UUID], **({'adapter': adapter} if adapter else {}))
+                for adapter in adapters]
+    for scanner in scanners:
+        await scanner.start()
+    await asyncio.sleep(scan_time)
+    for scanner in scanners:
+        await scanner.stop()
+    return list(addresses)
+
+def fleet_summary(file_name, firmware, results, seconds):
+    # the --results JSON of a fleet update
+    ok = sum(1 for r in results if r['result'] == RESULT_OK)
+    return {'file': file_name, 'size': len(firmware), 'ok': ok, 'failed': len(results) - ok,
+            'seconds': round(seconds, 1), 'devices': results}
+
+def format_eta(seconds):
+    return f"{int(seconds) // 60}m{int(seconds) % 60:02d}s"
+
+async def update_fleet(addresses, firmware, window, block_size, image_size, flags, base_hash, adapters=(None,),
+                       concurrency=3, retries=2, backoff=5.0, target=None, signature=None, l2cap=True,
+                       client_factory=BleakClient):
+    """
+    Updates the devices in addresses, up to concurrency at a time on each adapter.
+    A failed device is retried after backoff seconds, doubled for each further attempt.
+    Returns a list of dicts with the result of each device.
+    """
+    pending = asyncio.Queue()
+    target = parse_target(target) if target else None
+    for address in addresses:
+        pending.put_nowait(address)
+    done = {}  # fraction of the image each device has acknowledged
+    results = []
+    start = time.monotonic()
+
+    def report():
+        elapsed = time.monotonic() - start
+        sent = sum(done.values()) * len(firmware)
+        rate = sent / elapsed if elapsed else 0
+        finished = {r['address'] for r in results}
+        remaining = (len(addresses) - len(finished) - sum(v for a, v in done.items() if a not in finished)) * len(firmware)
+        ok = sum(1 for r in results if r['result'] == RESULT_OK)
+        eta = format_eta(remaining / rate) if rate else "-"
+        print(f"Fleet: {ok} ok, {len(finished) - ok} failed, {len(addresses) - len(finished)} remaining, "
+              f"{rate / 1024:.1f} KB/s, ETA {eta}")
+
+    async def worker(adapter):
+        while not pending.empty():
+            address = pending.get_nowait()
+            log_device.set(address)
+            device_start = time.monotonic()
+            for attempt in range(1, retries + 2):
+                done[address] = 0
+                stats = {}
+                bench = {}
+
+                def progress(fraction):
+                    done[address] = fraction
+
+                result = await connect_to_device(address, firmware, window, block_size, image_size, flags, base_hash,
+                                                 adapter, progress, stats, target, signature, bench, l2cap,
+                                                 client_factory)
+                if result != RESULT_FAILED or attempt > retries:
+                    break
+                delay = backoff * (2 ** (attempt - 1))
+                log(f"Attempt {attempt} failed, retrying in {delay:g}s")
+                await asyncio.sleep(delay)
+
+            done[address] = 1 if result == RESULT_OK else 0
+            results.append({'address': address, 'adapter': adapter, 'result': result, 'attempts': attempt,
+                            'seconds': round(time.monotonic() - device_start, 1),
+                            'bytes': len(firmware) if result == RESULT_OK else 0, 'stats': stats or None,
+                            'bench': bench_summary(bench)})
+
+    async def reporter():
+        while True:
+            await asyncio.sleep(FLEET_REPORT_INTERVAL)
+            report()
+
+    reporter_task = asyncio.create_task(reporter())
+    try:
+        await asyncio.gather(*[worker(adapter) for adapter in adapters for _ in range(concurrency)])
+    finally:
+        reporter_task.cancel()
+    report()
+    return results
 
 async def main():
     devices = []
@@ -148,7 +711,9 @@ async def main():
     try:
         args = parse_args()
         file_name = args.file_name
-        mac_address = args.mac_address
+        addresses = list(args.mac_address)
+        adapters = args.adapter or [None]
+        fleet = len(addresses) > 1 or args.fleet_file or args.fleet_scan
 
         if not file_name:
             file_name = input("Enter the file name for the OTA update: ")
@@ -162,19 +727,76 @@ async def main():
             print('Invalid file size %d' % (file_size))
             sys.exit()
 
-        sectors = []
-        with open(file_name, 'rb') as file:
-            while True:
-                sector = file.read(4096)
-                if not sector:
-                    break
-                sector += crc16_ccitt(sector).to_bytes(2, byteorder='little')
-                sectors.append(sector)
+        firmware = open_image(file_name)
+
+        signature = None
+        if args.signature:
+            with open(args.signature, 'rb') as file:
+                signature = file.read()
+        elif args.sign:
+            signature = sign_image(args.sign, firmware)
+
+        flags = 0
+        base_hash = None
+        if args.delta:
+            with open(args.delta, 'rb') as file:
+                base = file.read()
+            base_hash = image_hash(base)
+            firmware = make_delta_patch(base, bytes(firmware))
+            flags |= START_FLAG_DELTA
+            args.compress = True  # the patch is mostly zeros for unchanged data
+
+        if args.target and (args.delta or args.sync):
+            print("--target cannot be combined with --delta or --sync")
+            sys.exit()
 
-        if not mac_address:
-            async with BleakScanner(detection_callback, [OTA_SERVICE_UUID]):
+        if args.sync:
+            if signature:
+                print("--sync cannot be combined with a signature")
+                sys.exit()
+            if args.compress or args.delta:
+                print("--sync cannot be combined with --compress or --delta")
+                sys.exit()
+            flags |= START_FLAG_SYNC
+
+        image_size = len(firmware)
+        if args.compress:
+            firmware = zlib.compress(firmware, 9)
+            file_size = len(firmware)
+            flags |= START_FLAG_COMPRESSED
+            print(f"Compressed {image_size} bytes to {file_size} ({file_size * 100 // image_size}%)")
+
+        if args.fleet_file:
+            with open(args.fleet_file) as file:
+                addresses += [line.strip() for line in file if line.strip() and not line.startswith('#')]
+
+        if args.fleet_scan:
+            print("Scanning for devices...")
+            addresses += [a for a in await scan_fleet(args.scan_time, args.name_filter, adapters) if a not in addresses]
+
+        if fleet:
+            if not addresses:
+                print("No devices found")
+                return
+            print(f"Updating {len(addresses)} devices, {args.concurrency} at a time on {len(adapters)} adapter(s)")
+            start = time.monotonic()
+            results = await update_fleet(addresses, firmware, args.window, args.block_size, image_size, flags,
+                                         base_hash, adapters, max(1, args.concurrency), args.retries, args.backoff,
+                                         args.target, signature, not args.no_l2cap)
+            for result in results:
+                if result['result'] != RESULT_OK:
+                    print(f"{result['address']}: {result['result']} after {result['attempts']} attempt(s)")
+                elif args.bench and result['bench']:
+                    print(f"{result['address']}: {format_bench(result['bench'])}")
+            if args.results:
+                with open(args.results, 'w') as file:
+                    json.dump(fleet_summary(file_name, firmware, results, time.monotonic() - start), file, indent=2)
+            return
+
+        if not addresses:
+            async with BleakScanner(detection_callback, [OTA_SERVICE_UUID], **({'adapter': adapters[0]} if adapters[0] else {})):
                 print("Scanning for devices...")
-                await asyncio.sleep(5)
+                await asyncio.sleep(args.scan_time)
                 for dev_num, device in enumerate(devices):
                     print(f"Option {dev_num + 1}: {device.name} - {device.address}")
 
@@ -197,11 +819,18 @@ async def main():
 
                 device = devices[dev_num - 1]  # Adjust for 0-based index
                 print(f"Selected: {device.name} - {device.address}")
-                mac_address = device.address
+                addresses = [device.address]
 
-        await connect_to_device(mac_address, file_size, sectors)
+        bench = {}
+        await connect_to_device(addresses[0], firmware, args.window, args.block_size, image_size, flags, base_hash,
+                                adapters[0], stats={}, target=parse_target(args.target) if args.target else None,
+                                signature=signature, bench=bench, l2cap=not args.no_l2cap)
+        summary = bench_summary(bench)
+        if args.bench and summary:
+            print(f"Bench: {format_bench(summary)}")
 
     except:
         sys.exit(0)
 
-asyncio.run(main())
+if __name__ == "__main__":
+    asyncio.run(main())
@@ -0,0 +1,260 @@
+# Copyright 2025 Ryan Powell and NimBLEOta contributors
+# Sponsored by Theengs https://www.theengs.io, https://github.com/theengs
+# MIT License
+
+# Checks the fleet mode of nimbleota.py without a Bluetooth adapter: update_fleet and scan_fleet run against fake
+# clients and scanners, each fake device receives the image the way NimBLEOtaCore does and can be scripted to fail
+# connections, reject the start command, report busy or crc errors or lose an ack. Run with `make fleetcheck`.
+
+import asyncio
+import contextlib
+import io
+import json
+import os
+import random
+import sys
+import time
+import types
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+try:
+    import bleak  # noqa: F401
+except ImportError:
+    # only the names nimbleota.py imports, the fakes below replace the client and the scanner
+    bleak = types.ModuleType('bleak')
+    bleak.uuids = types.SimpleNamespace(normalize_uuid_16=lambda uuid: f"0000{uuid:04x}-0000-1000-8000-00805f9b34fb")
+    bleak.BleakClient = bleak.BleakScanner = None
+    sys.modules['bleak'] = bleak
+
+import nimbleota as ota
+
+IMAGE_SIZE = 64 * 1024 + 1000  # a short last sector
+MTU = 247
+ADAPTERS = ('hci0', 'hci1')
+CONCURRENCY = 2
+RETRIES = 2
+BACKOFF = 0.05
+
+
+def with_crc(data):
+    return bytes(data) + ota.crc16_ccitt(data).to_bytes(2, byteorder='little')
+
+
+class FakeDevice:
+    # a target following the NimBLEOtaCore protocol, failures are scripted by name and happen once unless noted
+    def __init__(self, address, name, script=()):
+        self.address = address
+        self.name = name
+        self.script = set(script)
+        self.connect_failures = 2 if 'flaky' in self.script else 0
+        self.connects = []  # time of each connection attempt
+        self.image = bytearray()
+
+    def fail(self, event):
+        if event in self.script:
+            self.script.discard(event)
+            return True
+        return False
+
+
+class FakeClient:
+    # the subset of BleakClient nimbleota.py uses, bound to a FakeDevice
+    active = {}  # adapter -> clients connected
+    peak = {}  # adapter -> most clients connected at once
+
+    def __init__(self, device, adapter=None):
+        self.device = device
+        self.adapter = adapter
+        self.mtu_size = MTU
+        self.services = types.SimpleNamespace(get_characteristic=lambda uuid: uuid == ota.OTA_STATS_UUID or None)
+        self.callbacks = {}
+
+    async def __aenter__(self):
+        self.device.connects.append(time.monotonic())
+        await asyncio.sleep(0.01)
+        if self.device.connect_failures or 'dead' in self.device.script:
+            self.device.connect_failures = max(0, self.device.connect_failures - 1)
+            raise OSError(f"failed to connect to {self.device.address}")
+        FakeClient.active[self.adapter] = FakeClient.active.get(self.adapter, 0) + 1
+        FakeClient.peak[self.adapter] = max(FakeClient.peak.get(self.adapter, 0), FakeClient.active[self.adapter])
+        return self
+
+    async def __aexit__(self, *exc):
+        FakeClient.active[self.adapter] -= 1
+
+    async def start_notify(self, uuid, callback):
+        self.callbacks[uuid] = callback
+
+    async def disconnect(self):
+        pass
+
+    def notify(self, uuid, data):
+        if uuid in self.callbacks:
+            asyncio.get_running_loop().call_soon(self.callbacks[uuid], None, bytearray(data))
+
+    async def write_gatt_char(self, uuid, data, response=True):
+        await asyncio.sleep(0)
+        if uuid == ota.OTA_COMMAND_UUID:
+            self.command(bytes(data))
+        elif uuid == ota.OTA_FIRMWARE_UUID:
+            self.firmware(bytes(data))
+
+    def command(self, data):
+        cmd = int.from_bytes(data[0:2], byteorder='little')
+        if cmd != ota.START_COMMAND:
+            return
+        self.file_len = int.from_bytes(data[2:6], byteorder='little')
+        self.window = min(data[7], 4) if data[6] & ota.START_FLAG_NOTIFY_ACK else 1
+        self.sectors = (self.file_len + ota.MIN_BLOCK_SIZE - 1) // ota.MIN_BLOCK_SIZE
+        self.sector = 0
+        self.received = bytearray()
+        self.device.image = bytearray()
+        rsp = ota.ACK_REJECTED if 'reject' in self.device.script else ota.ACK_ACCEPTED
+        ack = bytearray(18)
+        ack[0:2] = ota.ACK_COMMAND.to_bytes(2, byteorder='little')
+        ack[2:4] = cmd.to_bytes(2, byteorder='little')
+        ack[4:6] = rsp.to_bytes(2, byteorder='little')
+        ack[6] = ota.START_FLAG_NOTIFY_ACK if self.window > 1 else 0  # 4096 byte blocks
+        ack[7] = self.window
+        self.notify(ota.OTA_COMMAND_UUID, with_crc(ack))
+
+    def firmware(self, data):
+        recv_sector = int.from_bytes(data[0:2], byteorder='little')
+        recv_sector = self.sectors - 1 if recv_sector == 0xFFFF else recv_sector
+        if data[2] == 0:
+            self.received = bytearray()
+        self.received += data[3:]
+        if data[2] != 0xFF:
+            return
+
+        sector, self.received = self.received, bytearray()
+        if recv_sector < self.sector:
+            self.ack(recv_sector, ota.FW_ACK_SUCCESS, recv_sector)  # resent after a lost ack, already written
+        elif recv_sector > self.sector:
+            pass  # in flight when the error ack was sent, the client resends from the sector acked
+        elif self.device.fail('busy'):
+            self.ack(recv_sector, ota.FW_ACK_BUSY, self.sector)
+        elif self.device.fail('crc') or ota.crc16_ccitt(sector[:-2]) != int.from_bytes(sector[-2:], 'little'):
+            self.ack(recv_sector, ota.FW_ACK_CRC_ERROR, self.sector)
+        else:
+            self.device.image += sector[:-2]
+            self.sector += 1
+            if self.sector == self.sectors:
+                self.send_stats()
+            if not (self.sector == self.sectors and self.device.fail('lost_ack')):
+                self.ack(recv_sector, ota.FW_ACK_SUCCESS, recv_sector)
+
+    def ack(self, recv_sector, status, sector):
+        ack = bytearray(18)
+        ack[0:2] = recv_sector.to_bytes(2, byteorder='little')
+        ack[2:4] = status.to_bytes(2, byteorder='little')
+        ack[4:6] = sector.to_bytes(2, byteorder='little')
+        self.notify(ota.OTA_FIRMWARE_UUID, with_crc(ack))
+
+    def send_stats(self):
+        stats = bytearray(42)
+        stats[0] = 1
+        stats[2:6] = len(self.device.image).to_bytes(4, byteorder='little')
+        stats[18:20] = self.sectors.to_bytes(2, byteorder='little')
+        stats[30:32] = MTU.to_bytes(2, byteorder='little')
+        self.notify(ota.OTA_STATS_UUID, stats)
+
+
+class FakeScanner:
+    # the subset of BleakScanner scan_fleet uses, every adapter sees every device
+    def __init__(self, devices, callback, service_uuids, adapter=None):
+        self.devices = devices
+        self.callback = callback
+
+    async def start(self):
+        for device in self.devices:
+            self.callback(types.SimpleNamespace(address=device.address, name=device.name), None)
+
+    async def stop(self):
+        pass
+
+
+def check(failures, condition, message):
+    if not condition:
+        failures.append(message)
+
+
+async def run_checks():
+    firmware = random.Random(1).randbytes(IMAGE_SIZE)
+    devices = [FakeDevice(f"AA:00:00:00:00:{i:02X}", f"node-{i}") for i in range(6)]
+    devices += [FakeDevice("AA:00:00:00:01:00", "node-busy", ['busy']),
+                FakeDevice("AA:00:00:00:01:01", "node-crc", ['crc']),
+                FakeDevice("AA:00:00:00:01:02", "node-lost-ack", ['lost_ack']),
+                FakeDevice("AA:00:00:00:01:03", "node-flaky", ['flaky']),
+                FakeDevice("AA:00:00:00:01:04", "node-dead", ['dead']),
+                FakeDevice("AA:00:00:00:01:05", "node-reject", ['reject']),
+                FakeDevice("AA:00:00:00:02:00", "other")]
+    by_address = {d.address: d for d in devices}
+    failures = []
+    ota.ACK_TIMEOUT = 1.0  # the lost ack is resent after it, whole seconds as the timeout is scaled by floor division
+
+    addresses = await ota.scan_fleet(0, 'node', ADAPTERS,
+                                     lambda callback, uuids, **kw: FakeScanner(devices, callback, uuids, **kw))
+    check(failures, sorted(addresses) == sorted(d.address for d in devices if d.name.startswith('node')),
+          f"scan_fleet found {addresses}")
+
+    start = time.monotonic()
+    results = await ota.update_fleet(addresses, firmware, 4, ota.MIN_BLOCK_SIZE, len(firmware), 0, None, ADAPTERS,
+                                     CONCURRENCY, RETRIES, BACKOFF,
+                                     client_factory=lambda address, **kw: FakeClient(by_address[address], **kw))
+    summary = json.loads(json.dumps(ota.fleet_summary('image.bin', firmware, results, time.monotonic() - start)))
+
+    check(failures, all(FakeClient.peak.get(a, 0) == CONCURRENCY for a in ADAPTERS),
+          f"peak connections per adapter {FakeClient.peak}, expected {CONCURRENCY}")
+    check(failures, len(summary['devices']) == len(addresses) and summary['size'] == len(firmware),
+          f"{len(summary['devices'])} results for {len(addresses)} devices")
+    check(failures, summary['ok'] == len(addresses) - 2 and summary['failed'] == 2,
+          f"{summary['ok']} ok, {summary['failed']} failed")
+    for result in summary['devices']:
+        device = by_address[result['address']]
+        expected = ({'dead': ota.RESULT_FAILED, 'reject': ota.RESULT_REJECTED}.get(device.name[5:], ota.RESULT_OK))
+        check(failures, result['result'] == expected, f"{device.name}: {result['result']}, expected {expected}")
+        check(failures, result['adapter'] in ADAPTERS, f"{device.name}: adapter {result['adapter']}")
+        if expected == ota.RESULT_OK:
+            check(failures, device.image == firmware, f"{device.name}: image differs")
+            check(failures, result['bytes'] == len(firmware) and result['bench'] is not None,
+                  f"{device.name}: bytes {result['bytes']}, bench {result['bench']}")
+            check(failures, result['stats'] and result['stats']['bytes_written'] == len(firmware),
+                  f"{device.name}: stats {result['stats']}")
+        if device.name in ('node-busy', 'node-crc', 'node-lost-ack'):
+            check(failures, result['bench'] and result['bench']['retries'] == 1,
+                  f"{device.name}: bench {result['bench']}, expected 1 retry")
+        if device.name in ('node-flaky', 'node-dead'):
+            # retried after the back-off, doubled for each further attempt
+            gaps = [b - a for a, b in zip(device.connects, device.connects[1:])]
+            check(failures, result['attempts'] == RETRIES + 1 and len(gaps) == RETRIES,
+                  f"{device.name}: {result['attempts']} attempts, {len(device.connects)} connections")
+            check(failures, all(gap >= BACKOFF * 2 ** i for i, gap in enumerate(gaps)),
+                  f"{device.name}: retried after {[round(g, 3) for g in gaps]}s")
+        elif device.name == 'node-reject':
+            check(failures, result['attempts'] == 1, f"{device.name}: {result['attempts']} attempts, not retried")
+
+    return summary, failures
+
+
+def main():
+    output = io.StringIO()
+    with contextlib.redirect_stdout(output):
+        summary, failures = asyncio.run(run_checks())
+
+    print(f"fleet check: {len(summary['devices'])} devices, {len(ADAPTERS)} adapters, {CONCURRENCY} at a time, "
+          f"{summary['ok']} ok, {summary['failed']} failed, peak connections {FakeClient.peak}")
+    for result in summary['devices']:
+        retries = result['bench']['retries'] if result['bench'] else '-'
+        print(f"  {result['address']}  {result['adapter']}  {result['result']:<8} attempts {result['attempts']}  "
+              f"retries {retries}")
+    if failures:
+        print(output.getvalue())
+        for failure in failures:
+            print(f"FAILED: {failure}")
+        sys.exit(1)
+    print("ok")
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,139 @@
+# Copyright 2025 Ryan Powell and NimBLEOta contributors
+# Sponsored by Theengs https://www.theengs.io, https://github.com/theengs
+# MIT License
+
+# Decodes a NimBLEOta trace, a console capture with the NBOTA-TRACE lines printed by NimBLEOta::dumpTrace()
+# or the binary records read with NimBLEOtaCore::getTrace(), into a timeline and the latency of each stage.
+
+import argparse
+import struct
+import sys
+
+RECORD = struct.Struct('<IBBHI')
+TRACE_PREFIX = 'NBOTA-TRACE '
+EVENTS = {1: 'packet', 2: 'sector', 3: 'crc', 4: 'flash', 5: 'flashed', 6: 'ack', 7: 'command', 8: 'error'}
+ACK_STATUS = {0: 'ok', 1: 'crc error', 2: 'index error', 3: 'length error', 4: 'busy', 5: 'missing'}
+REASONS = {2: 'disconnected', 4: 'flash error', 5: 'length error', 7: 'verify error'}
+STAGES = [('receive', 'first packet to the sector queued'),
+          ('verify', 'queued to crc checked'),
+          ('queue', 'crc checked to flash write'),
+          ('flash', 'flash write'),
+          ('ack', 'queued to ack sent')]
+
+
+def load_records(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    if TRACE_PREFIX.encode() in data:
+        raw = bytearray()
+        for line in data.decode(errors='replace').splitlines():
+            pos = line.find(TRACE_PREFIX)
+            if pos >= 0:
+                raw += bytes.fromhex(line[pos + len(TRACE_PREFIX):].strip())
+        data = bytes(raw)
+
+    events = []
+    last = None
+    time_us = 0
+    for t, event, arg, sector, value in RECORD.iter_unpack(data[:len(data) - len(data) % RECORD.size]):
+        # the device keeps the low 32 bits of the time, unwrap it
+        time_us += (t - last) & 0xffffffff if last is not None else 0
+        last = t
+        events.append((time_us, event, arg, sector, value))
+    return events
+
+
+def describe(event, arg, sector, value):
+    name = EVENTS.get(event, f'event {event}')
+    if event == 1:
+        return f'{name:8} sector {sector:5} seq {arg:3} {value} bytes'
+    if event == 2:
+        return f'{name:8} sector {sector:5} {value} bytes{" last" if arg else ""}'
+    if event == 3:
+        return f'{name:8} sector {sector:5} {"ok" if arg else "failed or dropped"}'
+    if event == 4:
+        return f'{name:8} sector {sector:5}'
+    if event == 5:
+        return f'{name:8} sector {sector:5}{f" error 0x{value:x}" if arg else ""}'
+    if event == 6:
+        return f'{name:8} sector {sector:5} {ACK_STATUS.get(arg, arg)}, continue at {value}'
+    if event == 7:
+        return f'{name:8} 0x{sector:04x} {"accepted" if arg else "rejected"}, {value} bytes'
+    if event == 8:
+        return f'{name:8} {REASONS.get(arg, arg)} at sector {sector}, error 0x{value:x}'
+    return f'{name:8} sector {sector} arg {arg} value {value}'
+
+
+def stage_times(events):
+    # The time of each stage of the sectors, from the events of the same sector
+    stages = {name: [] for name, _ in STAGES}
+    queued = {}
+    verified = {}
+    flash_start = {}
+    first_packet = None
+    for time_us, event, arg, sector, value in events:
+        if event == 1 and first_packet is None:
+            first_packet = time_us
+        elif event == 2:
+            if first_packet is not None:
+                stages['receive'].append(time_us - first_packet)
+            first_packet = None
+            queued[sector] = time_us
+        elif event == 3 and arg and sector in queued:
+            stages['verify'].append(time_us - queued[sector])
+            verified[sector] = time_us
+        elif event == 4:
+            flash_start[sector] = time_us
+            if sector in verified:
+                stages['queue'].append(time_us - verified.pop(sector))
+        elif event == 5 and sector in flash_start:
+            stages['flash'].append(time_us - flash_start.pop(sector))
+        elif event == 6 and arg == 0 and value in queued:
+            stages['ack'].append(time_us - queued[value])
+    return stages
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decodes a NimBLEOta trace")
+    parser.add_argument("file_name", help="A console capture with NBOTA-TRACE lines or a binary trace")
+    parser.add_argument("--timeline", action="store_true", help="Print every event")
+    args = parser.parse_args()
+
+    events = load_records(args.file_name)
+    if not events:
+        print("No trace events found")
+        sys.exit(1)
+
+    if args.timeline:
+        for time_us, event, arg, sector, value in events:
+            print(f'{(time_us - events[0][0]) / 1000:10.3f} ms  {describe(event, arg, sector, value)}')
+        print()
+
+    counts = {}
+    for _, event, arg, _, value in events:
+        counts[event] = counts.get(event, 0) + 1
+    span = (events[-1][0] - events[0][0]) / 1e6
+    written = sum(e[4] for e in events if e[1] == 2)
+    errors = [e for e in events if (e[1] == 6 and e[2] != 0) or e[1] == 8 or (e[1] == 5 and e[2])]
+    print(f'{len(events)} events over {span:.3f}s: ' +
+          ', '.join(f'{counts[e]} {EVENTS.get(e, e)}' for e in sorted(counts)))
+    if span > 0 and written:
+        print(f'{written} bytes queued, {written / span / 1024:.1f} KB/s')
+    if errors:
+        print(f'{len(errors)} errors, first: {describe(*errors[0][1:])}')
+
+    print(f'\n{"stage":8} {"count":>6} {"avg us":>9} {"p50 us":>9} {"p95 us":>9} {"max us":>9}')
+    for (name, desc), values in zip(STAGES, stage_times(events).values()):
+        if values:
+            values.sort()
+            print(f'{name:8} {len(values):6} {sum(values) / len(values):9.0f} {percentile(values, 50):9} '
+                  f'{percentile(values, 95):9} {values[-1]:9}  {desc}')
+
+
+if __name__ == "__main__":
+    main()